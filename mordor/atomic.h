@@ -275,10 +275,20 @@ private:
 inline void compilerReadWriteBarrier() { _ReadWriteBarrier(); }
 inline void compilerReadBarrier() { _ReadBarrier(); }
 inline void compilerWriteBarrier() { _WriteBarrier(); }
+/// Tell the CPU we're in a spin-wait loop
+inline void cpuRelax() { _mm_pause(); }
 #elif defined (__GNUC__)
 inline void compilerReadWriteBarrier() { __asm__ __volatile__ ("" ::: "memory"); }
 inline void compilerReadBarrier() { compilerReadWriteBarrier(); }
 inline void compilerWriteBarrier() { compilerReadWriteBarrier(); }
+/// Tell the CPU we're in a spin-wait loop
+#if defined(__i386__) || defined(__x86_64__)
+inline void cpuRelax() { __asm__ __volatile__ ("pause" ::: "memory"); }
+#elif defined(__aarch64__)
+inline void cpuRelax() { __asm__ __volatile__ ("yield" ::: "memory"); }
+#else
+inline void cpuRelax() { compilerReadWriteBarrier(); }
+#endif
 #endif
 
 }
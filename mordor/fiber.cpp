@@ -8,13 +8,16 @@
 #include "mordor/config.h"
 #include "exception.h"
 #include "statistics.h"
+#include "thread.h"
 #include "version.h"
 
 #ifdef WINDOWS
+#include <malloc.h>
 #include <windows.h>
 
 #include "runtime_linking.h"
 #else
+#include <stdlib.h>
 #include <sys/mman.h>
 #include <pthread.h>
 #endif
@@ -27,9 +30,34 @@ static AverageMinMaxStatistic<unsigned int> &g_statAlloc =
 static AverageMinMaxStatistic<unsigned int> &g_statFree=
     Statistics::registerStatistic("fiber.freestack",
     AverageMinMaxStatistic<unsigned int>("us"));
-static volatile unsigned int g_cntFibers = 0; // Active fibers
+static CountStatistic<unsigned int> &g_statFibers =
+    Statistics::registerStatistic("fiber.live",
+    CountStatistic<unsigned int>(), "fibers currently in existence");
 static MaxStatistic<unsigned int> &g_statMaxFibers=Statistics::registerStatistic("fiber.max",
     MaxStatistic<unsigned int>());
+static PerThreadCountStatistic<unsigned long long> &g_statCreated =
+    Statistics::registerStatistic("fiber.created",
+    PerThreadCountStatistic<unsigned long long>());
+static PerThreadCountStatistic<unsigned long long> &g_statDestroyed =
+    Statistics::registerStatistic("fiber.destroyed",
+    PerThreadCountStatistic<unsigned long long>());
+static PerThreadCountStatistic<unsigned long long> &g_statSwitches =
+    Statistics::registerStatistic("fiber.switches",
+    PerThreadCountStatistic<unsigned long long>(), "context switches");
+#ifdef POSIX
+static CountStatistic<unsigned long long> &g_statPoolHits =
+    Statistics::registerStatistic("fiber.stackpool.hits",
+    CountStatistic<unsigned long long>());
+static CountStatistic<unsigned long long> &g_statPoolMisses =
+    Statistics::registerStatistic("fiber.stackpool.misses",
+    CountStatistic<unsigned long long>());
+static CountStatistic<unsigned long long> &g_statPoolTrims =
+    Statistics::registerStatistic("fiber.stackpool.trims",
+    CountStatistic<unsigned long long>());
+static AverageMinMaxStatistic<unsigned int> &g_statHighWater =
+    Statistics::registerStatistic("fiber.stackhighwater",
+    AverageMinMaxStatistic<unsigned int>("bytes"));
+#endif
 
 #ifdef SETJMP_FIBERS
 #ifdef OSX
@@ -40,6 +68,82 @@ static MaxStatistic<unsigned int> &g_statMaxFibers=Statistics::registerStatistic
 
 static size_t g_pagesize;
 
+#ifdef ASM_FIBERS
+// Saves the callee-saved registers on the current stack, stores the stack
+// pointer in *from, and restores the registers saved on the stack at to.
+// The frame layout must match what Fiber::initStack() builds.
+extern "C" void mordor_fiber_switch(void **from, void *to);
+
+#ifdef X86_64
+__asm__ (
+    ".text\n"
+    ".globl mordor_fiber_switch\n"
+    ".hidden mordor_fiber_switch\n"
+    ".type mordor_fiber_switch,@function\n"
+    ".align 16\n"
+"mordor_fiber_switch:\n"
+    "pushq %rbp\n"
+    "pushq %rbx\n"
+    "pushq %r12\n"
+    "pushq %r13\n"
+    "pushq %r14\n"
+    "pushq %r15\n"
+    "subq $8, %rsp\n"
+    "stmxcsr (%rsp)\n"
+    "fnstcw 4(%rsp)\n"
+    "movq %rsp, (%rdi)\n"
+    "movq %rsi, %rsp\n"
+    "ldmxcsr (%rsp)\n"
+    "fldcw 4(%rsp)\n"
+    "addq $8, %rsp\n"
+    "popq %r15\n"
+    "popq %r14\n"
+    "popq %r13\n"
+    "popq %r12\n"
+    "popq %rbx\n"
+    "popq %rbp\n"
+    "ret\n"
+    ".size mordor_fiber_switch,.-mordor_fiber_switch\n"
+);
+#elif defined(AARCH64)
+__asm__ (
+    ".text\n"
+    ".globl mordor_fiber_switch\n"
+    ".hidden mordor_fiber_switch\n"
+    ".type mordor_fiber_switch,%function\n"
+    ".align 4\n"
+"mordor_fiber_switch:\n"
+    "sub sp, sp, #0xa0\n"
+    "stp x19, x20, [sp, #0x00]\n"
+    "stp x21, x22, [sp, #0x10]\n"
+    "stp x23, x24, [sp, #0x20]\n"
+    "stp x25, x26, [sp, #0x30]\n"
+    "stp x27, x28, [sp, #0x40]\n"
+    "stp x29, x30, [sp, #0x50]\n"
+    "stp d8, d9, [sp, #0x60]\n"
+    "stp d10, d11, [sp, #0x70]\n"
+    "stp d12, d13, [sp, #0x80]\n"
+    "stp d14, d15, [sp, #0x90]\n"
+    "mov x2, sp\n"
+    "str x2, [x0]\n"
+    "mov sp, x1\n"
+    "ldp x19, x20, [sp, #0x00]\n"
+    "ldp x21, x22, [sp, #0x10]\n"
+    "ldp x23, x24, [sp, #0x20]\n"
+    "ldp x25, x26, [sp, #0x30]\n"
+    "ldp x27, x28, [sp, #0x40]\n"
+    "ldp x29, x30, [sp, #0x50]\n"
+    "ldp d8, d9, [sp, #0x60]\n"
+    "ldp d10, d11, [sp, #0x70]\n"
+    "ldp d12, d13, [sp, #0x80]\n"
+    "ldp d14, d15, [sp, #0x90]\n"
+    "add sp, sp, #0xa0\n"
+    "ret\n"
+    ".size mordor_fiber_switch,.-mordor_fiber_switch\n"
+);
+#endif
+#endif
+
 namespace {
 
 static struct FiberInitializer {
@@ -67,6 +171,147 @@ static ConfigVar<size_t>::ptr g_defaultStackSize = Config::lookup<size_t>(
     "Default stack size for new fibers.  This is the virtual size; physical "
     "memory isn't consumed until it is actually referenced.");
 
+#ifdef POSIX
+static ConfigVar<bool>::ptr g_stackGuard = Config::lookup(
+    "fiber.stackguard", false,
+    "Reserve new fiber stacks without committing swap (MAP_NORESERVE), with "
+    "an inaccessible guard page below each one, so that stacks can be sized "
+    "generously and overflows fault instead of corrupting memory.  The "
+    "high-water mark of each guarded stack is recorded in the "
+    "fiber.stackhighwater statistic as it is freed.  Note that each guarded "
+    "stack uses two memory mappings.");
+
+static ConfigVar<size_t>::ptr g_stackPoolSize = Config::lookup<size_t>(
+    "fiber.stackpoolsize", 32u,
+    "Maximum number of freed fiber stacks each thread keeps for reuse by new "
+    "fibers.  Pages already touched by a pooled stack stay resident.  0 "
+    "disables pooling.");
+
+namespace {
+
+/// Per-thread cache of freed fiber stacks, bucketed by size
+///
+/// The free list for each bucket is threaded through the top word of each
+/// pooled stack, so pushing and popping never allocates.
+struct StackPool
+{
+    struct Bucket
+    {
+        size_t size;
+        bool guarded;
+        void *head;
+    };
+
+    StackPool() : count(0) {}
+    ~StackPool();
+
+    void *pop(size_t size, bool guarded);
+    /// @return false if the pool is full, and the caller should free the
+    /// stack itself
+    bool push(void *stack, size_t size, bool guarded);
+
+    static void *&next(void *stack, size_t size)
+    { return ((void **)((char *)stack + size))[-1]; }
+
+    std::vector<Bucket> buckets;
+    size_t count;
+};
+
+}
+
+/// @return The usable stack; if guarded, the guard page sits immediately
+/// below it
+static void *mapStack(size_t size, bool guarded)
+{
+    if (!guarded) {
+        void *stack = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (stack == MAP_FAILED)
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mmap");
+        return stack;
+    }
+    int flags = MAP_PRIVATE | MAP_ANON;
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    void *mapping = mmap(NULL, size + g_pagesize, PROT_READ | PROT_WRITE,
+        flags, -1, 0);
+    if (mapping == MAP_FAILED)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mmap");
+    if (mprotect(mapping, g_pagesize, PROT_NONE)) {
+        int error = errno;
+        munmap(mapping, size + g_pagesize);
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "mprotect");
+    }
+    return (char *)mapping + g_pagesize;
+}
+
+static void unmapStack(void *stack, size_t size, bool guarded)
+{
+    if (guarded)
+        munmap((char *)stack - g_pagesize, size + g_pagesize);
+    else
+        munmap(stack, size);
+}
+
+// Same arrangement as t_fiber/t_threadFiber below: fast access through
+// ThreadLocalStorage, cleanup at thread exit through boost::tss
+static ThreadLocalStorage<StackPool *> t_stackPool;
+static boost::thread_specific_ptr<StackPool> t_stackPoolOwner;
+
+StackPool::~StackPool()
+{
+    t_stackPool = NULL;
+    for (std::vector<Bucket>::iterator it = buckets.begin();
+        it != buckets.end();
+        ++it) {
+        while (it->head) {
+            void *stack = it->head;
+            it->head = next(stack, it->size);
+            unmapStack(stack, it->size, it->guarded);
+            g_statPoolTrims.increment();
+        }
+    }
+}
+
+void *
+StackPool::pop(size_t size, bool guarded)
+{
+    for (std::vector<Bucket>::iterator it = buckets.begin();
+        it != buckets.end();
+        ++it) {
+        if (it->size != size || it->guarded != guarded)
+            continue;
+        void *stack = it->head;
+        if (stack) {
+            it->head = next(stack, size);
+            --count;
+        }
+        return stack;
+    }
+    return NULL;
+}
+
+bool
+StackPool::push(void *stack, size_t size, bool guarded)
+{
+    if (count >= g_stackPoolSize->val())
+        return false;
+    std::vector<Bucket>::iterator it = buckets.begin();
+    for (; it != buckets.end(); ++it)
+        if (it->size == size && it->guarded == guarded)
+            break;
+    if (it == buckets.end()) {
+        Bucket bucket = { size, guarded, NULL };
+        it = buckets.insert(buckets.end(), bucket);
+    }
+    next(stack, size) = it->head;
+    it->head = stack;
+    ++count;
+    return true;
+}
+#endif
+
 // t_fiber is the Fiber currently executing on this thread
 // t_threadFiber is the Fiber that represents the thread's original stack
 // t_threadFiber is a boost::tss, because it supports automatic cleanup when
@@ -87,14 +332,37 @@ static std::vector<bool> & g_flsIndices()
     return indices;
 }
 
+namespace {
+struct FlsSlot
+{
+    size_t size, alignment;
+    void (*copy)(void *, const void *);
+};
+}
+
+// Protected by g_flsMutex(); keys are never reused, since Fibers may still
+// have values for a freed key
+static std::vector<FlsSlot> & g_flsSlots()
+{
+    static std::vector<FlsSlot> slots;
+    return slots;
+}
+// How many allocated slots are inheritable
+static volatile size_t g_flsInheritable = 0;
+
 Fiber::Fiber()
 {
-    g_statMaxFibers.update(atomicIncrement(g_cntFibers));
+    g_statMaxFibers.update(atomicIncrement(g_statFibers.count));
+    g_statCreated.increment();
     MORDOR_ASSERT(!t_fiber);
     m_state = EXEC;
     m_stack = NULL;
     m_stacksize = 0;
     m_sp = NULL;
+    m_flsInlineUsed = 0;
+#ifdef POSIX
+    m_guardPage = false;
+#endif
     setThis(this);
 #ifdef NATIVE_WINDOWS_FIBERS
     if (!pIsThreadAFiber())
@@ -109,13 +377,15 @@ Fiber::Fiber()
 
 Fiber::Fiber(boost::function<void ()> dg, size_t stacksize)
 {
-    g_statMaxFibers.update(atomicIncrement(g_cntFibers));
+    g_statMaxFibers.update(atomicIncrement(g_statFibers.count));
+    g_statCreated.increment();
     stacksize += g_pagesize - 1;
     stacksize -= stacksize % g_pagesize;
-    m_dg = dg;
+    m_dg.swap(dg);
     m_state = INIT;
     m_stack = NULL;
     m_stacksize = stacksize;
+    m_flsInlineUsed = 0;
     allocStack();
 #ifdef UCONTEXT_FIBERS
     m_sp = &m_ctx;
@@ -123,11 +393,24 @@ Fiber::Fiber(boost::function<void ()> dg, size_t stacksize)
     m_sp = &m_env;
 #endif
     initStack();
+    Fiber *parent = t_fiber.get();
+    if (g_flsInheritable != 0 && parent && !parent->m_flsValues.empty()) {
+        try {
+            flsInherit(*parent);
+        } catch (...) {
+            flsClear();
+            freeStack();
+            g_statFibers.decrement();
+            throw;
+        }
+    }
 }
 
 Fiber::~Fiber()
 {
-    atomicDecrement(g_cntFibers);
+    g_statFibers.decrement();
+    g_statDestroyed.increment();
+    flsClear();
     if (!m_stack || m_stack == m_sp) {
         // Thread entry fiber
         MORDOR_ASSERT(!m_dg);
@@ -160,7 +443,8 @@ Fiber::reset(boost::function<void ()> dg)
     m_exception = boost::exception_ptr();
     MORDOR_ASSERT(m_stack);
     MORDOR_ASSERT(m_state == TERM || m_state == INIT || m_state == EXCEPT);
-    m_dg = dg;
+    flsClear();
+    m_dg.swap(dg);
     initStack();
     m_state = INIT;
 }
@@ -396,9 +680,23 @@ Fiber::allocStack()
     VirtualAlloc((char*)m_stack + g_pagesize, m_stacksize, MEM_COMMIT, PAGE_READWRITE);
     m_sp = (char*)m_stack + m_stacksize + g_pagesize;
 #elif defined(POSIX)
-    m_stack = mmap(NULL, m_stacksize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-    if (m_stack == MAP_FAILED)
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mmap");
+    StackPool *pool = t_stackPool.get();
+    if (!pool && g_stackPoolSize->val() != 0) {
+        pool = new StackPool();
+        t_stackPoolOwner.reset(pool);
+        t_stackPool = pool;
+    }
+    m_guardPage = g_stackGuard->val();
+    m_stack = pool ? pool->pop(m_stacksize, m_guardPage) : NULL;
+    if (m_stack) {
+        g_statPoolHits.increment();
+    } else {
+        if (pool)
+            g_statPoolMisses.increment();
+        m_stack = mapStack(m_stacksize, m_guardPage);
+        // Fibers tend to be created by the thread that will run them
+        numaPreferLocal(m_stack, m_stacksize);
+    }
 #if defined(VALGRIND) && (defined(LINUX) || defined(OSX))
     m_valgrindStackId = VALGRIND_STACK_REGISTER(m_stack, (char *)m_stack + m_stacksize);
 #endif
@@ -419,13 +717,47 @@ Fiber::freeStack()
 #if defined(VALGRIND) && (defined(LINUX) || defined(OSX))
     VALGRIND_STACK_DEREGISTER(m_valgrindStackId);
 #endif
-    munmap(m_stack, m_stacksize);
+    if (m_guardPage)
+        g_statHighWater.update((unsigned int)stackHighWaterMark());
+    // Threads that have never allocated a stack don't get a pool
+    StackPool *pool = t_stackPool.get();
+    if (pool && pool->push(m_stack, m_stacksize, m_guardPage))
+        return;
+    if (pool)
+        g_statPoolTrims.increment();
+    unmapStack(m_stack, m_stacksize, m_guardPage);
+#endif
+}
+
+size_t
+Fiber::stackHighWaterMark() const
+{
+#if defined(POSIX) && !defined(NATIVE_WINDOWS_FIBERS)
+    if (!m_stack || m_stack == m_sp)
+        return 0;
+    size_t pages = m_stacksize / g_pagesize;
+#ifdef OSX
+    std::vector<char> resident(pages);
+#else
+    std::vector<unsigned char> resident(pages);
+#endif
+    if (mincore(m_stack, m_stacksize, &resident[0]))
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mincore");
+    // The stack grows down, so the lowest resident page is the deepest
+    // the stack has ever been
+    for (size_t i = 0; i < pages; ++i)
+        if (resident[i] & 1)
+            return (pages - i) * g_pagesize;
+    return 0;
+#else
+    return 0;
 #endif
 }
 
 void
 Fiber::switchContext(Fiber *to)
 {
+    g_statSwitches.increment();
 #ifdef NATIVE_WINDOWS_FIBERS
     SwitchToFiber(to->m_sp);
 
@@ -436,6 +768,12 @@ Fiber::switchContext(Fiber *to)
     if (swapcontext((ucontext_t*)(this->m_sp), (ucontext_t*)to->m_sp))
         MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("swapcontext");
 
+#elif defined(ASM_FIBERS)
+#  if defined(CXXABIV1_EXCEPTION)
+    this->m_eh.swap(to->m_eh);
+#  endif
+    mordor_fiber_switch(&this->m_sp, to->m_sp);
+
 #elif defined(SETJMP_FIBERS)
     if (!setjmp(*(jmp_buf*)this->m_sp)) {
 #  if defined(CXXABIV1_EXCEPTION)
@@ -470,6 +808,23 @@ Fiber::initStack()
     m_ctx.uc_mcontext = (mcontext_t)m_mctx;
 #endif
     makecontext(&m_ctx, &Fiber::entryPoint, 0);
+#elif defined(ASM_FIBERS)
+    // Build the frame mordor_fiber_switch will restore, so that it "returns"
+    // into entryPoint with the stack aligned as if entryPoint had been called
+    void **sp = (void **)(((uintptr_t)m_stack + m_stacksize) & ~(uintptr_t)15);
+#ifdef X86_64
+    *--sp = NULL;                               // entryPoint's return address
+    *--sp = (void *)&Fiber::entryPoint;
+    for (int i = 0; i < 6; ++i)
+        *--sp = NULL;                           // rbp, rbx, r12-r15
+    // Default MXCSR and x87 control word
+    *--sp = (void *)(0x1f80ull | (0x037full << 32));
+#elif defined(AARCH64)
+    sp -= 20;
+    memset(sp, 0, 20 * sizeof(void *));         // x19-x29, d8-d15
+    sp[11] = (void *)&Fiber::entryPoint;        // x30
+#endif
+    m_sp = sp;
 #elif defined(SETJMP_FIBERS)
     if (setjmp(m_env)) {
         Fiber::entryPoint();
@@ -610,6 +965,143 @@ Fiber::flsGet(size_t key)
     return self->m_fls[key];
 }
 
+size_t
+Fiber::flsTypedAlloc(size_t size, size_t alignment,
+    void (*copy)(void *, const void *))
+{
+    FlsSlot slot = { size, alignment, copy };
+    boost::mutex::scoped_lock lock(g_flsMutex());
+    g_flsSlots().push_back(slot);
+    if (copy)
+        atomicIncrement(g_flsInheritable);
+    return g_flsSlots().size() - 1;
+}
+
+void
+Fiber::flsTypedFree(size_t key)
+{
+    boost::mutex::scoped_lock lock(g_flsMutex());
+    MORDOR_ASSERT(key < g_flsSlots().size());
+    if (g_flsSlots()[key].copy) {
+        g_flsSlots()[key].copy = NULL;
+        atomicDecrement(g_flsInheritable);
+    }
+}
+
+void *
+Fiber::flsConstruct(size_t key, size_t size, size_t alignment,
+    void (*construct)(void *), void (*destroy)(void *))
+{
+    if (m_flsValues.size() <= key) {
+        FlsValue empty = { NULL, NULL };
+        m_flsValues.resize(key + 1, empty);
+    }
+    MORDOR_ASSERT(!m_flsValues[key].value);
+    void *value = flsAllocate(size, alignment);
+    try {
+        construct(value);
+    } catch (...) {
+        flsDeallocate(value);
+        throw;
+    }
+    m_flsValues[key].value = value;
+    m_flsValues[key].destroy = destroy;
+    return value;
+}
+
+void *
+Fiber::flsAllocate(size_t size, size_t alignment)
+{
+    if (alignment <= boost::alignment_of<FlsInline>::value) {
+        size_t offset = (m_flsInlineUsed + alignment - 1) & ~(alignment - 1);
+        if (offset + size <= sizeof(m_flsInline)) {
+            m_flsInlineUsed = offset + size;
+            return m_flsInline.bytes + offset;
+        }
+    }
+    // Honors over-aligned types, unlike operator new
+    alignment = (std::max)(alignment, sizeof(void *));
+#ifdef WINDOWS
+    void *result = _aligned_malloc(size, alignment);
+#else
+    void *result;
+    if (posix_memalign(&result, alignment, size))
+        result = NULL;
+#endif
+    if (!result)
+        MORDOR_THROW_EXCEPTION(std::bad_alloc());
+    return result;
+}
+
+void
+Fiber::flsDeallocate(void *value)
+{
+    // Inline space is only reclaimed by flsClear()
+    if (value < (void *)m_flsInline.bytes ||
+        value >= (void *)(m_flsInline.bytes + sizeof(m_flsInline))) {
+#ifdef WINDOWS
+        _aligned_free(value);
+#else
+        free(value);
+#endif
+    }
+}
+
+void
+Fiber::flsErase(size_t key)
+{
+    if (key >= m_flsValues.size() || !m_flsValues[key].value)
+        return;
+    FlsValue value = m_flsValues[key];
+    m_flsValues[key].value = NULL;
+    value.destroy(value.value);
+    flsDeallocate(value.value);
+}
+
+void
+Fiber::flsClear()
+{
+    // Destroying one value may access another, so take them one at a time
+    for (size_t i = 0; i < m_flsValues.size(); ++i)
+        flsErase(i);
+    m_flsValues.clear();
+    m_flsInlineUsed = 0;
+}
+
+void
+Fiber::flsInherit(const Fiber &parent)
+{
+    // Copy constructors run without the lock, so they don't serialize Fiber
+    // creation, and may themselves use FiberLocals
+    std::vector<std::pair<size_t, FlsSlot> > inherited;
+    {
+        boost::mutex::scoped_lock lock(g_flsMutex());
+        const std::vector<FlsSlot> &slots = g_flsSlots();
+        for (size_t i = 0; i < parent.m_flsValues.size(); ++i) {
+            if (parent.m_flsValues[i].value && slots[i].copy)
+                inherited.push_back(std::make_pair(i, slots[i]));
+        }
+    }
+    for (size_t j = 0; j < inherited.size(); ++j) {
+        size_t i = inherited[j].first;
+        const FlsSlot &slot = inherited[j].second;
+        const FlsValue &value = parent.m_flsValues[i];
+        if (m_flsValues.size() <= i) {
+            FlsValue empty = { NULL, NULL };
+            m_flsValues.resize(i + 1, empty);
+        }
+        void *copy = flsAllocate(slot.size, slot.alignment);
+        try {
+            slot.copy(copy, value.value);
+        } catch (...) {
+            flsDeallocate(copy);
+            throw;
+        }
+        m_flsValues[i].value = copy;
+        m_flsValues[i].destroy = value.destroy;
+    }
+}
+
 std::vector<void *>
 Fiber::backtrace()
 {
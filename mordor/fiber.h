@@ -3,11 +3,14 @@
 // Copyright (c) 2009 - Mozy, Inc.
 
 #include <list>
+#include <new>
+#include <vector>
 
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/function.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/type_traits/alignment_of.hpp>
 
 #include "exception.h"
 #include "thread_local_storage.h"
@@ -15,7 +18,13 @@
 
 // Fiber impl selection
 
-#ifdef X86_64
+// ASM_FIBERS (configure --enable-asm-fibers) selects a hand-written context
+// switch that saves only callee-saved registers, instead of ucontext
+#ifdef ASM_FIBERS
+#   if !defined(LINUX) || !(defined(X86_64) || defined(AARCH64))
+#       error ASM_FIBERS is only supported on x86-64 and AArch64 Linux
+#   endif
+#elif defined(X86_64)
 #   ifdef WINDOWS
 #       define NATIVE_WINDOWS_FIBERS
 #   elif defined(OSX)
@@ -35,6 +44,8 @@
 #   define UCONTEXT_FIBERS
 #elif defined(ARM)
 #   define UCONTEXT_FIBERS
+#elif defined(AARCH64)
+#   define UCONTEXT_FIBERS
 #else
 #   error Platform not supported
 #endif
@@ -58,6 +69,8 @@ namespace Mordor {
 class Fiber : public boost::enable_shared_from_this<Fiber>
 {
     template <class T> friend class FiberLocalStorageBase;
+    template <class T> friend class FiberLocal;
+    friend class Scheduler;
 public:
     typedef boost::shared_ptr<Fiber> ptr;
     typedef boost::weak_ptr<Fiber> weak_ptr;
@@ -94,6 +107,8 @@ public:
     ~Fiber();
 
     /// @brief Reset a Fiber to be used again, with a different initial function
+    ///
+    /// Any FiberLocal values the Fiber has are destroyed.
     /// @param dg The new initial function
     /// @pre state() == INIT || state() == TERM || state() == EXCEPT
     /// @post state() == INIT
@@ -156,6 +171,15 @@ public:
     /// @pre state() != EXEC
     std::vector<void *> backtrace();
 
+    /// How much of this Fiber's stack has ever been used
+
+    /// This is measured by which pages of the stack are resident, so it is
+    /// rounded up to a whole page, and a stack recycled from the stack pool
+    /// also reports whatever its previous owners touched.
+    /// @return The high-water mark in bytes, or 0 if it can't be determined
+    /// (for a thread's own Fiber, or on platforms other than POSIX)
+    size_t stackHighWaterMark() const;
+
 private:
     Fiber::ptr yieldTo(bool yieldToCallerOnTerminate, State targetState);
     static void setThis(Fiber *f);
@@ -172,6 +196,9 @@ private:
     boost::function<void ()> m_dg;
     void *m_stack, *m_sp;
     size_t m_stacksize;
+#ifdef POSIX
+    bool m_guardPage;
+#endif
 #ifdef UCONTEXT_FIBERS
     ucontext_t m_ctx;
 #ifdef OSX
@@ -200,6 +227,46 @@ private:
     static intptr_t flsGet(size_t key);
 
     std::vector<intptr_t> m_fls;
+
+    // Typed FLS (FiberLocal) support
+    struct FlsValue
+    {
+        void *value;
+        void (*destroy)(void *);
+    };
+    /// Bytes in each Fiber for FiberLocal values, before they go to the heap
+    static const size_t FLS_INLINE_SIZE = 64;
+
+    /// Like getThis(), but without the reference counting
+    static Fiber *flsThis()
+    {
+        Fiber *self = t_fiber.get();
+        return self ? self : getThis().get();
+    }
+    /// @param copy Copy-constructs a value for a child Fiber from its
+    /// creator's, or NULL if the slot isn't inherited
+    static size_t flsTypedAlloc(size_t size, size_t alignment,
+        void (*copy)(void *, const void *));
+    static void flsTypedFree(size_t key);
+    void *flsConstruct(size_t key, size_t size, size_t alignment,
+        void (*construct)(void *), void (*destroy)(void *));
+    void *flsAllocate(size_t size, size_t alignment);
+    void flsDeallocate(void *value);
+    void flsErase(size_t key);
+    /// Destroy all of this Fiber's FiberLocal values
+    void flsClear();
+    void flsInherit(const Fiber &parent);
+
+    union FlsInline {
+        char bytes[FLS_INLINE_SIZE];
+        double d;
+        long long ll;
+        void *p;
+    };
+
+    std::vector<FlsValue> m_flsValues;
+    FlsInline m_flsInline;
+    size_t m_flsInlineUsed;
 };
 
 std::ostream &operator<<(std::ostream &os, Fiber::State state);
@@ -257,6 +324,63 @@ public:
     T * operator->() { return FiberLocalStorageBase<T *>::get(); }
 };
 
+/// Fiber-local variable of any type
+
+/// Each Fiber has its own T, default constructed the first time the Fiber
+/// accesses it, and destroyed when the Fiber is destroyed or reset().  Small
+/// values live inside the Fiber object itself, so they cost no allocation.
+/// Delegates run by a Scheduler start out with no values, even when they
+/// share a Fiber with the delegate before them.
+///
+/// If the variable is inheritable, a Fiber created from another Fiber starts
+/// out with a copy of its creator's value (if it has one) instead, so
+/// context such as a request ID or deadline follows work that a Fiber
+/// spawns.
+template <class T>
+class FiberLocal : boost::noncopyable
+{
+public:
+    explicit FiberLocal(bool inheritable = false)
+        : m_key(Fiber::flsTypedAlloc(sizeof(T),
+            boost::alignment_of<T>::value, inheritable ? &copy : NULL))
+    {}
+    ~FiberLocal() { Fiber::flsTypedFree(m_key); }
+
+    T &get()
+    {
+        Fiber *self = Fiber::flsThis();
+        if (m_key < self->m_flsValues.size()) {
+            void *value = self->m_flsValues[m_key].value;
+            if (value)
+                return *(T *)value;
+        }
+        return *(T *)self->flsConstruct(m_key, sizeof(T),
+            boost::alignment_of<T>::value, &construct, &destroy);
+    }
+    T &operator*() { return get(); }
+    T *operator->() { return &get(); }
+    FiberLocal &operator =(const T &t) { get() = t; return *this; }
+
+    /// @return If the current Fiber has a value yet
+    bool exists() const
+    {
+        Fiber *self = Fiber::flsThis();
+        return m_key < self->m_flsValues.size() &&
+            self->m_flsValues[m_key].value;
+    }
+    /// Destroy the current Fiber's value, if it has one
+    void reset() { Fiber::flsThis()->flsErase(m_key); }
+
+private:
+    static void construct(void *p) { new (p) T(); }
+    static void copy(void *p, const void *other)
+    { new (p) T(*(const T *)other); }
+    static void destroy(void *p) { ((T *)p)->~T(); }
+
+private:
+    size_t m_key;
+};
+
 }
 
 #endif // __FIBER_H__
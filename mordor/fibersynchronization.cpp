@@ -3,17 +3,30 @@
 #include "fibersynchronization.h"
 
 #include "assert.h"
+#include "atomic.h"
+#include "config.h"
 #include "fiber.h"
 #include "scheduler.h"
 
 namespace Mordor {
 
+static ConfigVar<unsigned int>::ptr g_spinCount = Config::lookup(
+    "fibermutex.spincount", 100u,
+    "How many times an ADAPTIVE FiberMutex polls a locked mutex before "
+    "parking the Fiber");
+
+FiberMutex::FiberMutex(Policy policy)
+    : m_policy(policy),
+      m_state(0)
+{}
+
 FiberMutex::~FiberMutex()
 {
 #ifndef NDEBUG
     boost::mutex::scoped_lock scopeLock(m_mutex);
     MORDOR_ASSERT(!m_owner);
     MORDOR_ASSERT(m_waiters.empty());
+    MORDOR_ASSERT(!m_state);
 #endif
 }
 
@@ -21,6 +34,10 @@ void
 FiberMutex::lock()
 {
     MORDOR_ASSERT(Scheduler::getThis());
+    if (m_policy == ADAPTIVE) {
+        lockAdaptive();
+        return;
+    }
     {
         boost::mutex::scoped_lock scopeLock(m_mutex);
         MORDOR_ASSERT(m_owner != Fiber::getThis());
@@ -47,6 +64,10 @@ FiberMutex::lock()
 void
 FiberMutex::unlock()
 {
+    if (m_policy == ADAPTIVE) {
+        unlockAdaptive();
+        return;
+    }
     boost::mutex::scoped_lock lock(m_mutex);
     unlockNoLock();
 }
@@ -54,6 +75,14 @@ FiberMutex::unlock()
 bool
 FiberMutex::unlockIfNotUnique()
 {
+    if (m_policy == ADAPTIVE) {
+        MORDOR_ASSERT(m_owner == Fiber::getThis());
+        if (m_state & WAITERS) {
+            unlockAdaptive();
+            return true;
+        }
+        return false;
+    }
     boost::mutex::scoped_lock lock(m_mutex);
     MORDOR_ASSERT(m_owner == Fiber::getThis());
     if (!m_waiters.empty()) {
@@ -63,6 +92,81 @@ FiberMutex::unlockIfNotUnique()
     return false;
 }
 
+bool
+FiberMutex::tryLockAdaptive()
+{
+    int state = m_state;
+    if (state & LOCKED)
+        return false;
+    if (atomicCompareAndSwap(m_state, state | LOCKED, state) != state)
+        return false;
+#ifndef NDEBUG
+    m_owner = Fiber::getThis();
+#endif
+    return true;
+}
+
+void
+FiberMutex::lockAdaptive()
+{
+    MORDOR_ASSERT(m_owner != Fiber::getThis());
+    if (tryLockAdaptive())
+        return;
+    while (true) {
+        // Spinning only helps if whoever has the mutex can be running on
+        // another thread in the meantime
+        if (Scheduler::getThis()->threadCount() > 1) {
+            for (unsigned int i = g_spinCount->val(); i > 0; --i) {
+                cpuRelax();
+                if (!(m_state & LOCKED) && tryLockAdaptive())
+                    return;
+            }
+        }
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            // Don't park if it was released while we were getting here;
+            // otherwise flag that there are waiters before we become one,
+            // so the unlocker knows to come and wake us
+            int state;
+            do {
+                if (tryLockAdaptive())
+                    return;
+                state = m_state;
+            } while (!(state & LOCKED) || ((!(state & WAITERS)) &&
+                atomicCompareAndSwap(m_state, state | WAITERS, state) !=
+                    state));
+            m_waiters.push_back(std::make_pair(Scheduler::getThis(),
+                Fiber::getThis()));
+        }
+        Scheduler::yieldTo();
+        // Woken up, but the mutex hasn't been handed over; try again
+        if (tryLockAdaptive())
+            return;
+    }
+}
+
+void
+FiberMutex::unlockAdaptive()
+{
+    MORDOR_ASSERT(m_owner == Fiber::getThis());
+#ifndef NDEBUG
+    m_owner.reset();
+#endif
+    if (atomicCompareAndSwap(m_state, 0, (int)LOCKED) == LOCKED)
+        return;
+    std::pair<Scheduler *, Fiber::ptr> next;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        MORDOR_ASSERT(m_state == (LOCKED | WAITERS));
+        MORDOR_ASSERT(!m_waiters.empty());
+        next = m_waiters.front();
+        m_waiters.pop_front();
+        // Nobody else changes m_state while it's locked and we hold m_mutex
+        m_state = m_waiters.empty() ? 0 : WAITERS;
+    }
+    next.first->schedule(next.second);
+}
+
 void
 FiberMutex::unlockNoLock()
 {
@@ -156,6 +260,200 @@ RecursiveFiberMutex::unlockNoLock()
     }
 }
 
+FiberRWMutex::FiberRWMutex(Policy policy)
+    : m_policy(policy),
+      m_state(0)
+{}
+
+FiberRWMutex::~FiberRWMutex()
+{
+#ifndef NDEBUG
+    boost::mutex::scoped_lock scopeLock(m_mutex);
+    MORDOR_ASSERT(!m_owner);
+    MORDOR_ASSERT(m_readers.empty());
+    MORDOR_ASSERT(m_writers.empty());
+    MORDOR_ASSERT(!m_state);
+#endif
+}
+
+bool
+FiberRWMutex::tryLock()
+{
+    if (atomicCompareAndSwap(m_state, (int)WRITER, 0) != 0)
+        return false;
+#ifndef NDEBUG
+    m_owner = Fiber::getThis();
+#endif
+    return true;
+}
+
+void
+FiberRWMutex::lock()
+{
+    MORDOR_ASSERT(Scheduler::getThis());
+#ifndef NDEBUG
+    MORDOR_ASSERT(m_owner != Fiber::getThis());
+#endif
+    if (tryLock())
+        return;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        // Only wait if it's still held by someone who will hand it over
+        // when they're done; otherwise flag that there are waiting writers
+        // before we become one
+        while (true) {
+            if (tryLock())
+                return;
+            int state = m_state;
+            if (state == 0)
+                continue;
+            if ((state & WAITING_WRITERS) || atomicCompareAndSwap(m_state,
+                state | WAITING_WRITERS, state) == state)
+                break;
+        }
+        m_writers.push_back(std::make_pair(Scheduler::getThis(),
+            Fiber::getThis()));
+    }
+    // The unlocker hands us the mutex
+    Scheduler::yieldTo();
+    MORDOR_ASSERT(m_state & WRITER);
+}
+
+void
+FiberRWMutex::unlock()
+{
+#ifndef NDEBUG
+    MORDOR_ASSERT(m_owner == Fiber::getThis());
+    m_owner.reset();
+#endif
+    if (atomicCompareAndSwap(m_state, 0, (int)WRITER) == WRITER)
+        return;
+    boost::mutex::scoped_lock lock(m_mutex);
+    // Nobody else can change the state while we own it exclusively and
+    // hold m_mutex
+    int state = m_state;
+    MORDOR_ASSERT(state & WRITER);
+    MORDOR_ASSERT(state < READER);
+    MORDOR_ASSERT(!m_readers.empty() || !m_writers.empty());
+    if (!m_writers.empty() &&
+        (m_policy == WRITER_PREFERENCE || m_readers.empty())) {
+        std::pair<Scheduler *, Fiber::ptr> next = m_writers.front();
+        m_writers.pop_front();
+        int newState = WRITER |
+            (m_writers.empty() ? 0 : WAITING_WRITERS) |
+            (m_readers.empty() ? 0 : WAITING_READERS);
+        MORDOR_VERIFY(atomicCompareAndSwap(m_state, newState, state) == state);
+#ifndef NDEBUG
+        m_owner = next.second;
+#endif
+        next.first->schedule(next.second);
+        return;
+    }
+    // Let every waiting reader in at once
+    int newState = (int)m_readers.size() * READER |
+        (m_writers.empty() ? 0 : WAITING_WRITERS);
+    MORDOR_VERIFY(atomicCompareAndSwap(m_state, newState, state) == state);
+    for (std::list<std::pair<Scheduler *, Fiber::ptr> >::iterator it =
+        m_readers.begin(); it != m_readers.end(); ++it)
+        it->first->schedule(it->second);
+    m_readers.clear();
+}
+
+bool
+FiberRWMutex::blocksReaders(int state) const
+{
+    return (state & WRITER) ||
+        (m_policy == WRITER_PREFERENCE && (state & WAITING_WRITERS));
+}
+
+bool
+FiberRWMutex::tryLockShared()
+{
+    int state = m_state;
+    while (!blocksReaders(state)) {
+        int old = atomicCompareAndSwap(m_state, state + READER, state);
+        if (old == state)
+            return true;
+        state = old;
+    }
+    return false;
+}
+
+void
+FiberRWMutex::lockShared()
+{
+    MORDOR_ASSERT(Scheduler::getThis());
+#ifndef NDEBUG
+    MORDOR_ASSERT(m_owner != Fiber::getThis());
+#endif
+    if (tryLockShared())
+        return;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        while (true) {
+            if (tryLockShared())
+                return;
+            int state = m_state;
+            if (!blocksReaders(state))
+                continue;
+            if ((state & WAITING_READERS) || atomicCompareAndSwap(m_state,
+                state | WAITING_READERS, state) == state)
+                break;
+        }
+        m_readers.push_back(std::make_pair(Scheduler::getThis(),
+            Fiber::getThis()));
+    }
+    // The unlocker has already counted us as a reader
+    Scheduler::yieldTo();
+    MORDOR_ASSERT(m_state >= READER);
+}
+
+void
+FiberRWMutex::unlockShared()
+{
+    int state = m_state;
+    while (true) {
+        MORDOR_ASSERT(state >= READER);
+        MORDOR_ASSERT(!(state & WRITER));
+        // The last reader out has to hand the mutex to a waiting writer
+        if (state < 2 * READER && (state & WAITING_WRITERS))
+            break;
+        int old = atomicCompareAndSwap(m_state, state - READER, state);
+        if (old == state)
+            return;
+        state = old;
+    }
+    boost::mutex::scoped_lock lock(m_mutex);
+    state = m_state;
+    while (true) {
+        int newState;
+        // Other readers may still be coming and going (if readers are
+        // preferred), but the WAITING_ bits are stable while we hold m_mutex
+        bool handOff = state < 2 * READER && (state & WAITING_WRITERS);
+        if (handOff) {
+            MORDOR_ASSERT(!m_writers.empty());
+            newState = WRITER | (state & WAITING_READERS) |
+                (m_writers.size() > 1 ? WAITING_WRITERS : 0);
+        } else {
+            newState = state - READER;
+        }
+        int old = atomicCompareAndSwap(m_state, newState, state);
+        if (old != state) {
+            state = old;
+            continue;
+        }
+        if (handOff) {
+            std::pair<Scheduler *, Fiber::ptr> next = m_writers.front();
+            m_writers.pop_front();
+#ifndef NDEBUG
+            m_owner = next.second;
+#endif
+            next.first->schedule(next.second);
+        }
+        return;
+    }
+}
+
 FiberSemaphore::FiberSemaphore(size_t initialConcurrency)
     : m_concurrency(initialConcurrency)
 {}
@@ -218,6 +516,18 @@ void
 FiberCondition::wait()
 {
     MORDOR_ASSERT(Scheduler::getThis());
+    if (m_fiberMutex.m_policy == FiberMutex::ADAPTIVE) {
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            MORDOR_ASSERT(m_fiberMutex.m_owner == Fiber::getThis());
+            m_waiters.push_back(std::make_pair(Scheduler::getThis(),
+                Fiber::getThis()));
+            m_fiberMutex.unlockAdaptive();
+        }
+        Scheduler::yieldTo();
+        m_fiberMutex.lockAdaptive();
+        return;
+    }
     {
         boost::mutex::scoped_lock lock(m_mutex);
         boost::mutex::scoped_lock lock2(m_fiberMutex.m_mutex);
@@ -244,6 +554,11 @@ FiberCondition::signal()
         next = m_waiters.front();
         m_waiters.pop_front();
     }
+    // An adaptive mutex is re-acquired by the waiter itself
+    if (m_fiberMutex.m_policy == FiberMutex::ADAPTIVE) {
+        next.first->schedule(next.second);
+        return;
+    }
     boost::mutex::scoped_lock lock2(m_fiberMutex.m_mutex);
     MORDOR_ASSERT(m_fiberMutex.m_owner != next.second);
     MORDOR_ASSERT_PERF(std::find(m_fiberMutex.m_waiters.begin(),
@@ -263,6 +578,13 @@ FiberCondition::broadcast()
     boost::mutex::scoped_lock lock(m_mutex);
     if (m_waiters.empty())
         return;
+    if (m_fiberMutex.m_policy == FiberMutex::ADAPTIVE) {
+        for (std::list<std::pair<Scheduler *, Fiber::ptr> >::iterator it =
+            m_waiters.begin(); it != m_waiters.end(); ++it)
+            it->first->schedule(it->second);
+        m_waiters.clear();
+        return;
+    }
     boost::mutex::scoped_lock lock2(m_fiberMutex.m_mutex);
 
     std::list<std::pair<Scheduler *, Fiber::ptr> >::iterator it;
@@ -63,17 +63,65 @@ private:
     bool m_locked;
 };
 
+/// Type that will lock a reader/writer mutex for shared access on
+/// construction, and unlock it on destruction
+template<class Mutex> struct SharedScopedLockImpl
+{
+public:
+    SharedScopedLockImpl(Mutex &mutex)
+        : m_mutex(mutex)
+    {
+        m_mutex.lockShared();
+        m_locked = true;
+    }
+    ~SharedScopedLockImpl()
+    { unlock(); }
+
+    void lock()
+    {
+        if (!m_locked) {
+            m_mutex.lockShared();
+            m_locked = true;
+        }
+    }
+
+    void unlock()
+    {
+        if (m_locked) {
+            m_mutex.unlockShared();
+            m_locked = false;
+        }
+    }
+
+private:
+    Mutex &m_mutex;
+    bool m_locked;
+};
+
 /// Mutex for use by Fibers that yields to a Scheduler instead of blocking
-/// if the mutex cannot be immediately acquired.  It also provides the
-/// additional guarantee that it is strictly FIFO, instead of random which
+/// if the mutex cannot be immediately acquired.  By default, it also provides
+/// the additional guarantee that it is strictly FIFO, instead of random which
 /// Fiber will acquire the mutex next after it is released.
+///
+/// An ADAPTIVE mutex gives up that guarantee for throughput on short
+/// critical sections: locking and unlocking an uncontended mutex is a single
+/// atomic operation, a contended lock spins for a while (if there are other
+/// threads that could be releasing it) before parking the Fiber, and a
+/// parked Fiber that is woken up competes with newcomers for the mutex,
+/// instead of being handed it.
 struct FiberMutex : boost::noncopyable
 {
     friend struct FiberCondition;
 public:
     typedef ScopedLockImpl<FiberMutex> ScopedLock;
 
+    enum Policy {
+        FIFO,
+        ADAPTIVE
+    };
+
 public:
+    FiberMutex(Policy policy = FIFO);
     ~FiberMutex();
 
     /// @brief Locks the mutex
@@ -95,8 +143,22 @@ public:
 
 private:
     void unlockNoLock();
+    /// @return If the mutex was acquired
+    bool tryLockAdaptive();
+    void lockAdaptive();
+    void unlockAdaptive();
 
 private:
+    // ADAPTIVE mutexes only
+    enum {
+        LOCKED = 0x1,
+        WAITERS = 0x2
+    };
+
+    Policy m_policy;
+    // Only for ADAPTIVE mutexes; LOCKED | WAITERS.  WAITERS is only changed
+    // while holding m_mutex, and is set exactly while m_waiters isn't empty.
+    volatile int m_state;
     boost::mutex m_mutex;
     boost::shared_ptr<Fiber> m_owner;
     std::list<std::pair<Scheduler *, boost::shared_ptr<Fiber> > > m_waiters;
@@ -136,6 +198,83 @@ private:
     unsigned m_recursion;
 };
 
+/// Scheduler based reader/writer mutex for Fibers
+
+/// Reader/writer mutex for use by Fibers that yields to a Scheduler instead
+/// of blocking if the mutex cannot be immediately acquired.  Any number of
+/// Fibers may hold it shared at once, or a single Fiber exclusively.
+/// Acquiring or releasing it shared while there is no writer involved is a
+/// single atomic operation, so readers on different threads don't serialise
+/// on an internal lock.
+///
+/// With WRITER_PREFERENCE (the default), new readers queue behind a waiting
+/// writer, so a steady stream of readers can't starve writers; when a writer
+/// unlocks, the next waiting writer gets the mutex before any waiting
+/// readers.  With READER_PREFERENCE, readers are only held off by a writer
+/// that actually owns the mutex, and all waiting readers are let in when it
+/// unlocks; writers can starve.  Waiting writers are always released in FIFO
+/// order.  The mutex is not recursive, in either mode.
+struct FiberRWMutex : boost::noncopyable
+{
+public:
+    typedef ScopedLockImpl<FiberRWMutex> ScopedLock;
+    typedef SharedScopedLockImpl<FiberRWMutex> SharedScopedLock;
+
+    enum Policy {
+        WRITER_PREFERENCE,
+        READER_PREFERENCE
+    };
+
+public:
+    FiberRWMutex(Policy policy = WRITER_PREFERENCE);
+    ~FiberRWMutex();
+
+    /// @brief Locks the mutex exclusively
+    /// Note that it is possible for this Fiber to switch threads after this
+    /// method, though it is guaranteed to still be on the same Scheduler
+    /// @pre Scheduler::getThis() != NULL
+    /// @pre Fiber::getThis() does not hold this mutex
+    void lock();
+    /// @brief Unlocks the mutex from exclusive ownership
+    /// @pre Fiber::getThis() holds this mutex exclusively
+    void unlock();
+
+    /// @brief Locks the mutex for shared access
+    /// @pre Scheduler::getThis() != NULL
+    /// @pre Fiber::getThis() does not hold this mutex
+    void lockShared();
+    /// @brief Unlocks the mutex from shared access
+    /// @pre Fiber::getThis() holds this mutex shared
+    void unlockShared();
+
+private:
+    /// @return If the mutex was acquired exclusively
+    bool tryLock();
+    bool blocksReaders(int state) const;
+    /// @return If the mutex was acquired shared
+    bool tryLockShared();
+
+private:
+    enum {
+        WRITER = 0x1,
+        WAITING_WRITERS = 0x2,
+        WAITING_READERS = 0x4,
+        // The number of readers is kept in the remaining bits
+        READER = 0x8
+    };
+
+    const Policy m_policy;
+    // The WAITING_ bits are only changed while holding m_mutex, and are set
+    // exactly while the corresponding waiter list isn't empty
+    volatile int m_state;
+    boost::mutex m_mutex;
+    std::list<std::pair<Scheduler *, boost::shared_ptr<Fiber> > > m_readers;
+    std::list<std::pair<Scheduler *, boost::shared_ptr<Fiber> > > m_writers;
+#ifndef NDEBUG
+    boost::shared_ptr<Fiber> m_owner;
+#endif
+};
+
 /// Scheduler based Semaphore for Fibers
 
 /// Semaphore for use by Fibers that yields to a Scheduler instead of blocking
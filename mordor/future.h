@@ -3,10 +3,12 @@
 // Copyright (c) 2009 - Mozy, Inc.
 
 #include <bitset>
+#include <iterator>
 
 #include <boost/bind.hpp>
 #include <boost/function.hpp>
 #include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
 
 #include "assert.h"
 #include "atomic.h"
@@ -58,6 +60,31 @@ public:
         return m_t;
     }
 
+    /// Call a continuation once the Future is signalled, instead of waiting
+
+    /// This is the same as having passed dg and scheduler to the
+    /// constructor, except that if the Future has already been signalled,
+    /// dg is called (or scheduled) immediately.  Either way, no Fiber is
+    /// tied up waiting for the result.
+    /// @pre Nothing is waiting on this Future, and it has no dg yet
+    void then(boost::function<void (const T &)> dg,
+        Scheduler *scheduler = NULL)
+    {
+        MORDOR_ASSERT(dg);
+        MORDOR_ASSERT(!m_dg);
+        MORDOR_ASSERT(!m_scheduler);
+        m_dg = dg;
+        m_scheduler = scheduler;
+        intptr_t currentValue = atomicCompareAndSwap(m_fiber, (intptr_t)0x2,
+            (intptr_t)0);
+        if (currentValue == 0x1) {
+            m_fiber = 0x2;
+            callDg();
+        } else {
+            MORDOR_ASSERT(currentValue == 0);
+        }
+    }
+
     /// For signallers to set the result; once signalled should not be modified
     T& result() { MORDOR_ASSERT(!(m_fiber & 0x1)); return m_t; }
 
@@ -65,15 +92,12 @@ public:
     void signal()
     {
         intptr_t newValue = m_fiber, oldValue;
-        if (newValue == 0x2) {
-            MORDOR_ASSERT(m_dg);
-            if (m_scheduler)
-                m_scheduler->schedule(boost::bind(m_dg, boost::cref(m_t)));
-            else
-                m_dg(m_t);
-            return;
-        }
         do {
+            // then() may have raced with us
+            if (newValue == 0x2) {
+                callDg();
+                return;
+            }
             oldValue = newValue;
             newValue = oldValue | 0x1;
         } while ( (newValue = atomicCompareAndSwap(m_fiber, newValue, oldValue)) != oldValue);
@@ -93,12 +117,23 @@ public:
             m_scheduler = NULL;
     }
 
+private:
+    void callDg()
+    {
+        MORDOR_ASSERT(m_dg);
+        if (m_scheduler)
+            m_scheduler->schedule(boost::bind(m_dg, boost::cref(m_t)));
+        else
+            m_dg(m_t);
+    }
+
 private:
     // We're going to stuff a couple of things into m_fiber, and do some bit
     // manipulation, so it's going to be easier to declare it as intptr_t
     // m_fiber = NULL if not signalled, and not waiting
     // m_fiber & 0x1 if signalled
     // m_fiber & ~0x1 if waiting
+    // m_fiber == 0x2 if m_dg is to be called when signalled
     // Note that m_fiber will *not* point to a fiber if m_dg is valid
     intptr_t m_fiber;
     Scheduler *m_scheduler;
@@ -149,15 +184,12 @@ public:
     void signal()
     {
         intptr_t newValue = m_fiber, oldValue;
-        if (newValue == 0x2) {
-            MORDOR_ASSERT(m_dg);
-            if (m_scheduler)
-                m_scheduler->schedule(m_dg);
-            else
-                m_dg();
-            return;
-        }
         do {
+            // then() may have raced with us
+            if (newValue == 0x2) {
+                callDg();
+                return;
+            }
             oldValue = newValue;
             newValue = oldValue | 0x1;
         } while ( (newValue = atomicCompareAndSwap(m_fiber, newValue, oldValue)) != oldValue);
@@ -177,7 +209,40 @@ public:
             m_scheduler = NULL;
     }
 
+    /// Call a continuation once the Future is signalled, instead of waiting
+
+    /// This is the same as having passed dg and scheduler to the
+    /// constructor, except that if the Future has already been signalled,
+    /// dg is called (or scheduled) immediately.  Either way, no Fiber is
+    /// tied up waiting for the result.
+    /// @pre Nothing is waiting on this Future, and it has no dg yet
+    void then(boost::function<void ()> dg, Scheduler *scheduler = NULL)
+    {
+        MORDOR_ASSERT(dg);
+        MORDOR_ASSERT(!m_dg);
+        MORDOR_ASSERT(!m_scheduler);
+        m_dg = dg;
+        m_scheduler = scheduler;
+        intptr_t currentValue = atomicCompareAndSwap(m_fiber, (intptr_t)0x2,
+            (intptr_t)0);
+        if (currentValue == 0x1) {
+            m_fiber = 0x2;
+            callDg();
+        } else {
+            MORDOR_ASSERT(currentValue == 0);
+        }
+    }
+
 private:
+    void callDg()
+    {
+        MORDOR_ASSERT(m_dg);
+        if (m_scheduler)
+            m_scheduler->schedule(m_dg);
+        else
+            m_dg();
+    }
+
     /// @return If the future was already signalled
     bool startWait()
     {
@@ -216,12 +281,100 @@ private:
     // m_fiber = NULL if not signalled, and not waiting
     // m_fiber & 0x1 if signalled
     // m_fiber & ~0x1 if waiting
+    // m_fiber == 0x2 if m_dg is to be called when signalled
     // Note that m_fiber will *not* point to a fiber if m_dg is valid
     intptr_t m_fiber;
     Scheduler *m_scheduler;
     boost::function<void ()> m_dg;
 };
 
+namespace Detail {
+
+template <class T>
+void ignoreResult(const boost::function<void ()> &dg, const T &)
+{
+    dg();
+}
+
+template <class T>
+void onSignal(Future<T> &future, const boost::function<void ()> &dg)
+{
+    future.then(boost::bind(&ignoreResult<T>, dg, _1));
+}
+
+inline void onSignal(Future<> &future, const boost::function<void ()> &dg)
+{
+    future.then(dg);
+}
+
+struct WhenAll
+{
+    WhenAll(size_t count) : remaining(count) {}
+
+    size_t remaining;
+    Future<> result;
+};
+
+inline void whenAllOne(boost::shared_ptr<WhenAll> state)
+{
+    if (atomicDecrement(state->remaining) == 0)
+        state->result.signal();
+}
+
+struct WhenAny
+{
+    WhenAny() : signalled(0) {}
+
+    int signalled;
+    Future<size_t> result;
+};
+
+inline void whenAnyOne(boost::shared_ptr<WhenAny> state, size_t index)
+{
+    if (atomicCompareAndSwap(state->signalled, 1, 0) == 0) {
+        state->result.result() = index;
+        state->result.signal();
+    }
+}
+
+}
+
+/// @return A Future that is signalled once all of the Futures in
+/// [first, last) have been; use Future::then() on it for a continuation
+/// @note This uses then() on each of the Futures, so nothing else can wait on
+/// them, and they must stay alive until they are signalled.  The returned
+/// Future stays valid (even if it's the only reference to it) until
+/// after it has been signalled.
+template <class Iterator>
+boost::shared_ptr<Future<> > whenAll(Iterator first, Iterator last)
+{
+    boost::shared_ptr<Detail::WhenAll> state(
+        new Detail::WhenAll(std::distance(first, last) + 1));
+    boost::shared_ptr<Future<> > result(state, &state->result);
+    for (; first != last; ++first)
+        Detail::onSignal(*first, boost::bind(&Detail::whenAllOne, state));
+    // Accounts for the extra count, so that we don't signal before we've
+    // gone through them all (or at all, for an empty range)
+    Detail::whenAllOne(state);
+    return result;
+}
+
+/// @return A Future that is signalled with the index of the first of the
+/// Futures in [first, last) to be signalled
+/// @note As for whenAll, except that the later Futures must still be
+/// signalled eventually, so that everything gets cleaned up
+template <class Iterator>
+boost::shared_ptr<Future<size_t> > whenAny(Iterator first, Iterator last)
+{
+    MORDOR_ASSERT(first != last);
+    boost::shared_ptr<Detail::WhenAny> state(new Detail::WhenAny());
+    boost::shared_ptr<Future<size_t> > result(state, &state->result);
+    for (size_t index = 0; first != last; ++first, ++index)
+        Detail::onSignal(*first, boost::bind(&Detail::whenAnyOne, state,
+            index));
+    return result;
+}
+
 template <class Iterator>
 void waitAll(Iterator first, Iterator last)
 {
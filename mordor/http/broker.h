@@ -161,7 +161,8 @@ public:
 
 protected:
     ConnectionCache(StreamBroker::ptr streamBroker, TimerManager *timerManager = NULL)
-        : m_streamBroker(streamBroker),
+        : m_mutex(FiberMutex::ADAPTIVE),
+          m_streamBroker(streamBroker),
           m_connectionsPerHost(1u),
           m_closed(false)
     {
@@ -6,13 +6,28 @@
 
 #include "iomanager_epoll.h"
 
+#ifdef HAVE_CONFIG_H
+#include "autoconfig.h"
+#endif
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#endif
+#include <poll.h>
+#include <signal.h>
+#include <stdexcept>
 #include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 #include <boost/exception_ptr.hpp>
 
 #include "assert.h"
 #include "atomic.h"
+#include "config.h"
 #include "fiber.h"
+#include "statistics.h"
 
 // EPOLLRDHUP is missing in the header on etch
 #ifndef EPOLLRDHUP
@@ -23,6 +38,239 @@ namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:iomanager");
 
+static ConfigVar<bool>::ptr g_ioUring = Config::lookup(
+    "iomanager.iouring", false,
+    "Use io_uring instead of epoll in new IOManagers, if the kernel "
+    "supports it");
+static ConfigVar<size_t>::ptr g_ringEntries = Config::lookup<size_t>(
+    "iomanager.iouring.entries", 256u,
+    "Size of each IOManager's io_uring submission queue");
+
+static ConfigVar<size_t>::ptr g_maxEvents = Config::lookup<size_t>(
+    "iomanager.epoll.maxevents", 4096u,
+    "Largest number of events to retrieve with a single epoll_wait");
+
+static AverageMinMaxStatistic<unsigned int> &g_statEventsPerWakeup =
+    Statistics::registerStatistic("iomanager.epoll.eventsperwakeup",
+    AverageMinMaxStatistic<unsigned int>("events"));
+
+// The event array starts at this size, doubles whenever a wakeup fills it
+// (up to iomanager.epoll.maxevents), and halves again if a whole window of
+// wakeups used less than a quarter of it
+static const size_t g_minEvents = 64;
+static const unsigned int g_shrinkWindow = 64;
+
+// AsyncStates per segment of IOManager::m_pendingEvents; with 4096
+// segments, fds up to 4M are covered
+static const size_t g_segmentSize = 1024;
+
+#ifdef HAVE_IO_URING
+// io_uring user_data for requests whose completions are of no interest
+// (cancellations), and for the poll on the tickle pipe; anything else is an
+// IOManager::Operation
+static const unsigned long long g_ignoreCompletion = 0;
+static const unsigned long long g_tickleCompletion = 1;
+
+// glibc has no wrappers for the io_uring syscalls
+static int
+ioUringSetup(unsigned int entries, io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+ioUringEnter(int fd, unsigned int toSubmit, unsigned int minComplete,
+    unsigned int flags, void *arg, size_t argSize)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete,
+        flags, arg, argSize);
+}
+
+static void
+prepareSqe(io_uring_sqe &sqe, int opcode, int fd,
+    unsigned long long userData = g_ignoreCompletion)
+{
+    memset(&sqe, 0, sizeof(io_uring_sqe));
+    sqe.opcode = opcode;
+    sqe.fd = fd;
+    sqe.user_data = userData;
+}
+
+struct IOManager::Ring : boost::noncopyable
+{
+    Ring(unsigned int entries);
+    ~Ring();
+
+    /// Queue @c sqe, and submit everything that's queued
+    /// @return false if the kernel didn't take it yet; it stays queued, and
+    /// the next wait() submits it
+    /// @throws NativeException (EBUSY) if the queue stays full, in which case
+    /// @c sqe wasn't queued
+    bool submit(const io_uring_sqe &sqe);
+    /// Submit anything still queued, and wait until there is at least one
+    /// completion, or @c timeout microseconds (~0ull for no timeout) elapse
+    void wait(unsigned long long timeout);
+    /// Append the user_data and result of everything on the completion queue
+    /// to @c completions, and remove them from the queue
+    void reap(std::vector<std::pair<unsigned long long, int> > &completions);
+
+    int m_fd;
+    /// Heap allocated polls, plus the tickle poll, that haven't completed
+    size_t m_outstanding;
+    bool m_stopping;
+
+private:
+    void *m_ring;
+    size_t m_ringSize;
+    io_uring_sqe *m_sqes;
+    size_t m_sqesSize;
+    unsigned int m_sqEntries, m_sqMask, m_cqMask;
+    volatile unsigned int *m_sqHead, *m_sqTail, *m_cqHead, *m_cqTail;
+    unsigned int *m_sqArray;
+    io_uring_cqe *m_cqes;
+    boost::mutex m_sqMutex, m_cqMutex;
+};
+
+IOManager::Ring::Ring(unsigned int entries)
+    : m_outstanding(0),
+      m_stopping(false),
+      m_ring(MAP_FAILED),
+      m_sqes((io_uring_sqe *)MAP_FAILED)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(io_uring_params));
+    m_fd = ioUringSetup(entries, &params);
+    MORDOR_LOG_LEVEL(g_log, m_fd < 0 ? Log::ERROR : Log::TRACE) << this
+        << " io_uring_setup(" << entries << "): " << m_fd << " ("
+        << lastError() << ")";
+    if (m_fd < 0)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("io_uring_setup");
+    try {
+        // Extended wait arguments (for the timeout) are 5.11+; everything
+        // else we use is older
+        const unsigned int required = IORING_FEAT_SINGLE_MMAP |
+            IORING_FEAT_NODROP | IORING_FEAT_RW_CUR_POS | IORING_FEAT_EXT_ARG;
+        if ((params.features & required) != required)
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(ENOSYS, "io_uring_setup");
+        m_ringSize = std::max(
+            params.sq_off.array + params.sq_entries * sizeof(unsigned int),
+            params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        m_ring = mmap(NULL, m_ringSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+        if (m_ring == MAP_FAILED)
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mmap");
+        m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        m_sqes = (io_uring_sqe *)mmap(NULL, m_sqesSize,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd,
+            IORING_OFF_SQES);
+        if (m_sqes == MAP_FAILED)
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mmap");
+    } catch (...) {
+        if (m_ring != MAP_FAILED)
+            munmap(m_ring, m_ringSize);
+        close(m_fd);
+        throw;
+    }
+    char *ring = (char *)m_ring;
+    m_sqEntries = params.sq_entries;
+    m_sqMask = *(unsigned int *)(ring + params.sq_off.ring_mask);
+    m_sqHead = (unsigned int *)(ring + params.sq_off.head);
+    m_sqTail = (unsigned int *)(ring + params.sq_off.tail);
+    m_sqArray = (unsigned int *)(ring + params.sq_off.array);
+    m_cqMask = *(unsigned int *)(ring + params.cq_off.ring_mask);
+    m_cqHead = (unsigned int *)(ring + params.cq_off.head);
+    m_cqTail = (unsigned int *)(ring + params.cq_off.tail);
+    m_cqes = (io_uring_cqe *)(ring + params.cq_off.cqes);
+    // Submission queue entries are always used in order
+    for (unsigned int i = 0; i < m_sqEntries; ++i)
+        m_sqArray[i] = i;
+}
+
+IOManager::Ring::~Ring()
+{
+    munmap(m_sqes, m_sqesSize);
+    munmap(m_ring, m_ringSize);
+    close(m_fd);
+    MORDOR_LOG_TRACE(g_log) << this << " close(" << m_fd << ")";
+}
+
+bool
+IOManager::Ring::submit(const io_uring_sqe &sqe)
+{
+    boost::mutex::scoped_lock lock(m_sqMutex);
+    unsigned int tail = *m_sqTail;
+    // Entries are only left on the queue if the kernel refused them before
+    // (i.e. it is out of resources); try to flush them first
+    for (int i = 0; tail - *m_sqHead == m_sqEntries; ++i) {
+        if (i == 2)
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(EBUSY, "io_uring_enter");
+        ioUringEnter(m_fd, tail - *m_sqHead, 0, 0, NULL, 0);
+    }
+    m_sqes[tail & m_sqMask] = sqe;
+    // The entry must be visible before the new tail is
+    __sync_synchronize();
+    *m_sqTail = tail + 1;
+    int rc;
+    do {
+        rc = ioUringEnter(m_fd, tail + 1 - *m_sqHead, 0, 0, NULL, 0);
+    } while (rc < 0 && errno == EINTR);
+    MORDOR_LOG_LEVEL(g_log, rc < 0 && errno != EAGAIN && errno != EBUSY ?
+        Log::ERROR : Log::VERBOSE) << this << " io_uring_enter(" << m_fd
+        << ", " << (int)sqe.opcode << ", " << sqe.fd << "): " << rc << " ("
+        << lastError() << ")";
+    // Any failure (or a partial submission) leaves the entry queued, and
+    // it's too late to take it back: its user_data may be about to complete,
+    // so it has to be submitted later, not thrown away
+    return *m_sqHead == tail + 1;
+}
+
+void
+IOManager::Ring::wait(unsigned long long timeout)
+{
+    __kernel_timespec ts;
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(io_uring_getevents_arg));
+    arg.sigmask_sz = _NSIG / 8;
+    if (timeout != ~0ull) {
+        ts.tv_sec = timeout / 1000000;
+        ts.tv_nsec = (timeout % 1000000) * 1000;
+        arg.ts = (unsigned long long)(uintptr_t)&ts;
+    }
+    // Entries only stay queued if submit() was refused; the kernel
+    // serializes submissions, so racing with another submit() is harmless
+    unsigned int queued = *m_sqTail - *m_sqHead;
+    int rc = ioUringEnter(m_fd, queued, 1,
+        IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    MORDOR_LOG_LEVEL(g_log, rc < 0 && errno != ETIME && errno != EINTR ?
+        Log::ERROR : Log::VERBOSE) << this << " io_uring_enter(" << m_fd
+        << ", " << queued << ", GETEVENTS, " << (long long)timeout << "): "
+        << rc << " (" << lastError() << ")";
+    // Still short of resources: the idle loop will come back and try again
+    if (rc < 0 && errno != ETIME && errno != EINTR && errno != EBUSY &&
+        errno != EAGAIN)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("io_uring_enter");
+}
+
+void
+IOManager::Ring::reap(
+    std::vector<std::pair<unsigned long long, int> > &completions)
+{
+    boost::mutex::scoped_lock lock(m_cqMutex);
+    unsigned int head = *m_cqHead;
+    unsigned int tail = *m_cqTail;
+    // Don't read entries before the tail that says they're there
+    __sync_synchronize();
+    for (; head != tail; ++head) {
+        const io_uring_cqe &cqe = m_cqes[head & m_cqMask];
+        completions.push_back(std::make_pair(
+            (unsigned long long)cqe.user_data, (int)cqe.res));
+    }
+    // ... and finish reading them before giving them back
+    __sync_synchronize();
+    *m_cqHead = head;
+}
+#endif
+
 enum epoll_ctl_op_t
 {
     epoll_ctl_op_t_dummy = 0x7ffffff
@@ -122,14 +370,23 @@ IOManager::AsyncState::contextForEvent(Event event)
 }
 
 bool
-IOManager::AsyncState::triggerEvent(Event event, size_t &pendingEventCount)
+IOManager::AsyncState::triggerEvent(Event event, size_t &pendingEventCount,
+    Batch *batch)
 {
     if (!(m_events & event))
         return false;
     m_events = (Event)(m_events & ~event);
     atomicDecrement(pendingEventCount);
     EventContext &context = contextForEvent(event);
-    if (context.dg) {
+    if (batch && context.scheduler == batch->scheduler) {
+        if (context.dg) {
+            batch->dgs.push_back(NULL);
+            batch->dgs.back().swap(context.dg);
+        } else {
+            batch->fibers.push_back(boost::shared_ptr<Fiber>());
+            batch->fibers.back().swap(context.fiber);
+        }
+    } else if (context.dg) {
         context.scheduler->schedule(&context.dg);
     } else {
         context.scheduler->schedule(&context.fiber);
@@ -170,76 +427,166 @@ IOManager::AsyncState::resetContext(EventContext &context)
 
 IOManager::IOManager(size_t threads, bool useCaller, bool autoStart, size_t batchSize)
     : Scheduler(threads, useCaller, batchSize),
+      m_ring(NULL),
+      m_epfd(-1),
       m_pendingEventCount(0)
 {
-    m_epfd = epoll_create(5000);
-    MORDOR_LOG_LEVEL(g_log, m_epfd <= 0 ? Log::ERROR : Log::TRACE) << this
-        << " epoll_create(5000): " << m_epfd;
-    if (m_epfd <= 0)
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_create");
-    int rc = pipe(m_tickleFds);
-    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this << " pipe(): "
-        << rc << " (" << lastError() << ")";
-    if (rc) {
-        close(m_epfd);
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("pipe");
-    }
-    MORDOR_ASSERT(m_tickleFds[0] > 0);
-    MORDOR_ASSERT(m_tickleFds[1] > 0);
-    epoll_event event;
-    memset(&event, 0, sizeof(epoll_event));
-    event.events = EPOLLIN | EPOLLET;
-    event.data.fd = m_tickleFds[0];
-    rc = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK);
-    if (rc == -1) {
-        close(m_tickleFds[0]);
-        close(m_tickleFds[1]);
-        close(m_epfd);
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("fcntl");
+    memset(m_pendingEvents, 0, sizeof(m_pendingEvents));
+    if (g_ioUring->val()) {
+#ifdef HAVE_IO_URING
+        try {
+            m_ring = new Ring((unsigned int)g_ringEntries->val());
+        } catch (boost::exception &) {
+            MORDOR_LOG_WARNING(g_log) << this << " io_uring unavailable, "
+                << "using epoll: "
+                << boost::current_exception_diagnostic_information();
+        }
+#else
+        MORDOR_LOG_WARNING(g_log) << this << " built without io_uring, "
+            << "using epoll";
+#endif
     }
-    rc = fcntl(m_tickleFds[1], F_SETFL, O_NONBLOCK);
-    if (rc == -1) {
-        close(m_tickleFds[0]);
-        close(m_tickleFds[1]);
-        close(m_epfd);
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("fcntl");
-    }
-    rc = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
-    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
-        << " epoll_ctl(" << m_epfd << ", EPOLL_CTL_ADD, " << m_tickleFds[0]
-        << ", EPOLLIN | EPOLLET): " << rc << " (" << lastError() << ")";
-    if (rc) {
-        close(m_tickleFds[0]);
-        close(m_tickleFds[1]);
-        close(m_epfd);
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+    if (!m_ring) {
+        m_epfd = epoll_create(5000);
+        MORDOR_LOG_LEVEL(g_log, m_epfd <= 0 ? Log::ERROR : Log::TRACE) << this
+            << " epoll_create(5000): " << m_epfd;
+        if (m_epfd <= 0)
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_create");
     }
-    if (autoStart) {
+    try {
+        int rc = pipe(m_tickleFds);
+        MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this << " pipe(): "
+            << rc << " (" << lastError() << ")";
+        if (rc)
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("pipe");
+        MORDOR_ASSERT(m_tickleFds[0] > 0);
+        MORDOR_ASSERT(m_tickleFds[1] > 0);
         try {
-            start();
+            rc = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK);
+            if (rc == -1)
+                MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("fcntl");
+            rc = fcntl(m_tickleFds[1], F_SETFL, O_NONBLOCK);
+            if (rc == -1)
+                MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("fcntl");
+            if (m_ring) {
+                armTicklePoll();
+            } else {
+                epoll_event event;
+                memset(&event, 0, sizeof(epoll_event));
+                event.events = EPOLLIN | EPOLLET;
+                event.data.fd = m_tickleFds[0];
+                rc = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
+                MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+                    << " epoll_ctl(" << m_epfd << ", EPOLL_CTL_ADD, " << m_tickleFds[0]
+                    << ", EPOLLIN | EPOLLET): " << rc << " (" << lastError() << ")";
+                if (rc)
+                    MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+            }
+            if (autoStart)
+                start();
         } catch (...) {
             close(m_tickleFds[0]);
             close(m_tickleFds[1]);
-            close(m_epfd);
             throw;
         }
+    } catch (...) {
+#ifdef HAVE_IO_URING
+        if (m_ring)
+            delete m_ring;
+        else
+#endif
+            close(m_epfd);
+        throw;
     }
 }
 
 IOManager::~IOManager()
 {
     stop();
-    close(m_epfd);
-    MORDOR_LOG_TRACE(g_log) << this << " close(" << m_epfd << ")";
+#ifdef HAVE_IO_URING
+    if (m_ring) {
+        // Nothing is registered any more, but polls that were removed may
+        // not have completed yet; wait for them (and the tickle poll) so
+        // they can be freed
+        m_ring->m_stopping = true;
+        io_uring_sqe sqe;
+        prepareSqe(sqe, IORING_OP_POLL_REMOVE, -1);
+        sqe.addr = g_tickleCompletion;
+        m_ring->submit(sqe);
+        std::vector<std::pair<unsigned long long, int> > completions;
+        Batch batch(this);
+        while (m_ring->m_outstanding) {
+            m_ring->wait(~0ull);
+            m_ring->reap(completions);
+            for (size_t i = 0; i < completions.size(); ++i)
+                completeOperation(completions[i].first, completions[i].second,
+                    batch);
+            completions.clear();
+        }
+        MORDOR_ASSERT(batch.fibers.empty() && batch.dgs.empty());
+        delete m_ring;
+    } else
+#endif
+    {
+        close(m_epfd);
+        MORDOR_LOG_TRACE(g_log) << this << " close(" << m_epfd << ")";
+    }
     close(m_tickleFds[0]);
     MORDOR_LOG_VERBOSE(g_log) << this << " close(" << m_tickleFds[0] << ")";
     close(m_tickleFds[1]);
     // Yes, it would be more C++-esque to store a boost::shared_ptr in the
-    // vector, but that requires an extra allocation per fd for the counter
-    for (size_t i = 0; i < m_pendingEvents.size(); ++i) {
-        if (m_pendingEvents[i])
-            delete m_pendingEvents[i];
+    // table, but that requires an extra allocation per fd for the counter
+    for (size_t i = 0; i < sizeof(m_pendingEvents) / sizeof(m_pendingEvents[0]); ++i) {
+        AsyncState **segment = m_pendingEvents[i];
+        if (!segment)
+            continue;
+        for (size_t j = 0; j < g_segmentSize; ++j)
+            delete segment[j];
+        delete [] segment;
+    }
+}
+
+IOManager::AsyncState *
+IOManager::asyncState(int fd, bool create)
+{
+    size_t index = (size_t)fd / g_segmentSize;
+    if (index >= sizeof(m_pendingEvents) / sizeof(m_pendingEvents[0])) {
+        // Can't have been registered, and can't be
+        if (!create)
+            return NULL;
+        MORDOR_LOG_ERROR(g_log) << this << " fd " << fd
+            << " is beyond the AsyncState table";
+        MORDOR_THROW_EXCEPTION(std::out_of_range("fd"));
     }
+    AsyncState **segment = ((AsyncState ** volatile *)m_pendingEvents)[index];
+    if (!segment) {
+        if (!create)
+            return NULL;
+        AsyncState **newSegment = new AsyncState *[g_segmentSize];
+        memset(newSegment, 0, g_segmentSize * sizeof(AsyncState *));
+        segment = atomicCompareAndSwap(m_pendingEvents[index], newSegment,
+            (AsyncState **)NULL);
+        if (segment) {
+            // Someone else beat us to it
+            delete [] newSegment;
+        } else {
+            segment = newSegment;
+        }
+    }
+    AsyncState *state = ((AsyncState * volatile *)segment)[fd % g_segmentSize];
+    if (!state && create) {
+        AsyncState *newState = new AsyncState();
+        newState->m_fd = fd;
+        state = atomicCompareAndSwap(segment[fd % g_segmentSize], newState,
+            (AsyncState *)NULL);
+        if (state) {
+            delete newState;
+        } else {
+            state = newState;
+        }
+    }
+    MORDOR_ASSERT(!state || state->m_fd == fd);
+    return state;
 }
 
 bool
@@ -257,32 +604,29 @@ IOManager::registerEvent(int fd, Event event, boost::function<void ()> dg)
     MORDOR_ASSERT(dg || Fiber::getThis());
     MORDOR_ASSERT(event == READ || event == WRITE || event == CLOSE);
 
-    // Look up our state in the global map, expanding it if necessary
-    boost::mutex::scoped_lock lock(m_mutex);
-    if (m_pendingEvents.size() < (size_t)fd)
-        m_pendingEvents.resize(fd * 3 / 2);
-    if (!m_pendingEvents[fd - 1]) {
-        m_pendingEvents[fd - 1] = new AsyncState();
-        m_pendingEvents[fd - 1]->m_fd = fd;
-    }
-    AsyncState &state = *m_pendingEvents[fd - 1];
-    MORDOR_ASSERT(fd == state.m_fd);
-    lock.unlock();
+    // Look up our state in the table, expanding it if necessary
+    AsyncState &state = *asyncState(fd, true);
 
     boost::mutex::scoped_lock lock2(state.m_mutex);
 
     //MORDOR_ASSERT(!(state.m_events & event));
-    int op = state.m_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
-    epoll_event epevent;
-    epevent.events = EPOLLET | state.m_events | event;
-    epevent.data.ptr = &state;
-    int rc = epoll_ctl(m_epfd, op, fd, &epevent);
-    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
-        << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
-        << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc
-        << " (" << lastError() << ")";
-    if (rc)
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+    if (m_ring) {
+        // If the event is already registered, its poll is still armed
+        if (!(state.m_events & event))
+            armPoll(state, event);
+    } else {
+        int op = state.m_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        epoll_event epevent;
+        epevent.events = EPOLLET | state.m_events | event;
+        epevent.data.ptr = &state;
+        int rc = epoll_ctl(m_epfd, op, fd, &epevent);
+        MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+            << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
+            << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc
+            << " (" << lastError() << ")";
+        if (rc)
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+    }
     atomicIncrement(m_pendingEventCount);
     state.m_events = (Event)(state.m_events | event);
     AsyncState::EventContext &context = state.contextForEvent(event);
@@ -303,14 +647,10 @@ IOManager::unregisterEvent(int fd, Event event)
     MORDOR_ASSERT(fd > 0);
     MORDOR_ASSERT(event == READ || event == WRITE || event == CLOSE);
 
-    boost::mutex::scoped_lock lock(m_mutex);
-    if (m_pendingEvents.size() < (size_t)fd)
+    AsyncState *pState = asyncState(fd, false);
+    if (!pState)
         return false;
-    if (!m_pendingEvents[fd - 1])
-        return false;
-    AsyncState &state = *m_pendingEvents[fd - 1];
-    MORDOR_ASSERT(fd == state.m_fd);
-    lock.unlock();
+    AsyncState &state = *pState;
 
     boost::mutex::scoped_lock lock2(state.m_mutex);
     if (!(state.m_events & event))
@@ -318,20 +658,32 @@ IOManager::unregisterEvent(int fd, Event event)
 
     MORDOR_ASSERT(fd == state.m_fd);
     Event newEvents = (Event)(state.m_events &~event);
-    int op = newEvents ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events = EPOLLET | newEvents;
-    epevent.data.ptr = &state;
-    int rc = epoll_ctl(m_epfd, op, fd, &epevent);
-    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
-        << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
-        << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc
-        << " (" << lastError() << ")";
-    if (rc)
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+    AsyncState::EventContext &context = state.contextForEvent(event);
+    if (m_ring) {
+        MORDOR_ASSERT(context.op);
+        if (!context.op->poll) {
+            // The kernel may still be using an operation's buffers, so it
+            // can't just be forgotten; it completes (as cancelled) instead
+            cancelOperation(context.op);
+            return false;
+        }
+        cancelOperation(context.op);
+        context.op = NULL;
+    } else {
+        int op = newEvents ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+        epoll_event epevent;
+        epevent.events = EPOLLET | newEvents;
+        epevent.data.ptr = &state;
+        int rc = epoll_ctl(m_epfd, op, fd, &epevent);
+        MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+            << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
+            << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc
+            << " (" << lastError() << ")";
+        if (rc)
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+    }
     atomicDecrement(m_pendingEventCount);
     state.m_events = newEvents;
-    AsyncState::EventContext &context = state.contextForEvent(event);
     // spawn a dedicated fiber to do the cleanup
     state.resetContext(context);
     return true;
@@ -343,32 +695,38 @@ IOManager::cancelEvent(int fd, Event event)
     MORDOR_ASSERT(fd > 0);
     MORDOR_ASSERT(event == READ || event == WRITE || event == CLOSE);
 
-    boost::mutex::scoped_lock lock(m_mutex);
-    if (m_pendingEvents.size() < (size_t)fd)
-        return false;
-    if (!m_pendingEvents[fd - 1])
+    AsyncState *pState = asyncState(fd, false);
+    if (!pState)
         return false;
-    AsyncState &state = *m_pendingEvents[fd - 1];
-    MORDOR_ASSERT(fd == state.m_fd);
-    lock.unlock();
+    AsyncState &state = *pState;
 
     boost::mutex::scoped_lock lock2(state.m_mutex);
     if (!(state.m_events & event))
         return false;
 
     MORDOR_ASSERT(fd == state.m_fd);
-    Event newEvents = (Event)(state.m_events &~event);
-    int op = newEvents ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events = EPOLLET | newEvents;
-    epevent.data.ptr = &state;
-    int rc = epoll_ctl(m_epfd, op, fd, &epevent);
-    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
-        << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
-        << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc
-        << " (" << lastError() << ")";
-    if (rc)
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+    if (m_ring) {
+        AsyncState::EventContext &context = state.contextForEvent(event);
+        MORDOR_ASSERT(context.op);
+        cancelOperation(context.op);
+        // An operation fires when it completes
+        if (!context.op->poll)
+            return true;
+        context.op = NULL;
+    } else {
+        Event newEvents = (Event)(state.m_events &~event);
+        int op = newEvents ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+        epoll_event epevent;
+        epevent.events = EPOLLET | newEvents;
+        epevent.data.ptr = &state;
+        int rc = epoll_ctl(m_epfd, op, fd, &epevent);
+        MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+            << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
+            << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc
+            << " (" << lastError() << ")";
+        if (rc)
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+    }
     state.triggerEvent(event, m_pendingEventCount);
     return true;
 }
@@ -384,7 +742,19 @@ IOManager::stopping(unsigned long long &nextTimeout)
 void
 IOManager::idle()
 {
-    epoll_event events[64];
+    if (m_ring)
+        idleIoUring();
+    else
+        idleEPoll();
+}
+
+void
+IOManager::idleEPoll()
+{
+    std::vector<epoll_event> events(g_minEvents);
+    unsigned int wakeups = 0;
+    size_t peak = 0;
+    Batch batch(this);
     while (true) {
         unsigned long long nextTimeout;
         if (stopping(nextTimeout))
@@ -396,22 +766,19 @@ IOManager::idle()
                 timeout = (int)(nextTimeout / 1000) + 1;
             else
                 timeout = -1;
-            rc = epoll_wait(m_epfd, events, 64, timeout);
+            rc = epoll_wait(m_epfd, &events[0], (int)events.size(), timeout);
             if (rc < 0 && errno == EINTR)
                 nextTimeout = nextTimer();
             else
                 break;
         } while (true);
         MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::ERROR : Log::VERBOSE) << this
-            << " epoll_wait(" << m_epfd << ", 64, " << timeout << "): " << rc
-            << " (" << lastError() << ")";
+            << " epoll_wait(" << m_epfd << ", " << events.size() << ", "
+            << timeout << "): " << rc << " (" << lastError() << ")";
         if (rc < 0)
             MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_wait");
-        std::vector<boost::function<void ()> > expired = processTimers();
-        if (!expired.empty()) {
-            schedule(expired.begin(), expired.end());
-            expired.clear();
-        }
+        g_statEventsPerWakeup.update((unsigned int)rc);
+        processTimers().swap(batch.dgs);
 
         boost::exception_ptr exception;
         for(int i = 0; i < rc; ++i) {
@@ -471,13 +838,35 @@ IOManager::idle()
             }
             bool triggered = false;
             if (incomingEvents & READ)
-                triggered = state.triggerEvent(READ, m_pendingEventCount);
+                triggered = state.triggerEvent(READ, m_pendingEventCount,
+                    &batch);
             if (incomingEvents & WRITE)
-                triggered = state.triggerEvent(WRITE, m_pendingEventCount) || triggered;
+                triggered = state.triggerEvent(WRITE, m_pendingEventCount,
+                    &batch) || triggered;
             if (incomingEvents & CLOSE)
-                triggered = state.triggerEvent(CLOSE, m_pendingEventCount) || triggered;
+                triggered = state.triggerEvent(CLOSE, m_pendingEventCount,
+                    &batch) || triggered;
             MORDOR_ASSERT(triggered);
         }
+        // One lock acquisition and at most one tickle for everything that
+        // became ready on this wakeup
+        schedule(batch.fibers, batch.dgs);
+
+        if ((size_t)rc == events.size()) {
+            size_t maxEvents = std::max(g_maxEvents->val(), g_minEvents);
+            if (events.size() < maxEvents)
+                events.resize(std::min(events.size() * 2, maxEvents));
+            wakeups = 0;
+            peak = 0;
+        } else {
+            peak = std::max(peak, (size_t)rc);
+            if (++wakeups == g_shrinkWindow) {
+                if (events.size() > g_minEvents && peak < events.size() / 4)
+                    events.resize(events.size() / 2);
+                wakeups = 0;
+                peak = 0;
+            }
+        }
         if (exception)
             boost::rethrow_exception(exception);
         try {
@@ -501,6 +890,265 @@ IOManager::tickle()
     MORDOR_VERIFY(rc == 1 || (rc < 0 && errno == EAGAIN));
 }
 
+#ifdef HAVE_IO_URING
+void
+IOManager::idleIoUring()
+{
+    std::vector<std::pair<unsigned long long, int> > completions;
+    Batch batch(this);
+    while (true) {
+        unsigned long long nextTimeout;
+        if (stopping(nextTimeout))
+            return;
+        m_ring->wait(nextTimeout);
+        m_ring->reap(completions);
+        processTimers().swap(batch.dgs);
+
+        boost::exception_ptr exception;
+        for (size_t i = 0; i < completions.size(); ++i) {
+            try {
+                completeOperation(completions[i].first, completions[i].second,
+                    batch);
+            } catch (boost::exception &) {
+                exception = boost::current_exception();
+            }
+        }
+        completions.clear();
+        schedule(batch.fibers, batch.dgs);
+        if (exception)
+            boost::rethrow_exception(exception);
+        try {
+            Fiber::yield();
+        } catch (OperationAbortedException &) {
+            return;
+        }
+    }
+}
+
+void
+IOManager::completeOperation(unsigned long long userData, int result,
+    Batch &batch)
+{
+    if (userData == g_ignoreCompletion)
+        return;
+    if (userData == g_tickleCompletion) {
+        atomicDecrement(m_ring->m_outstanding);
+        unsigned char dummy[256];
+        int rc;
+        while ((rc = ::read(m_tickleFds[0], dummy, 256)) > 0) {
+            MORDOR_LOG_VERBOSE(g_log) << this << " received " << rc << " tickles";
+        }
+        MORDOR_VERIFY(rc < 0 && errno == EAGAIN);
+        if (!m_ring->m_stopping)
+            armTicklePoll();
+        return;
+    }
+    Operation *op = (Operation *)(uintptr_t)userData;
+    // A completed operation's Operation may be gone as soon as its Fiber is
+    // scheduled
+    bool poll = op->poll;
+    AsyncState &state = *op->state;
+    {
+        boost::mutex::scoped_lock lock(state.m_mutex);
+        MORDOR_LOG_TRACE(g_log) << this << " completion {" << state.m_fd
+            << ", " << op->event << ", " << result << "}";
+        AsyncState::EventContext &context = state.contextForEvent(op->event);
+        // Otherwise, this is a poll that was removed
+        if (context.op == op) {
+            context.op = NULL;
+            op->result = result;
+            bool triggered = state.triggerEvent(op->event,
+                m_pendingEventCount, &batch);
+            MORDOR_ASSERT(triggered);
+        }
+    }
+    if (poll) {
+        atomicDecrement(m_ring->m_outstanding);
+        delete op;
+    }
+}
+
+void
+IOManager::armPoll(AsyncState &state, Event event)
+{
+    io_uring_sqe sqe;
+    Operation *op = new Operation(&state, event, true);
+    prepareSqe(sqe, IORING_OP_POLL_ADD, state.m_fd, (uintptr_t)op);
+    unsigned int mask = event == READ ? POLLIN :
+        event == WRITE ? POLLOUT : POLLRDHUP;
+#if __BYTE_ORDER == __BIG_ENDIAN
+    mask = (mask << 16) | (mask >> 16);
+#endif
+    sqe.poll32_events = mask;
+    atomicIncrement(m_ring->m_outstanding);
+    bool submitted;
+    try {
+        submitted = m_ring->submit(sqe);
+    } catch (...) {
+        atomicDecrement(m_ring->m_outstanding);
+        delete op;
+        throw;
+    }
+    state.contextForEvent(event).op = op;
+    // Get an idle thread to submit it
+    if (!submitted)
+        tickle();
+}
+
+void
+IOManager::cancelOperation(Operation *op)
+{
+    io_uring_sqe sqe;
+    prepareSqe(sqe, op->poll ? IORING_OP_POLL_REMOVE : IORING_OP_ASYNC_CANCEL,
+        -1);
+    sqe.addr = (uintptr_t)op;
+    if (!m_ring->submit(sqe))
+        tickle();
+}
+
+void
+IOManager::armTicklePoll()
+{
+    io_uring_sqe sqe;
+    prepareSqe(sqe, IORING_OP_POLL_ADD, m_tickleFds[0], g_tickleCompletion);
+    sqe.poll32_events = POLLIN;
+    atomicIncrement(m_ring->m_outstanding);
+    // This is only called before the idle loop waits (again), and that
+    // submits it if the kernel didn't take it now
+    try {
+        m_ring->submit(sqe);
+    } catch (...) {
+        atomicDecrement(m_ring->m_outstanding);
+        throw;
+    }
+}
+
+int
+IOManager::submitOperation(int fd, Event event, void *sqe,
+    const error_t *cancelled)
+{
+    MORDOR_ASSERT(m_ring);
+    MORDOR_ASSERT(fd >= 0);
+    MORDOR_ASSERT(Scheduler::getThis());
+    MORDOR_ASSERT(Fiber::getThis());
+    AsyncState &state = *asyncState(fd, true);
+    Operation op(&state, event, false);
+    ((io_uring_sqe *)sqe)->user_data = (uintptr_t)&op;
+    bool submitted;
+    {
+        boost::mutex::scoped_lock lock(state.m_mutex);
+        MORDOR_ASSERT(!(state.m_events & event));
+        // Completions can't be processed until we release the lock, so it's
+        // safe to register only once the kernel has accepted (or queued) it
+        submitted = m_ring->submit(*(io_uring_sqe *)sqe);
+        atomicIncrement(m_pendingEventCount);
+        state.m_events = (Event)(state.m_events | event);
+        AsyncState::EventContext &context = state.contextForEvent(event);
+        context.scheduler = Scheduler::getThis();
+        context.fiber = Fiber::getThis();
+        context.op = &op;
+    }
+    // Get an idle thread to submit it
+    if (!submitted)
+        tickle();
+    // Whoever set *cancelled either saw our registration when they called
+    // cancelEvent, or we see their cancellation now
+    if (cancelled && cancelled->value)
+        cancelEvent(fd, event);
+    Scheduler::yieldTo();
+    return op.result;
+}
+
+int
+IOManager::readv(int fd, const iovec *iov, int iovcnt)
+{
+    io_uring_sqe sqe;
+    prepareSqe(sqe, IORING_OP_READV, fd);
+    sqe.addr = (uintptr_t)iov;
+    sqe.len = iovcnt;
+    sqe.off = (unsigned long long)-1;
+    return submitOperation(fd, READ, &sqe, NULL);
+}
+
+int
+IOManager::writev(int fd, const iovec *iov, int iovcnt)
+{
+    io_uring_sqe sqe;
+    prepareSqe(sqe, IORING_OP_WRITEV, fd);
+    sqe.addr = (uintptr_t)iov;
+    sqe.len = iovcnt;
+    sqe.off = (unsigned long long)-1;
+    return submitOperation(fd, WRITE, &sqe, NULL);
+}
+
+int
+IOManager::recvmsg(int fd, msghdr *msg, int flags, const error_t *cancelled)
+{
+    io_uring_sqe sqe;
+    prepareSqe(sqe, IORING_OP_RECVMSG, fd);
+    sqe.addr = (uintptr_t)msg;
+    sqe.len = 1;
+    sqe.msg_flags = flags;
+    return submitOperation(fd, READ, &sqe, cancelled);
+}
+
+int
+IOManager::sendmsg(int fd, const msghdr *msg, int flags,
+    const error_t *cancelled)
+{
+    io_uring_sqe sqe;
+    prepareSqe(sqe, IORING_OP_SENDMSG, fd);
+    sqe.addr = (uintptr_t)msg;
+    sqe.len = 1;
+    sqe.msg_flags = flags;
+    return submitOperation(fd, WRITE, &sqe, cancelled);
+}
+
+int
+IOManager::accept(int fd, const error_t *cancelled)
+{
+    io_uring_sqe sqe;
+    prepareSqe(sqe, IORING_OP_ACCEPT, fd);
+    return submitOperation(fd, READ, &sqe, cancelled);
+}
+
+int
+IOManager::connect(int fd, const sockaddr *addr, socklen_t addrlen,
+    const error_t *cancelled)
+{
+    io_uring_sqe sqe;
+    prepareSqe(sqe, IORING_OP_CONNECT, fd);
+    sqe.addr = (uintptr_t)addr;
+    sqe.off = addrlen;
+    return submitOperation(fd, WRITE, &sqe, cancelled);
+}
+
+int
+IOManager::fsync(int fd)
+{
+    io_uring_sqe sqe;
+    prepareSqe(sqe, IORING_OP_FSYNC, fd);
+    return submitOperation(fd, WRITE, &sqe, NULL);
+}
+#else
+// Without io_uring, m_ring is always NULL, so none of these are reachable
+void IOManager::idleIoUring() { MORDOR_NOTREACHED(); }
+void IOManager::armPoll(AsyncState &, Event) { MORDOR_NOTREACHED(); }
+void IOManager::cancelOperation(Operation *) { MORDOR_NOTREACHED(); }
+void IOManager::armTicklePoll() { MORDOR_NOTREACHED(); }
+
+int IOManager::readv(int, const iovec *, int) { return -ENOSYS; }
+int IOManager::writev(int, const iovec *, int) { return -ENOSYS; }
+int IOManager::recvmsg(int, msghdr *, int, const error_t *)
+{ return -ENOSYS; }
+int IOManager::sendmsg(int, const msghdr *, int, const error_t *)
+{ return -ENOSYS; }
+int IOManager::accept(int, const error_t *) { return -ENOSYS; }
+int IOManager::connect(int, const sockaddr *, socklen_t, const error_t *)
+{ return -ENOSYS; }
+int IOManager::fsync(int) { return -ENOSYS; }
+#endif
+
 }
 
 #endif
@@ -2,6 +2,8 @@
 #define __MORDOR_IOMANAGER_EPOLL_H__
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <sys/socket.h>
+
 #include "scheduler.h"
 #include "timer.h"
 #include "version.h"
@@ -10,10 +12,19 @@
 #error IOManagerEPoll is Linux only
 #endif
 
+struct iovec;
+
 namespace Mordor {
 
 class Fiber;
 
+/// Linux IOManager
+
+/// Waits for readiness with epoll, or, if iomanager.iouring is set when it is
+/// constructed (and the kernel supports it), drives everything through an
+/// io_uring instead.  With io_uring, registerEvent() arms a one-shot poll,
+/// and the operations below (readv, writev, ...) are submitted to the ring
+/// and complete asynchronously, as with IOCP on Windows.
 class IOManager : public Scheduler, public TimerManager
 {
 public:
@@ -25,6 +36,30 @@ public:
     };
 
 private:
+    /// Work woken by one epoll_wait, to be handed to a Scheduler all at once
+    struct Batch
+    {
+        Batch(Scheduler *s) : scheduler(s) {}
+        Scheduler *scheduler;
+        std::vector<boost::shared_ptr<Fiber> > fibers;
+        std::vector<boost::function<void ()> > dgs;
+    };
+
+    struct AsyncState;
+    /// An io_uring request on behalf of an AsyncState: either the one-shot
+    /// poll armed by registerEvent() (heap allocated, and freed when it
+    /// completes), or an operation whose result the waiting Fiber collects
+    /// (on that Fiber's stack)
+    struct Operation
+    {
+        Operation(AsyncState *s, Event e, bool p)
+            : state(s), event(e), poll(p), result(0) {}
+        AsyncState *state;
+        Event event;
+        bool poll;
+        int result;
+    };
+
     struct AsyncState : boost::noncopyable
     {
         AsyncState();
@@ -32,14 +67,19 @@ private:
 
         struct EventContext
         {
-            EventContext() : scheduler(NULL) {}
+            EventContext() : scheduler(NULL), op(NULL) {}
             Scheduler *scheduler;
             boost::shared_ptr<Fiber> fiber;
             boost::function<void ()> dg;
+            /// The in-flight io_uring request for this event, if any
+            Operation *op;
         };
 
         EventContext &contextForEvent(Event event);
-        bool triggerEvent(Event event, size_t &pendingEventCount);
+        /// If @c batch is given, and the event is for batch->scheduler, the
+        /// Fiber or delegate is added to it instead of being scheduled
+        bool triggerEvent(Event event, size_t &pendingEventCount,
+            Batch *batch = NULL);
         void resetContext(EventContext &);
 
         int m_fd;
@@ -53,9 +93,12 @@ private:
 
 public:
     /// @param autoStart  whether call the start() automatically in constructor
+    /// @param batchSize Number of operations to pull off the scheduler queue
+    /// on every iteration
     /// @note @p autoStart provides a more friendly behavior for derived class
     ///      that inherits from IOManager
-    IOManager(size_t threads = 1, bool useCaller = true, bool autoStart = true);
+    IOManager(size_t threads = 1, bool useCaller = true, bool autoStart = true,
+        size_t batchSize = 1);
     ~IOManager();
 
     bool stopping();
@@ -66,8 +109,43 @@ public:
     /// @return If the event was successfully unregistered before firing normally
     bool unregisterEvent(int fd, Event events);
     /// Will cause the event to fire
+    ///
+    /// For an io_uring operation, the operation is cancelled, and the event
+    /// fires once the kernel has finished with it
     bool cancelEvent(int fd, Event events);
 
+    /// If this IOManager is using io_uring, and the operations below are
+    /// available
+    bool usingIoUring() const { return m_ring != NULL; }
+
+    /// @name io_uring operations
+    /// Each of these submits the operation, and suspends the current Fiber
+    /// until it completes.  While in flight, an operation occupies @p fd's
+    /// READ (readv, recvmsg, accept) or WRITE (writev, sendmsg, connect,
+    /// fsync) event, and cancelEvent() on that event will abort it.  If
+    /// @p cancelled is given, and is set (by someone who then calls
+    /// cancelEvent()) while the operation is being submitted, the operation
+    /// is cancelled too.
+    ///
+    /// The fd should not be in non-blocking mode, otherwise the kernel will
+    /// just complete the operation with -EAGAIN if it would block.
+    /// @return What the equivalent syscall would return, or -errno
+    /// @pre usingIoUring()
+    /// @{
+    /// readv at the current file position
+    int readv(int fd, const iovec *iov, int iovcnt);
+    /// writev at the current file position
+    int writev(int fd, const iovec *iov, int iovcnt);
+    int recvmsg(int fd, msghdr *msg, int flags,
+        const error_t *cancelled = NULL);
+    int sendmsg(int fd, const msghdr *msg, int flags,
+        const error_t *cancelled = NULL);
+    int accept(int fd, const error_t *cancelled = NULL);
+    int connect(int fd, const sockaddr *addr, socklen_t addrlen,
+        const error_t *cancelled = NULL);
+    int fsync(int fd);
+    /// @}
+
 protected:
     bool stopping(unsigned long long &nextTimeout);
     void idle();
@@ -76,11 +154,37 @@ protected:
     void onTimerInsertedAtFront() { tickle(); }
 
 private:
+    /// Find the AsyncState for @c fd, optionally creating it
+    /// @return NULL if it doesn't exist and @c create is false
+    AsyncState *asyncState(int fd, bool create);
+
+    struct Ring;
+    /// Submit @c sqe (an io_uring_sqe) as @c event on @c fd, and yield until
+    /// it completes
+    int submitOperation(int fd, Event event, void *sqe,
+        const error_t *cancelled);
+    /// Arm a one-shot poll for @c event on @c state's fd
+    /// @pre state.m_mutex is held
+    void armPoll(AsyncState &state, Event event);
+    /// Ask the kernel to abort a poll or operation
+    void cancelOperation(Operation *op);
+    void armTicklePoll();
+    void idleEPoll();
+    void idleIoUring();
+    /// Handle one io_uring completion
+    void completeOperation(unsigned long long userData, int result,
+        Batch &batch);
+
+private:
+    Ring *m_ring;
     int m_epfd;
     int m_tickleFds[2];
     size_t m_pendingEventCount;
-    boost::mutex m_mutex;
-    std::vector<AsyncState *> m_pendingEvents;
+    /// AsyncStates indexed by fd, in fixed-size segments that are allocated
+    /// on demand.  Neither segments nor AsyncStates are freed or moved until
+    /// the IOManager is destroyed, so lookups need no lock; publishing a new
+    /// one is a compare-and-swap.
+    AsyncState **m_pendingEvents[4096];
 };
 
 }
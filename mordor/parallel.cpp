@@ -2,6 +2,8 @@
 
 #include "parallel.h"
 
+#include <algorithm>
+
 #include <boost/scoped_ptr.hpp>
 
 #include "assert.h"
@@ -131,4 +133,86 @@ Logger::ptr getLogger()
     return g_log;
 }
 
+ParallelRange::ParallelRange(size_t size, int parallelism)
+    : m_size(size),
+      m_parallelism(parallelism),
+      m_next(0),
+      m_failed(false),
+      m_scheduler(NULL),
+      m_count(0)
+{
+    MORDOR_ASSERT(parallelism > 0);
+}
+
+void
+ParallelRange::run(const boost::function<void (size_t)> &worker)
+{
+    m_scheduler = Scheduler::getThis();
+    if (m_parallelism == 1 || !m_scheduler) {
+        MORDOR_LOG_DEBUG(g_log) << " running parallel range of " << m_size
+            << " sequentially";
+        worker(0);
+        return;
+    }
+    // No point in Fibers that won't get anything to do
+    int fibers = (int)std::min<size_t>(m_parallelism, m_size);
+    MORDOR_LOG_DEBUG(g_log) << " running parallel range of " << m_size
+        << " with " << fibers << " fibers";
+    if (fibers == 0)
+        return;
+    m_caller = Fiber::getThis();
+    m_count = fibers;
+    for (int i = 0; i < fibers; ++i)
+        m_scheduler->schedule(boost::bind(&ParallelRange::work, this,
+            boost::cref(worker), i));
+    Scheduler::yieldTo();
+    m_caller.reset();
+    if (m_exception)
+        Mordor::rethrow_exception(m_exception);
+}
+
+void
+ParallelRange::work(const boost::function<void (size_t)> &worker,
+    size_t index)
+{
+    try {
+        worker(index);
+    } catch (boost::exception &ex) {
+        removeTopFrames(ex);
+        boost::mutex::scoped_lock lock(m_mutex);
+        if (!m_exception)
+            m_exception = boost::current_exception();
+        m_failed = true;
+    } catch (...) {
+        boost::mutex::scoped_lock lock(m_mutex);
+        if (!m_exception)
+            m_exception = boost::current_exception();
+        m_failed = true;
+    }
+    // Don't touch anything after this; the caller may already be gone
+    Scheduler *scheduler = m_scheduler;
+    Fiber::ptr caller = m_caller;
+    if (atomicDecrement(m_count) == 0)
+        scheduler->schedule(caller);
+}
+
+bool
+ParallelRange::claim(size_t &start, size_t &end)
+{
+    if (m_failed)
+        return false;
+    size_t next = m_next;
+    if (next >= m_size)
+        return false;
+    // Guided: a share of what's left, shrinking towards single objects
+    size_t chunk = std::max<size_t>(1,
+        (m_size - next) / (4 * m_parallelism));
+    end = atomicAdd(m_next, chunk);
+    start = end - chunk;
+    if (start >= m_size)
+        return false;
+    end = std::min(end, m_size);
+    return true;
+}
+
 }}
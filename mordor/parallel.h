@@ -2,6 +2,7 @@
 #define __MORDOR_PARALLEL_H__
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <iterator>
 #include <vector>
 
 #include <boost/bind.hpp>
@@ -88,29 +89,104 @@ parallel_foreach_impl(Iterator &begin, Iterator &end, Functor &functor,
 
 Logger::ptr getLogger();
 
+/// Shared state for splitting a random access range between Fibers
+///
+/// Each worker repeatedly claims a chunk of the range with an atomic add.
+/// Chunks start large, and shrink as the range is used up, so that the work
+/// still balances out at the end; the chunk size is computed from a racy
+/// read of what's left, but the add itself is what claims the chunk, so
+/// chunks never overlap.
+struct ParallelRange : boost::noncopyable
+{
+    ParallelRange(size_t size, int parallelism);
+
+    /// Run @p worker on up to parallelism Fibers, passing each its index,
+    /// and wait for them all to finish
+    ///
+    /// If there is no Scheduler, or parallelism is 1, worker(0) is simply
+    /// called directly.  Otherwise, the first exception thrown by a worker
+    /// stops the others before they start their next item, and is rethrown.
+    void run(const boost::function<void (size_t)> &worker);
+
+    /// @return If a chunk [start, end) was claimed; false once the range is
+    /// used up, or another worker has failed
+    bool claim(size_t &start, size_t &end);
+    /// Another worker has thrown an exception; stop as soon as possible
+    bool failed() const { return m_failed; }
+
+    size_t size() const { return m_size; }
+    int parallelism() const { return m_parallelism; }
+
+private:
+    void work(const boost::function<void (size_t)> &worker, size_t index);
+
+private:
+    const size_t m_size;
+    const int m_parallelism;
+    volatile size_t m_next;
+    volatile bool m_failed;
+    boost::mutex m_mutex;
+    boost::exception_ptr m_exception;
+    Scheduler *m_scheduler;
+    Fiber::ptr m_caller;
+    int m_count;
+};
+
+template<class Iterator, class Functor>
+static
+void
+parallel_foreach_chunks(Iterator begin, Functor &functor,
+    ParallelRange &range, size_t)
+{
+    size_t start, end;
+    while (range.claim(start, end)) {
+        for (; start < end; ++start) {
+            if (range.failed())
+                return;
+            functor(begin[start]);
+        }
+    }
 }
 
-/// Execute a functor for multiple objects in parallel
+template<class Iterator, class T, class Op>
+static
+void
+parallel_reduce_chunks(Iterator begin, const T &identity, Op &op,
+    std::vector<T> &partials, ParallelRange &range, size_t index)
+{
+    T result = identity;
+    size_t start, end;
+    while (range.claim(start, end)) {
+        for (; start < end; ++start) {
+            if (range.failed())
+                return;
+            result = op(result, begin[start]);
+        }
+    }
+    partials[index] = result;
+}
+
+template<class InputIterator, class OutputIterator, class Functor>
+static
+void
+parallel_transform_chunks(InputIterator begin, OutputIterator out,
+    Functor &functor, ParallelRange &range, size_t)
+{
+    size_t start, end;
+    while (range.claim(start, end)) {
+        for (; start < end; ++start) {
+            if (range.failed())
+                return;
+            out[start] = functor(begin[start]);
+        }
+    }
+}
 
-/// @ingroup parallel_do
-/// Execute a functor for multiple objects in parallel by scheduling up to
-/// parallelism at a time on the current Scheduler.  Concurrency is achieved
-/// either because the Scheduler is running on multiple threads, or because the
-/// the functor yields to the Scheduler during execution, instead of blocking.
-/// @tparam Iterator The type of the iterator for the collection
-/// @tparam T The type returned by dereferencing the Iterator, and then passed
-/// to the functor
-/// @param begin The beginning of the collection
-/// @param end The end of the collection
-/// @param dg The functor to be passed each object in the collection
-/// @param parallelism How many objects to Schedule in parallel
 template<class Iterator, class Functor>
 void
-parallel_foreach(Iterator begin, Iterator end, Functor functor,
-    int parallelism = -1)
+parallel_foreach(Iterator begin, Iterator end, Functor &functor,
+    int parallelism, std::input_iterator_tag)
 {
-    if (parallelism == -1)
-        parallelism = 4;
     Scheduler *scheduler = Scheduler::getThis();
 
     if (parallelism == 1 || !scheduler) {
@@ -139,6 +215,105 @@ parallel_foreach(Iterator begin, Iterator end, Functor functor,
         Mordor::rethrow_exception(exception);
 }
 
+template<class Iterator, class Functor>
+void
+parallel_foreach(Iterator begin, Iterator end, Functor &functor,
+    int parallelism, std::random_access_iterator_tag)
+{
+    ParallelRange range(end - begin, parallelism);
+    range.run(boost::bind(&parallel_foreach_chunks<Iterator, Functor>,
+        begin, boost::ref(functor), boost::ref(range), _1));
+}
+
+}
+
+/// Execute a functor for multiple objects in parallel
+
+/// @ingroup parallel_do
+/// Execute a functor for multiple objects in parallel by scheduling up to
+/// parallelism at a time on the current Scheduler.  Concurrency is achieved
+/// either because the Scheduler is running on multiple threads, or because the
+/// the functor yields to the Scheduler during execution, instead of blocking.
+/// @tparam Iterator The type of the iterator for the collection
+/// @tparam T The type returned by dereferencing the Iterator, and then passed
+/// to the functor
+/// @param begin The beginning of the collection
+/// @param end The end of the collection
+/// @param dg The functor to be passed each object in the collection
+/// @param parallelism How many objects to Schedule in parallel
+/// @note For random access iterators, each Fiber claims chunks of the
+/// collection at a time with a single atomic operation, instead of taking
+/// a lock for each object; see Detail::ParallelRange.
+template<class Iterator, class Functor>
+void
+parallel_foreach(Iterator begin, Iterator end, Functor functor,
+    int parallelism = -1)
+{
+    if (parallelism == -1)
+        parallelism = 4;
+    Detail::parallel_foreach(begin, end, functor, parallelism,
+        typename std::iterator_traits<Iterator>::iterator_category());
+}
+
+/// Combine all the objects in a collection in parallel
+
+/// @ingroup parallel_do
+/// The range is split into chunks between up to parallelism Fibers, each of
+/// which folds its share of the objects into its own result (starting from
+/// @p identity); the results are then folded together.  The order in which
+/// objects are combined is therefore undefined, so @p op should be
+/// associative and commutative.  Exceptions are handled as for
+/// parallel_foreach.
+/// @param begin The beginning of the collection
+/// @param end The end of the collection
+/// @param identity The result for an empty collection; op(identity, x) must
+/// be x
+/// @param op Called as op(T, T) to combine two results (or a result and an
+/// object from the collection)
+/// @param parallelism How many Fibers to use
+template<class Iterator, class T, class Op>
+T
+parallel_reduce(Iterator begin, Iterator end, T identity, Op op,
+    int parallelism = -1)
+{
+    if (parallelism == -1)
+        parallelism = 4;
+    Detail::ParallelRange range(end - begin, parallelism);
+    std::vector<T> partials(parallelism, identity);
+    range.run(boost::bind(&Detail::parallel_reduce_chunks<Iterator, T, Op>,
+        begin, boost::cref(identity), boost::ref(op), boost::ref(partials),
+        boost::ref(range), _1));
+    T result = identity;
+    for (typename std::vector<T>::const_iterator it = partials.begin();
+        it != partials.end();
+        ++it)
+        result = op(result, *it);
+    return result;
+}
+
+/// Apply a functor to each object in a collection in parallel, storing the
+/// results
+
+/// @ingroup parallel_do
+/// out[i] = functor(begin[i]) for every object in [begin, end), in chunks
+/// split between up to parallelism Fibers.  Exceptions are handled as for
+/// parallel_foreach, except that which results have been stored is
+/// undefined.
+/// @param out The beginning of where to store the results; must be random
+/// access, and have room for end - begin results
+template<class InputIterator, class OutputIterator, class Functor>
+void
+parallel_transform(InputIterator begin, InputIterator end,
+    OutputIterator out, Functor functor, int parallelism = -1)
+{
+    if (parallelism == -1)
+        parallelism = 4;
+    Detail::ParallelRange range(end - begin, parallelism);
+    range.run(boost::bind(&Detail::parallel_transform_chunks<InputIterator,
+        OutputIterator, Functor>, begin, out, boost::ref(functor),
+        boost::ref(range), _1));
+}
+
 }
 
 #endif
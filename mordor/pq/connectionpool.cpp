@@ -22,7 +22,7 @@ ConnectionPool::ConnectionPool(
     size_t num, unsigned long long idleTolerance)
     : m_conninfo(conninfo)
     , m_iomanager(iomanager)
-    , m_mutex()
+    , m_mutex(FiberMutex::ADAPTIVE)
     , m_condition(m_mutex)
     , m_total(num)
     , m_idleTolerance(idleTolerance) {
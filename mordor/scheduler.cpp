@@ -3,24 +3,115 @@
 #include "scheduler.h"
 
 #include <boost/bind.hpp>
+#include <boost/thread/tss.hpp>
 
 #include "atomic.h"
 #include "assert.h"
+#include "config.h"
 #include "fiber.h"
+#include "statistics.h"
+#include "timer.h"
 
 namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:scheduler");
 
+static ConfigVar<bool>::ptr g_workStealing = Config::lookup(
+    "scheduler.workstealing", false,
+    "Give each scheduler thread its own run queue, and steal work from "
+    "other threads when idle");
+
+// How often (in iterations of the run loop) a thread with local work checks
+// the shared queue first anyway, so that thread-targeted work and work
+// scheduled from outside the Scheduler can't be starved
+static const unsigned int g_sharedQueueInterval = 61;
+
+// Upper bound on each thread's free list of FiberAndThreads
+static const size_t g_taskCacheSize = 1024;
+
+// How often (in iterations of the run loop) a thread looks at the NORMAL
+// and LOW classes of the shared queue before the HIGH class
+static const unsigned int g_normalFirstInterval = 4;
+static const unsigned int g_lowFirstInterval = 16;
+
+namespace {
+struct PriorityStatistics
+{
+    PriorityStatistics(const std::string &name)
+        : queued(Statistics::registerStatistic("scheduler." + name + ".queued",
+            PerThreadCountStatistic<unsigned int>("tasks"),
+            "tasks scheduled in the " + name + " class that haven't run yet")),
+          wait(Statistics::registerStatistic("scheduler." + name + ".wait",
+            PerThreadHistogramStatistic<unsigned long long>("us"),
+            "time from being scheduled in the " + name +
+            " class to starting to run"))
+    {}
+
+    PerThreadCountStatistic<unsigned int> &queued;
+    PerThreadHistogramStatistic<unsigned long long> &wait;
+};
+
+struct TaskCache
+{
+    TaskCache() : head(NULL), count(0) {}
+    ~TaskCache();
+
+    void *head;
+    size_t count;
+};
+}
+
+static HistogramStatistic<unsigned int> &g_statDepth =
+    Statistics::registerStatistic("scheduler.depth",
+    HistogramStatistic<unsigned int>("tasks"),
+    "tasks waiting to run, each time a thread looks at the shared queue");
+static PerThreadHistogramStatistic<unsigned long long> &g_statLatency =
+    Statistics::registerStatistic("scheduler.latency",
+    PerThreadHistogramStatistic<unsigned long long>("us"),
+    "time from being scheduled to starting to run");
+static PerThreadHistogramStatistic<unsigned long long> &g_statSlice =
+    Statistics::registerStatistic("scheduler.slice",
+    PerThreadHistogramStatistic<unsigned long long>("us"),
+    "time from switching to a fiber (or run of delegates) to getting "
+    "control back");
+
+// Indexed by Scheduler::Priority
+static PriorityStatistics g_statPriorities[] = {
+    PriorityStatistics("high"),
+    PriorityStatistics("normal"),
+    PriorityStatistics("low")
+};
+
+// Fast access to the free list, and ownership so it is freed at thread exit
+static ThreadLocalStorage<TaskCache *> t_taskCache;
+static boost::thread_specific_ptr<TaskCache> t_taskCacheOwner;
+
+TaskCache::~TaskCache()
+{
+    t_taskCache = NULL;
+    while (head) {
+        void *next = *(void **)head;
+        ::operator delete(head);
+        head = next;
+    }
+}
+
 ThreadLocalStorage<Scheduler *> Scheduler::t_scheduler;
 ThreadLocalStorage<Fiber *> Scheduler::t_fiber;
+ThreadLocalStorage<Scheduler::WorkQueue *> Scheduler::t_workQueue;
+ThreadLocalStorage<Scheduler::Trampoline *> Scheduler::t_trampoline;
 
 Scheduler::Scheduler(size_t threads, bool useCaller, size_t batchSize)
     : m_activeThreadCount(0),
       m_idleThreadCount(0),
       m_stopping(true),
       m_autoStop(false),
-      m_batchSize(batchSize)
+      m_batchSize(batchSize),
+      m_workStealing(g_workStealing->val() ? 1 : 0),
+      m_placement(UNBOUND),
+      m_affinityGeneration(0),
+      m_nextThreadIndex(0),
+      m_localCount(0)
 {
     MORDOR_ASSERT(threads >= 1);
     if (useCaller) {
@@ -40,6 +131,9 @@ Scheduler::Scheduler(size_t threads, bool useCaller, size_t batchSize)
 Scheduler::~Scheduler()
 {
     MORDOR_ASSERT(m_stopping);
+    for (size_t i = 0; i <= LOW; ++i)
+        while (!m_fibers.classes[i].empty())
+            delete m_fibers.classes[i].erase_after(NULL);
     if (getThis() == this) {
         t_scheduler = NULL;
     }
@@ -75,6 +169,8 @@ Scheduler::start()
 bool
 Scheduler::hasWorkToDo()
 {
+    if (m_localCount != 0)
+        return true;
     boost::mutex::scoped_lock lock(m_mutex);
     return !m_fibers.empty();
 }
@@ -152,7 +248,8 @@ bool
 Scheduler::stopping()
 {
     boost::mutex::scoped_lock lock(m_mutex);
-    return m_stopping && m_fibers.empty() && m_activeThreadCount == 0;
+    return m_stopping && m_fibers.empty() && m_activeThreadCount == 0 &&
+        m_localCount == 0;
 }
 
 void
@@ -175,6 +272,14 @@ Scheduler::yieldTo()
     MORDOR_ASSERT(self);
     MORDOR_LOG_DEBUG(g_log) << self << " yielding to scheduler";
     MORDOR_ASSERT(t_fiber.get());
+    Trampoline *trampoline = t_trampoline.get();
+    if (trampoline && trampoline->fiber == Fiber::getThis().get()) {
+        // A delegate is blocking; it gets to keep the trampoline's stack.
+        // This has to be decided before switching away, since whoever
+        // resumes it may do so on another thread as soon as we have
+        trampoline->promoted = true;
+        t_trampoline = NULL;
+    }
     if (self->m_rootThread == gettid() &&
         (t_fiber->state() == Fiber::INIT || t_fiber->state() == Fiber::TERM)) {
         self->m_callingFiber = Fiber::getThis();
@@ -249,22 +354,37 @@ Scheduler::run()
     }
     Fiber::ptr idleFiber(new Fiber(boost::bind(&Scheduler::idle, this)));
     MORDOR_LOG_VERBOSE(g_log) << this << " starting thread with idle fiber " << idleFiber;
-    Fiber::ptr dgFiber;
+    boost::shared_ptr<Trampoline> trampoline;
+    Fiber::ptr trampolineFiber;
     // use a vector for O(1) .size()
-    std::vector<FiberAndThread> batch;
+    std::vector<FiberAndThread *> batch;
     batch.reserve(m_batchSize);
     bool isActive = false;
+    // A hijacked thread is always the first thread
+    size_t index = 0;
+    if (gettid() != m_rootThread)
+        index = atomicIncrement(m_nextThreadIndex) - (m_rootFiber ? 0 : 1);
+    WorkQueue workQueue(this, index);
+    unsigned int iterations = 0;
     while (true) {
         MORDOR_ASSERT(batch.empty());
+        if (workQueue.generation != m_affinityGeneration)
+            bindThread(workQueue);
         bool dontIdle = false;
         bool tickleMe = false;
-        {
+        // HIGH work only ever goes on the shared queue, so look there first
+        // if there's any
+        bool sharedFirst = ++iterations % g_sharedQueueInterval == 0 ||
+            !m_fibers.classes[HIGH].empty();
+        if (!sharedFirst && m_localCount != 0)
+            tickleMe = dequeueLocal(workQueue, batch, isActive);
+        if (batch.empty()) {
             boost::mutex::scoped_lock lock(m_mutex);
             // Kill ourselves off if needed
             if (m_threads.size() > m_threadCount && gettid() != m_rootThread) {
                 // Accounting
                 if (isActive)
-                    --m_activeThreadCount;
+                    atomicDecrement(m_activeThreadCount);
                 // Kill off the idle fiber
                 try {
                     throw boost::enable_current_exception(
@@ -286,53 +406,82 @@ Scheduler::run()
                 MORDOR_NOTREACHED();
             }
 
-            std::list<FiberAndThread>::iterator it(m_fibers.begin());
-            while (it != m_fibers.end()) {
-                // If we've met our batch size, and we're not checking to see
-                // if we need to tickle another thread, then break
-                if ( (tickleMe || m_activeThreadCount == threadCount()) &&
-                    batch.size() == m_batchSize)
-                    break;
-                if (it->thread != emptytid() && it->thread != gettid()) {
-                    MORDOR_LOG_DEBUG(g_log) << this
-                        << " skipping item scheduled for thread "
-                        << it->thread;
-
-                    // Wake up another thread to hopefully service this
-                    tickleMe = true;
-                    dontIdle = true;
-                    ++it;
-                    continue;
-                }
-                MORDOR_ASSERT(it->fiber || it->dg);
-                // This fiber is still executing; probably just some race
-                // race condition that it needs to yield on one thread
-                // before running on another thread
-                if (it->fiber && it->fiber->state() == Fiber::EXEC) {
-                    MORDOR_LOG_DEBUG(g_log) << this
-                        << " skipping executing fiber " << it->fiber;
-                    ++it;
-                    dontIdle = true;
-                    continue;
-                }
-                // We were just checking if there is more work; there is, so
-                // set the flag and don't actually take this piece of work
-                if (batch.size() == m_batchSize) {
-                    tickleMe = true;
-                    break;
-                }
-                batch.push_back(*it);
-                it = m_fibers.erase(it);
-                if (!isActive) {
-                    ++m_activeThreadCount;
-                    isActive = true;
-                }
+            g_statDepth.update(
+                (unsigned int)(m_fibers.size() + m_localCount));
+            // Normally take the highest class first, but now and then give
+            // the lower classes first pick so they can't be starved
+            Priority order[LOW + 1] = { HIGH, NORMAL, LOW };
+            if (iterations % g_lowFirstInterval == 0) {
+                order[0] = LOW;
+                order[1] = HIGH;
+                order[2] = NORMAL;
+            } else if (iterations % g_normalFirstInterval == 0) {
+                order[0] = NORMAL;
+                order[1] = HIGH;
             }
-            if (batch.empty() && isActive) {
-                --m_activeThreadCount;
-                isActive = false;
+            for (size_t i = 0; i <= LOW; ++i) {
+                TaskList &fibers = m_fibers.classes[order[i]];
+                FiberAndThread *prev = NULL, *it = fibers.head;
+                while (it) {
+                    // If we've met our batch size, and we're not checking to
+                    // see if we need to tickle another thread, then break
+                    if ( (tickleMe || m_activeThreadCount == threadCount()) &&
+                        batch.size() == m_batchSize)
+                        break;
+                    if (it->thread != emptytid() && it->thread != gettid()) {
+                        MORDOR_LOG_DEBUG(g_log) << this
+                            << " skipping item scheduled for thread "
+                            << it->thread;
+
+                        // Wake up another thread to hopefully service this
+                        tickleMe = true;
+                        dontIdle = true;
+                        prev = it;
+                        it = it->next;
+                        continue;
+                    }
+                    MORDOR_ASSERT(it->fiber || it->dg);
+                    // This fiber is still executing; probably just some
+                    // race race condition that it needs to yield on one
+                    // thread before running on another thread
+                    if (it->fiber && it->fiber->state() == Fiber::EXEC) {
+                        MORDOR_LOG_DEBUG(g_log) << this
+                            << " skipping executing fiber " << it->fiber;
+                        prev = it;
+                        it = it->next;
+                        dontIdle = true;
+                        continue;
+                    }
+                    // We were just checking if there is more work; there is,
+                    // so set the flag and don't actually take this piece of
+                    // work
+                    if (batch.size() == m_batchSize) {
+                        tickleMe = true;
+                        break;
+                    }
+                    it = it->next;
+                    batch.push_back(fibers.erase_after(prev));
+                    if (!isActive) {
+                        atomicIncrement(m_activeThreadCount);
+                        isActive = true;
+                    }
+                }
             }
         }
+        if (batch.empty() && m_localCount != 0) {
+            if (sharedFirst)
+                tickleMe = dequeueLocal(workQueue, batch, isActive) || tickleMe;
+            if (batch.empty())
+                steal(workQueue, batch, isActive);
+            // Whatever is left is either still executing on another thread,
+            // or about to be pushed; either way it will be runnable shortly
+            if (batch.empty())
+                dontIdle = true;
+        }
+        if (batch.empty() && isActive) {
+            atomicDecrement(m_activeThreadCount);
+            isActive = false;
+        }
         if (tickleMe)
             tickle();
         MORDOR_LOG_DEBUG(g_log) << this
@@ -351,39 +500,69 @@ Scheduler::run()
                 // Unblock the next thread
                 if (threadCount() > 1)
                     tickle();
+                stopTrampoline(trampoline, trampolineFiber);
                 return;
             }
             MORDOR_LOG_DEBUG(g_log) << this << " idling";
             atomicIncrement(m_idleThreadCount);
+            {
+                boost::mutex::scoped_lock lock(workQueue.mutex);
+                workQueue.idleSince = TimerManager::now();
+            }
             idleFiber->call();
+            {
+                boost::mutex::scoped_lock lock(workQueue.mutex);
+                workQueue.idle += TimerManager::now() - workQueue.idleSince;
+                workQueue.idleSince = 0;
+            }
             atomicDecrement(m_idleThreadCount);
             continue;
         }
 
         while (!batch.empty()) {
-            FiberAndThread& ft = batch.back();
-            Fiber::ptr f = ft.fiber;
-            boost::function<void ()> dg = ft.dg;
+            Fiber::ptr f;
+            boost::function<void ()> dg;
+            unsigned long long start = TimerManager::now();
+            batch.back()->started(start);
+            batch.back()->fiber.swap(f);
+            batch.back()->dg.swap(dg);
+            delete batch.back();
             batch.pop_back();
 
             try {
                 if (f && f->state() != Fiber::TERM) {
                     MORDOR_LOG_DEBUG(g_log) << this << " running " << f;
                     f->yieldTo();
+                    g_statSlice.update(TimerManager::now() - start);
                 } else if (dg) {
-                    if (dgFiber)
-                        dgFiber->reset(dg);
-                    else
-                        dgFiber.reset(new Fiber(dg));
+                    if (!trampolineFiber) {
+                        trampoline.reset(new Trampoline());
+                        trampolineFiber.reset(new Fiber(boost::bind(
+                            &Scheduler::trampoline, trampoline)));
+                    }
                     MORDOR_LOG_DEBUG(g_log) << this << " running " << dg;
-                    dg = NULL;
-                    dgFiber->yieldTo();
-                    if (dgFiber->state() != Fiber::TERM)
-                        dgFiber.reset();
-                    else
-                        dgFiber->reset(NULL);
+                    trampoline->dg.swap(dg);
+                    trampoline->batch = &batch;
+                    trampolineFiber->yieldTo();
+                    g_statSlice.update(TimerManager::now() - start);
+                    if (t_trampoline.get()) {
+                        // The delegate switched away without going through
+                        // the Scheduler; don't count on it coming back
+                        t_trampoline->promoted = true;
+                        t_trampoline = NULL;
+                    }
+                    if (trampoline->promoted) {
+                        trampolineFiber.reset();
+                        trampoline.reset();
+                    }
                 }
             } catch (...) {
+                t_trampoline = NULL;
+                if (trampolineFiber &&
+                    trampolineFiber->state() == Fiber::EXCEPT) {
+                    trampolineFiber.reset();
+                    trampoline.reset();
+                }
                 try {
                     MORDOR_LOG_FATAL(Log::root())
                         << boost::current_exception_diagnostic_information();
@@ -395,18 +574,493 @@ Scheduler::run()
                 {
                     boost::mutex::scoped_lock lock(m_mutex);
                     // push all un-executed fibers back to m_fibers
-                    copy(batch.begin(), batch.end(), back_inserter(m_fibers));
+                    for (std::vector<FiberAndThread *>::iterator it =
+                        batch.begin();
+                        it != batch.end();
+                        ++it)
+                        m_fibers.push_back(*it);
                     batch.clear();
                     // decrease the activeCount as this thread is in exception
                     isActive = false;
-                    --m_activeThreadCount;
+                    atomicDecrement(m_activeThreadCount);
                 }
+                stopTrampoline(trampoline, trampolineFiber);
                 throw;
             }
         }
     }
 }
 
+void
+Scheduler::trampoline(boost::shared_ptr<Trampoline> self)
+{
+    self->fiber = Fiber::getThis().get();
+    while (!self->exiting) {
+        t_trampoline = self.get();
+        while (true) {
+            {
+                boost::function<void ()> dg;
+                dg.swap(self->dg);
+                dg();
+            }
+            // We blocked somewhere in there, and have now finished on
+            // whichever thread resumed us; nobody is waiting for us to run
+            // another delegate
+            if (self->promoted)
+                return;
+            // Each delegate starts out with no FiberLocal values
+            if (!self->fiber->m_flsValues.empty())
+                self->fiber->flsClear();
+            // Carry on with any delegates next in line in the batch,
+            // rather than switching back to the run() loop for each one
+            std::vector<FiberAndThread *> &batch = *self->batch;
+            if (batch.empty() || batch.back()->fiber)
+                break;
+            batch.back()->started(TimerManager::now());
+            self->dg.swap(batch.back()->dg);
+            delete batch.back();
+            batch.pop_back();
+        }
+        t_trampoline = NULL;
+        t_fiber->yieldTo(false);
+    }
+}
+
+void
+Scheduler::stopTrampoline(boost::shared_ptr<Trampoline> &trampoline,
+    Fiber::ptr &fiber)
+{
+    if (fiber && fiber->state() == Fiber::HOLD) {
+        trampoline->exiting = true;
+        fiber->yieldTo();
+        MORDOR_ASSERT(fiber->state() == Fiber::TERM);
+    }
+    fiber.reset();
+    trampoline.reset();
+}
+
+Scheduler::WorkQueue::WorkQueue(Scheduler *s, size_t index)
+    : scheduler(s),
+      tid(gettid()),
+      index(index),
+      node(~0),
+      generation(0),
+      started(TimerManager::now()),
+      idle(0),
+      idleSince(0)
+{
+    boost::mutex::scoped_lock lock(scheduler->m_workQueuesMutex);
+    scheduler->m_workQueues.push_back(this);
+    t_workQueue = this;
+}
+
+Scheduler::WorkQueue::~WorkQueue()
+{
+    t_workQueue = NULL;
+    MORDOR_LOG_VERBOSE(g_log) << scheduler << " thread " << gettid()
+        << " idle for " << idle << "us of "
+        << TimerManager::now() - started << "us";
+    {
+        boost::mutex::scoped_lock lock(scheduler->m_workQueuesMutex);
+        scheduler->m_workQueues.erase(std::find(scheduler->m_workQueues.begin(),
+            scheduler->m_workQueues.end(), this));
+    }
+    // No one can steal from us anymore; give anything left over to the
+    // other threads
+    if (fibers.empty())
+        return;
+    MORDOR_LOG_DEBUG(g_log) << scheduler << " returning " << fibers.size
+        << " fiber/dgs to the shared queue";
+    {
+        boost::mutex::scoped_lock lock(scheduler->m_mutex);
+        while (!fibers.empty()) {
+            scheduler->m_fibers.push_back(fibers.erase_after(NULL));
+            atomicDecrement(scheduler->m_localCount);
+        }
+    }
+    scheduler->tickle();
+}
+
+bool
+Scheduler::dequeueLocal(WorkQueue &queue, std::vector<FiberAndThread *> &batch,
+    bool &isActive)
+{
+    boost::mutex::scoped_lock lock(queue.mutex);
+    FiberAndThread *prev = NULL, *it = queue.fibers.head;
+    while (it && batch.size() < m_batchSize) {
+        // Scheduled from this thread while still yielding on another one
+        if (it->fiber && it->fiber->state() == Fiber::EXEC) {
+            prev = it;
+            it = it->next;
+            continue;
+        }
+        // Become active before the work leaves m_localCount, so that
+        // stopping() can't see an idle, empty Scheduler in between
+        if (!isActive) {
+            atomicIncrement(m_activeThreadCount);
+            isActive = true;
+        }
+        it = it->next;
+        batch.push_back(queue.fibers.erase_after(prev));
+        atomicDecrement(m_localCount);
+    }
+    return !queue.fibers.empty() && hasIdleThreads();
+}
+
+void
+Scheduler::steal(WorkQueue &queue, std::vector<FiberAndThread *> &batch,
+    bool &isActive)
+{
+    TaskList stolen;
+    {
+        boost::mutex::scoped_lock lock(m_workQueuesMutex);
+        size_t count = m_workQueues.size();
+        size_t self = std::find(m_workQueues.begin(), m_workQueues.end(),
+            &queue) - m_workQueues.begin();
+        MORDOR_ASSERT(self < count);
+        // Start with our neighbour, so that idle threads don't all pile on
+        // the same victim, and try threads on our own NUMA node (if we're
+        // bound to one) first
+        for (size_t i = 1; i < 2 * count && stolen.empty(); ++i) {
+            WorkQueue *victim = m_workQueues[(self + i) % count];
+            if (i == count || (victim->node == queue.node) != (i < count))
+                continue;
+            boost::mutex::scoped_lock victimLock(victim->mutex);
+            // Take the older half
+            size_t want = (victim->fibers.size + 1) / 2;
+            FiberAndThread *prev = NULL, *it = victim->fibers.head;
+            while (it && stolen.size < want) {
+                if (it->fiber && it->fiber->state() == Fiber::EXEC) {
+                    prev = it;
+                    it = it->next;
+                    continue;
+                }
+                it = it->next;
+                stolen.push_back(victim->fibers.erase_after(prev));
+            }
+        }
+    }
+    if (stolen.empty())
+        return;
+    MORDOR_LOG_DEBUG(g_log) << this << " stole " << stolen.size
+        << " fiber/dgs";
+    if (!isActive) {
+        atomicIncrement(m_activeThreadCount);
+        isActive = true;
+    }
+    while (!stolen.empty() && batch.size() < m_batchSize) {
+        batch.push_back(stolen.erase_after(NULL));
+        atomicDecrement(m_localCount);
+    }
+    if (!stolen.empty()) {
+        boost::mutex::scoped_lock lock(queue.mutex);
+        while (!stolen.empty())
+            queue.fibers.push_back(stolen.erase_after(NULL));
+    }
+}
+
+void
+Scheduler::cpuAffinity(Placement placement,
+    const std::vector<unsigned int> &cpus)
+{
+    {
+        boost::mutex::scoped_lock lock(m_workQueuesMutex);
+        m_placement = placement;
+        m_cpus = cpus;
+        if (m_cpus.empty() && placement != UNBOUND) {
+            for (size_t node = 0; node < numaNodeCount(); ++node) {
+                std::vector<unsigned int> nodeCpus = numaNodeCpus(node);
+                m_cpus.insert(m_cpus.end(), nodeCpus.begin(), nodeCpus.end());
+            }
+        }
+        atomicIncrement(m_affinityGeneration);
+    }
+    // Get idle threads to re-bind themselves now
+    for (size_t i = 0; i < threadCount(); ++i)
+        tickle();
+}
+
+void
+Scheduler::bindThread(WorkQueue &queue)
+{
+    Placement placement;
+    std::vector<unsigned int> cpus;
+    {
+        boost::mutex::scoped_lock lock(m_workQueuesMutex);
+        placement = m_placement;
+        cpus = m_cpus;
+        queue.generation = m_affinityGeneration;
+    }
+    size_t node = ~0;
+    std::vector<unsigned int> bound;
+    switch (placement) {
+        case UNBOUND:
+            break;
+        case PER_CPU:
+            if (cpus.empty())
+                break;
+            bound.push_back(cpus[queue.index % cpus.size()]);
+            break;
+        case PER_NUMA_NODE:
+        {
+            // The nodes that have CPUs in the set, and their CPUs from it
+            std::vector<std::pair<size_t, std::vector<unsigned int> > > nodes;
+            for (size_t i = 0; i < numaNodeCount(); ++i) {
+                std::vector<unsigned int> nodeCpus = numaNodeCpus(i);
+                std::pair<size_t, std::vector<unsigned int> > entry;
+                entry.first = i;
+                for (size_t j = 0; j < nodeCpus.size(); ++j)
+                    if (std::find(cpus.begin(), cpus.end(), nodeCpus[j]) !=
+                        cpus.end())
+                        entry.second.push_back(nodeCpus[j]);
+                if (!entry.second.empty())
+                    nodes.push_back(entry);
+            }
+            if (nodes.empty())
+                break;
+            size_t which = queue.index % nodes.size();
+            node = nodes[which].first;
+            bound.swap(nodes[which].second);
+            break;
+        }
+        default:
+            MORDOR_NOTREACHED();
+    }
+    MORDOR_LOG_DEBUG(g_log) << this << " binding thread " << queue.index
+        << " to " << bound.size() << " CPUs";
+    setThreadAffinity(bound);
+    boost::mutex::scoped_lock lock(m_workQueuesMutex);
+    queue.node = node;
+}
+
+std::vector<Scheduler::ThreadUtilization>
+Scheduler::utilization() const
+{
+    std::vector<ThreadUtilization> result;
+    boost::mutex::scoped_lock lock(m_workQueuesMutex);
+    unsigned long long now = TimerManager::now();
+    for (std::vector<WorkQueue *>::const_iterator it = m_workQueues.begin();
+        it != m_workQueues.end();
+        ++it) {
+        boost::mutex::scoped_lock queueLock((*it)->mutex);
+        ThreadUtilization thread;
+        thread.thread = (*it)->tid;
+        thread.elapsed = now - (*it)->started;
+        thread.idle = (*it)->idle;
+        if ((*it)->idleSince)
+            thread.idle += now - (*it)->idleSince;
+        result.push_back(thread);
+    }
+    return result;
+}
+
+void
+Scheduler::scheduleTask(FiberAndThread *task)
+{
+    if (m_workStealing && task->thread == emptytid() &&
+        task->priority == NORMAL && scheduleLocal(task))
+        return;
+    bool tickleMe;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        tickleMe = scheduleNoLock(task);
+    }
+    if (shouldTickle(tickleMe))
+        tickle();
+}
+
+bool
+Scheduler::scheduleNoLock(FiberAndThread *task)
+{
+    bool tickleMe = m_fibers.empty();
+    m_fibers.push_back(task);
+    return tickleMe;
+}
+
+bool
+Scheduler::scheduleLocal(FiberAndThread *task)
+{
+    WorkQueue *queue = t_workQueue.get();
+    if (!queue || queue->scheduler != this)
+        return false;
+    // Count it before it's visible, so stopping() can't miss it
+    atomicIncrement(m_localCount);
+    {
+        boost::mutex::scoped_lock lock(queue->mutex);
+        queue->fibers.push_back(task);
+    }
+    if (hasIdleThreads())
+        tickle();
+    return true;
+}
+
+bool
+Scheduler::scheduleLocal(TaskList &tasks)
+{
+    WorkQueue *queue = t_workQueue.get();
+    if (!queue || queue->scheduler != this)
+        return false;
+    atomicAdd(m_localCount, tasks.size);
+    {
+        boost::mutex::scoped_lock lock(queue->mutex);
+        queue->fibers.splice(tasks);
+    }
+    if (hasIdleThreads())
+        tickle();
+    return true;
+}
+
+void
+Scheduler::schedule(std::vector<boost::shared_ptr<Fiber> > &fibers,
+    std::vector<boost::function<void ()> > &dgs)
+{
+    if (fibers.empty() && dgs.empty())
+        return;
+    // Build the nodes before taking the lock
+    TaskList tasks;
+    for (size_t i = 0; i < fibers.size(); ++i)
+        tasks.push_back(new FiberAndThread(&fibers[i], emptytid()));
+    for (size_t i = 0; i < dgs.size(); ++i)
+        tasks.push_back(new FiberAndThread(&dgs[i], emptytid()));
+    fibers.clear();
+    dgs.clear();
+    if (m_workStealing && scheduleLocal(tasks))
+        return;
+    bool tickleMe;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        tickleMe = m_fibers.empty();
+        m_fibers.splice(tasks);
+    }
+    if (shouldTickle(tickleMe))
+        tickle();
+}
+
+void
+Scheduler::TaskList::push_back(FiberAndThread *task)
+{
+    task->next = NULL;
+    if (tail)
+        tail->next = task;
+    else
+        head = task;
+    tail = task;
+    ++size;
+}
+
+void
+Scheduler::TaskList::splice(TaskList &other)
+{
+    if (other.empty())
+        return;
+    if (tail)
+        tail->next = other.head;
+    else
+        head = other.head;
+    tail = other.tail;
+    size += other.size;
+    other.head = other.tail = NULL;
+    other.size = 0;
+}
+
+Scheduler::FiberAndThread *
+Scheduler::TaskList::erase_after(FiberAndThread *prev)
+{
+    FiberAndThread *task = prev ? prev->next : head;
+    MORDOR_ASSERT(task);
+    if (prev)
+        prev->next = task->next;
+    else
+        head = task->next;
+    if (tail == task)
+        tail = prev;
+    task->next = NULL;
+    --size;
+    return task;
+}
+
+size_t
+Scheduler::RunQueue::size() const
+{
+    size_t result = 0;
+    for (size_t i = 0; i <= LOW; ++i)
+        result += classes[i].size;
+    return result;
+}
+
+bool
+Scheduler::RunQueue::empty() const
+{
+    for (size_t i = 0; i <= LOW; ++i)
+        if (!classes[i].empty())
+            return false;
+    return true;
+}
+
+void
+Scheduler::RunQueue::push_back(FiberAndThread *task)
+{
+    classes[task->priority].push_back(task);
+}
+
+void
+Scheduler::RunQueue::splice(TaskList &tasks)
+{
+    classes[NORMAL].splice(tasks);
+}
+
+Scheduler::FiberAndThread::~FiberAndThread()
+{
+    g_statPriorities[priority].queued.decrement();
+}
+
+void
+Scheduler::FiberAndThread::enqueued()
+{
+    queued = TimerManager::now();
+    g_statPriorities[priority].queued.increment();
+}
+
+void
+Scheduler::FiberAndThread::started(unsigned long long now)
+{
+    g_statLatency.update(now - queued);
+    g_statPriorities[priority].wait.update(now - queued);
+}
+
+void *
+Scheduler::FiberAndThread::operator new(size_t size)
+{
+    MORDOR_ASSERT(size == sizeof(FiberAndThread));
+    TaskCache *cache = t_taskCache.get();
+    if (!cache || !cache->head)
+        return ::operator new(size);
+    void *result = cache->head;
+    cache->head = *(void **)result;
+    --cache->count;
+    return result;
+}
+
+void
+Scheduler::FiberAndThread::operator delete(void *p)
+{
+    if (!p)
+        return;
+    TaskCache *cache = t_taskCache.get();
+    if (!cache) {
+        cache = new TaskCache();
+        t_taskCacheOwner.reset(cache);
+        t_taskCache = cache;
+    }
+    if (cache->count >= g_taskCacheSize) {
+        ::operator delete(p);
+        return;
+    }
+    *(void **)p = cache->head;
+    cache->head = p;
+    ++cache->count;
+}
+
 SchedulerSwitcher::SchedulerSwitcher(Scheduler *target)
 {
     m_caller = Scheduler::getThis();
@@ -2,13 +2,14 @@
 #define __MORDOR_SCHEDULER_H__
 // Copyright (c) 2009 - Mozy, Inc.
 
-#include <list>
+#include <vector>
 
 #include <boost/function.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread/mutex.hpp>
 
+#include "atomic.h"
 #include "thread.h"
 #include "thread_local_storage.h"
 
@@ -28,6 +29,17 @@ class Fiber;
 /// there are no more Fibers scheduled, and return from yieldTo() or
 /// dispatch(). Hybrid and spawned Schedulers must be explicitly stopped via
 /// stop(). stop() will return only after there are no more Fibers scheduled.
+///
+/// By default all threads share a single queue of scheduled work.  If work
+/// stealing is enabled, work scheduled from one of the Scheduler's own
+/// threads (and not targeted at a specific thread) is instead placed on that
+/// thread's local queue; threads that run out of local work take from the
+/// shared queue, and then steal from the local queues of other threads.
+///
+/// The Scheduler's threads can be bound to CPUs with cpuAffinity(), either
+/// one CPU per thread, or one NUMA node per thread.  In the latter case, work
+/// stealing threads steal from threads on their own node before going to
+/// another node, so that work mostly stays on the node it was scheduled on.
 class Scheduler : public boost::noncopyable
 {
 public:
@@ -71,6 +83,23 @@ public:
     /// In all other cases stop() will not return until all work is complete.
     void stop();
 
+    /// Classes of scheduled work
+
+    /// When more work is queued than the Scheduler's threads can keep up
+    /// with, higher classes run first.  Lower classes aren't starved
+    /// outright: every few times around the scheduling loop a thread looks
+    /// at the NORMAL class first, and less often the LOW class, so bulk
+    /// work still makes (slow) progress under sustained load.
+    enum Priority {
+        /// Latency-sensitive work, such as health checks, accepts, and timer
+        /// callbacks
+        HIGH,
+        /// Everything that doesn't say otherwise
+        NORMAL,
+        /// Bulk work, such as large transfers or batch processing
+        LOW
+    };
+
     /// Schedule a Fiber to be executed on the Scheduler
 
     /// @param fd The Fiber or the functor to schedule, if a pointer is passed
@@ -80,13 +109,19 @@ public:
     template <class FiberOrDg>
     void schedule(FiberOrDg fd, tid_t thread = emptytid())
     {
-        bool tickleMe;
-        {
-            boost::mutex::scoped_lock lock(m_mutex);
-            tickleMe = scheduleNoLock(fd, thread);
-        }
-        if (shouldTickle(tickleMe))
-            tickle();
+        scheduleTask(new FiberAndThread(fd, thread));
+    }
+
+    /// Schedule a Fiber to be executed on the Scheduler in a specific class
+
+    /// The class only applies to this scheduling; a Fiber that yields, or
+    /// is rescheduled later, goes back to NORMAL unless it says otherwise.
+    /// Only NORMAL work goes onto a thread's local queue when work stealing
+    /// is enabled; HIGH and LOW work always goes through the shared queue.
+    template <class FiberOrDg>
+    void schedule(FiberOrDg fd, Priority priority, tid_t thread = emptytid())
+    {
+        scheduleTask(new FiberAndThread(fd, thread, priority));
     }
 
     /// Schedule multiple items to be executed at once
@@ -100,7 +135,8 @@ public:
         {
             boost::mutex::scoped_lock lock(m_mutex);
             while (begin != end) {
-                tickleMe = scheduleNoLock(&*begin) || tickleMe;
+                tickleMe = scheduleNoLock(
+                    new FiberAndThread(&*begin, emptytid())) || tickleMe;
                 ++begin;
             }
         }
@@ -108,6 +144,13 @@ public:
             tickle();
     }
 
+    /// Schedule a batch of Fibers and delegates at once
+
+    /// The whole batch is queued under a single lock acquisition, with at
+    /// most one tickle.  Both vectors are swapped from, and left empty.
+    void schedule(std::vector<boost::shared_ptr<Fiber> > &fibers,
+        std::vector<boost::function<void ()> > &dgs);
+
     /// Change the currently executing Fiber to be running on this Scheduler
 
     /// This function can be used to change which Scheduler/thread the
@@ -154,6 +197,47 @@ public:
     }
 
     tid_t rootThreadId() const { return m_rootThread; }
+
+    bool workStealing() const { return m_workStealing != 0; }
+
+    /// Enable or disable per-thread run queues with work stealing
+    ///
+    /// Defaults to the scheduler.workstealing config var.  It is safe to
+    /// change this while the Scheduler is running; work already on a
+    /// thread's local queue will still be run (or stolen).
+    void workStealing(bool enable)
+    { atomicSwap(m_workStealing, enable ? 1u : 0u); }
+
+    /// How cpuAffinity() binds threads to CPUs
+    enum Placement {
+        /// Threads may run on any CPU
+        UNBOUND,
+        /// Each thread is bound to a single CPU, assigned round robin
+        PER_CPU,
+        /// Each thread is bound to the CPUs of a single NUMA node, with
+        /// threads spread round robin across the nodes
+        PER_NUMA_NODE
+    };
+    /// Bind this Scheduler's threads to CPUs
+
+    /// This includes a hijacked thread, which stays bound after the
+    /// Scheduler stops.  Threads that are already running re-bind themselves
+    /// the next time around the scheduling loop.
+    /// @param cpus The CPUs to use; if empty, all of them
+    void cpuAffinity(Placement placement,
+        const std::vector<unsigned int> &cpus = std::vector<unsigned int>());
+
+    /// How busy one of the Scheduler's threads has been
+    struct ThreadUtilization
+    {
+        tid_t thread;
+        /// Microseconds since the thread started running the Scheduler
+        unsigned long long elapsed;
+        /// Microseconds of that spent in the idle Fiber
+        unsigned long long idle;
+    };
+    /// @return The utilization of each thread currently running the Scheduler
+    std::vector<ThreadUtilization> utilization() const;
 protected:
     /// Derived classes can query stopping() to see if the Scheduler is trying
     /// to stop, and should return from the idle Fiber as soon as possible.
@@ -189,39 +273,152 @@ private:
     void yieldTo(bool yieldToCallerOnTerminate);
     void run();
 
-    /// @pre @c fd should be valid
+    struct FiberAndThread;
+    struct TaskList;
+    struct RunQueue;
+    struct WorkQueue;
+    struct Trampoline;
+
+    void scheduleTask(FiberAndThread *task);
+    /// @pre @c task should be valid
     /// @pre the task to be scheduled is not thread-targeted, or this scheduler
     ///      owns the targeted thread.
-    template <class FiberOrDg>
-        bool scheduleNoLock(FiberOrDg fd,
-                            tid_t thread = emptytid()) {
-        bool tickleMe = m_fibers.empty();
-        m_fibers.push_back(FiberAndThread(fd, thread));
-        return tickleMe;
-    }
+    bool scheduleNoLock(FiberAndThread *task);
+    /// Push onto the calling thread's local queue
+    /// @return false if the calling thread is not running this Scheduler
+    bool scheduleLocal(FiberAndThread *task);
+    bool scheduleLocal(TaskList &tasks);
 
 private:
+    /// A scheduled Fiber or delegate
+    ///
+    /// These are allocated for every schedule() call, so they come from a
+    /// per-thread free list instead of the general-purpose allocator, and
+    /// link directly into the run queues.  Small delegates are stored inline
+    /// by boost::function; the delegate is only ever swapped, never copied,
+    /// on its way to being run.
     struct FiberAndThread {
         boost::shared_ptr<Fiber> fiber;
         boost::function<void ()> dg;
         tid_t thread;
-        FiberAndThread(boost::shared_ptr<Fiber> f, tid_t th)
-            : fiber(f), thread(th) {}
-        FiberAndThread(boost::shared_ptr<Fiber>* f, tid_t th)
-            : thread(th) {
+        Priority priority;
+        /// When the task was scheduled
+        unsigned long long queued;
+        FiberAndThread *next;
+        FiberAndThread(boost::shared_ptr<Fiber> f, tid_t th,
+            Priority p = NORMAL)
+            : fiber(f), thread(th), priority(p), next(NULL) {
+            enqueued();
+        }
+        FiberAndThread(boost::shared_ptr<Fiber>* f, tid_t th,
+            Priority p = NORMAL)
+            : thread(th), priority(p), next(NULL) {
             fiber.swap(*f);
+            enqueued();
         }
-        FiberAndThread(boost::function<void ()> d, tid_t th)
-            : dg(d), thread(th) {}
-        FiberAndThread(boost::function<void ()> *d, tid_t th)
-            : thread(th) {
+        FiberAndThread(boost::function<void ()> d, tid_t th,
+            Priority p = NORMAL)
+            : thread(th), priority(p), next(NULL) {
+            dg.swap(d);
+            enqueued();
+        }
+        FiberAndThread(boost::function<void ()> *d, tid_t th,
+            Priority p = NORMAL)
+            : thread(th), priority(p), next(NULL) {
             dg.swap(*d);
+            enqueued();
         }
+        ~FiberAndThread();
+
+        /// Stamps the task, and counts it against its class's queue depth
+        void enqueued();
+        /// Records how long the task waited, just before it runs
+        void started(unsigned long long now);
+
+        static void *operator new(size_t size);
+        static void operator delete(void *p);
+    };
+    /// Intrusive FIFO of FiberAndThreads
+    struct TaskList {
+        TaskList() : head(NULL), tail(NULL), size(0) {}
+
+        bool empty() const { return head == NULL; }
+        void push_back(FiberAndThread *task);
+        /// Move all of @c other's tasks onto the end of this list
+        void splice(TaskList &other);
+        /// Unlink and return the task following @c prev (or the first task,
+        /// if @c prev is NULL)
+        FiberAndThread *erase_after(FiberAndThread *prev);
+
+        FiberAndThread *head, *tail;
+        size_t size;
+    };
+    /// The shared run queue, one FIFO per Priority
+    struct RunQueue {
+        size_t size() const;
+        bool empty() const;
+        /// Queue @c task at the end of its class
+        void push_back(FiberAndThread *task);
+        /// Queue all of @c tasks, which must be NORMAL, at the end of the
+        /// NORMAL class
+        void splice(TaskList &tasks);
+
+        TaskList classes[LOW + 1];
     };
+    /// A thread's local run queue; registers itself with the Scheduler for
+    /// the lifetime of the thread's run() loop, and hands any leftover work
+    /// to the shared queue on destruction.  Also keeps the thread's CPU
+    /// binding and utilization.
+    struct WorkQueue {
+        WorkQueue(Scheduler *s, size_t index);
+        ~WorkQueue();
+
+        Scheduler *scheduler;
+        boost::mutex mutex;
+        TaskList fibers;
+        tid_t tid;
+        /// Which of the Scheduler's threads this is, for cpuAffinity()
+        size_t index;
+        /// NUMA node the thread is bound to, or ~0 if it isn't
+        size_t node;
+        /// The m_affinityGeneration the binding was made for
+        unsigned int generation;
+        // Protected by mutex
+        unsigned long long started, idle, idleSince;
+    };
+    bool dequeueLocal(WorkQueue &queue, std::vector<FiberAndThread *> &batch,
+        bool &isActive);
+    void steal(WorkQueue &queue, std::vector<FiberAndThread *> &batch,
+        bool &isActive);
+    void bindThread(WorkQueue &queue);
+
+    /// Runs delegates for a thread's run() loop.  Delegates that don't block
+    /// run back to back on the same Fiber, without a Fiber::reset() or a
+    /// trip through the run() loop in between.  A delegate that does block
+    /// keeps the Fiber (and its stack) to itself, and the thread starts a new
+    /// Trampoline the next time it has a delegate to run.
+    struct Trampoline {
+        Trampoline()
+            : fiber(NULL), batch(NULL), promoted(false), exiting(false)
+        {}
+
+        Fiber *fiber;
+        boost::function<void ()> dg;
+        /// The rest of the run() loop's batch, to take more delegates from
+        std::vector<FiberAndThread *> *batch;
+        bool promoted, exiting;
+    };
+    static void trampoline(boost::shared_ptr<Trampoline> self);
+    static void stopTrampoline(boost::shared_ptr<Trampoline> &trampoline,
+        boost::shared_ptr<Fiber> &fiber);
+
     static ThreadLocalStorage<Scheduler *> t_scheduler;
     static ThreadLocalStorage<Fiber *> t_fiber;
+    static ThreadLocalStorage<WorkQueue *> t_workQueue;
+    /// The Trampoline currently running a delegate on this thread, if any
+    static ThreadLocalStorage<Trampoline *> t_trampoline;
     boost::mutex m_mutex;
-    std::list<FiberAndThread> m_fibers;
+    RunQueue m_fibers;
     tid_t m_rootThread;
     boost::shared_ptr<Fiber> m_rootFiber;
     boost::shared_ptr<Fiber> m_callingFiber;
@@ -230,6 +427,17 @@ private:
     bool m_stopping;
     bool m_autoStop;
     size_t m_batchSize;
+    // Read by every thread without a lock
+    volatile unsigned int m_workStealing;
+    mutable boost::mutex m_workQueuesMutex;
+    std::vector<WorkQueue *> m_workQueues;
+    // cpuAffinity() settings, protected by m_workQueuesMutex
+    Placement m_placement;
+    std::vector<unsigned int> m_cpus;
+    volatile unsigned int m_affinityGeneration;
+    size_t m_nextThreadIndex;
+    /// Number of items sitting on any thread's local queue
+    size_t m_localCount;
 };
 
 /// Automatic Scheduler switcher
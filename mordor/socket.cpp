@@ -29,6 +29,11 @@
 #define closesocket close
 #endif
 
+#ifdef LINUX
+#include <signal.h>
+#include <sys/sendfile.h>
+#endif
+
 namespace Mordor {
 
 #ifdef WINDOWS
@@ -276,7 +281,12 @@ Socket::Socket(IOManager &ioManager, int family, int type, int protocol)
         throw;
     }
 #else
-    if (fcntl(m_sock, F_SETFL, O_NONBLOCK) == -1) {
+    // io_uring needs blocking sockets, so that it waits for them itself
+    if (
+#ifdef LINUX
+        !m_ioManager->usingIoUring() &&
+#endif
+        fcntl(m_sock, F_SETFL, O_NONBLOCK) == -1) {
         ::closesocket(m_sock);
         MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("fcntl");
     }
@@ -510,6 +520,41 @@ suckylsp:
             }
         }
 #else
+#ifdef LINUX
+        if (m_ioManager->usingIoUring()) {
+            if (m_cancelledSend) {
+                MORDOR_LOG_ERROR(g_log) << this << " connect(" << m_sock << ", " << to
+                    << "): (" << m_cancelledSend << ")";
+                MORDOR_THROW_EXCEPTION_FROM_ERROR_API(m_cancelledSend, "connect");
+            }
+            Timer::ptr timeout;
+            if (m_sendTimeout != ~0ull)
+                timeout = m_ioManager->registerConditionTimer(m_sendTimeout,
+                    boost::bind(&Socket::cancelIo, this, IOManager::WRITE,
+                        boost::ref(m_cancelledSend), ETIMEDOUT),
+                    weak_ptr(shared_from_this()));
+            int rc = m_ioManager->connect(m_sock, to.name(), to.nameLen(),
+                &m_cancelledSend);
+            if (timeout)
+                timeout->cancel();
+            if (m_cancelledSend) {
+                MORDOR_LOG_ERROR(g_log) << this << " connect(" << m_sock << ", " << to
+                    << "): (" << m_cancelledSend << ")";
+                MORDOR_THROW_EXCEPTION_FROM_ERROR_API(m_cancelledSend, "connect");
+            }
+            if (rc < 0) {
+                MORDOR_LOG_ERROR(g_log) << this << " connect(" << m_sock << ", " << to
+                    << "): (" << -rc << ")";
+                MORDOR_THROW_EXCEPTION_FROM_ERROR_API(-rc, "connect");
+            }
+            MORDOR_LOG_INFO(g_log) << this << " connect(" << m_sock << ", "
+                << to << ") local: " << *(localAddress());
+            m_isConnected = true;
+            if (!m_onRemoteClose.empty())
+                registerForRemoteClose();
+            return;
+        }
+#endif
         if (!::connect(m_sock, to.name(), to.nameLen())) {
             MORDOR_LOG_INFO(g_log) << this << " connect(" << m_sock << ", "
                 << to << ") local: " << *(localAddress());
@@ -745,6 +790,37 @@ suckylsp:
 #else
         int newsock;
         error_t error;
+#ifdef LINUX
+        if (m_ioManager->usingIoUring()) {
+            if (m_cancelledReceive) {
+                MORDOR_LOG_ERROR(g_log) << this << " accept(" << m_sock << "): ("
+                    << m_cancelledReceive << ")";
+                MORDOR_THROW_EXCEPTION_FROM_ERROR_API(m_cancelledReceive, "accept");
+            }
+            Timer::ptr timeout;
+            if (m_receiveTimeout != ~0ull)
+                timeout = m_ioManager->registerConditionTimer(m_receiveTimeout,
+                    boost::bind(&Socket::cancelIo, this, IOManager::READ,
+                        boost::ref(m_cancelledReceive), ETIMEDOUT),
+                    weak_ptr(shared_from_this()));
+            newsock = m_ioManager->accept(m_sock, &m_cancelledReceive);
+            if (timeout)
+                timeout->cancel();
+            if (m_cancelledReceive) {
+                // The accept may have completed anyway
+                if (newsock >= 0)
+                    ::close(newsock);
+                MORDOR_LOG_ERROR(g_log) << this << " accept(" << m_sock
+                    << "): (" << m_cancelledReceive << ")";
+                MORDOR_THROW_EXCEPTION_FROM_ERROR_API(m_cancelledReceive, "accept");
+            }
+            if (newsock < 0) {
+                error = -newsock;
+                errno = error;
+                newsock = -1;
+            }
+        } else
+#endif
         do {
             newsock = ::accept(m_sock, NULL, NULL);
             error = errno;
@@ -782,7 +858,11 @@ suckylsp:
                 << newsock << " (" << error << ")";
             MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("accept");
         }
-        if (fcntl(newsock, F_SETFL, O_NONBLOCK) == -1) {
+        if (
+#ifdef LINUX
+            !m_ioManager->usingIoUring() &&
+#endif
+            fcntl(newsock, F_SETFL, O_NONBLOCK) == -1) {
             ::close(newsock);
             MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("fcntl");
         }
@@ -959,6 +1039,28 @@ Socket::doIO(iovec *buffers, size_t length, int &flags, Address *address)
     }
     int rc;
     error_t error;
+#ifdef LINUX
+    if (m_ioManager && m_ioManager->usingIoUring()) {
+        Timer::ptr timer;
+        if (timeout != ~0ull)
+            timer = m_ioManager->registerConditionTimer(timeout,
+                boost::bind(&Socket::cancelIo, this, event, boost::ref(cancelled), ETIMEDOUT),
+                weak_ptr(shared_from_this()));
+        rc = isSend ? m_ioManager->sendmsg(m_sock, &msg, flags, &cancelled) :
+            m_ioManager->recvmsg(m_sock, &msg, flags, &cancelled);
+        if (timer)
+            timer->cancel();
+        if (cancelled) {
+            MORDOR_SOCKET_LOG(-1, cancelled);
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(cancelled, api);
+        }
+        error = rc < 0 ? -rc : 0;
+        if (rc < 0) {
+            errno = error;
+            rc = -1;
+        }
+    } else
+#endif
     do {
         rc = isSend ? sendmsg(m_sock, &msg, flags) : recvmsg(m_sock, &msg, flags);
         error = errno;
@@ -1064,6 +1166,93 @@ Socket::receiveFrom(iovec *buffers, size_t length, Address &from, int *flags)
     return doIO<false>(buffers, length, *flags, &from);
 }
 
+#ifdef LINUX
+// sendfile(2) and splice(2) don't take MSG_NOSIGNAL, so block SIGPIPE around
+// them instead, and discard the one raised for a broken connection
+template <bool isSplice>
+static ssize_t sendFileNoSignal(int sock, int fd, size_t length)
+{
+    sigset_t sigpipe, old;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, &old);
+    ssize_t rc;
+    do {
+        rc = isSplice ? splice(fd, NULL, sock, NULL, length, SPLICE_F_MOVE) :
+            sendfile(sock, fd, NULL, length);
+    } while (rc == -1 && errno == EINTR);
+    error_t error = errno;
+    if (rc == -1 && error == EPIPE && !sigismember(&old, SIGPIPE)) {
+        struct timespec zero = { 0, 0 };
+        while (sigtimedwait(&sigpipe, NULL, &zero) == -1 && errno == EINTR);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    errno = error;
+    return rc;
+}
+
+template <bool isSplice>
+size_t
+Socket::doSendFile(int fd, size_t length)
+{
+    const char *api = isSplice ? "splice" : "sendfile";
+    MORDOR_ASSERT(canSendFile());
+    if (m_ioManager && m_cancelledSend) {
+        MORDOR_LOG_ERROR(g_log) << this << " " << api << "(" << m_sock << ", "
+            << fd << ", " << length << "): (" << m_cancelledSend << ")";
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(m_cancelledSend, api);
+    }
+    ssize_t rc = sendFileNoSignal<isSplice>(m_sock, fd, length);
+    error_t error = errno;
+    while (m_ioManager && rc == -1 && error == EAGAIN) {
+        m_ioManager->registerEvent(m_sock, IOManager::WRITE);
+        Timer::ptr timer;
+        if (m_sendTimeout != ~0ull)
+            timer = m_ioManager->registerConditionTimer(m_sendTimeout,
+                boost::bind(&Socket::cancelIo, this, IOManager::WRITE,
+                    boost::ref(m_cancelledSend), ETIMEDOUT),
+                weak_ptr(shared_from_this()));
+        Scheduler::yieldTo();
+        if (timer)
+            timer->cancel();
+        if (m_cancelledSend) {
+            MORDOR_LOG_ERROR(g_log) << this << " " << api << "(" << m_sock
+                << ", " << fd << ", " << length << "): (" << m_cancelledSend
+                << ")";
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(m_cancelledSend, api);
+        }
+        rc = sendFileNoSignal<isSplice>(m_sock, fd, length);
+        error = errno;
+    }
+    if (rc == -1) {
+        MORDOR_LOG_ERROR(g_log) << this << " " << api << "(" << m_sock << ", "
+            << fd << ", " << length << "): (" << error << ")";
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, api);
+    }
+    MORDOR_LOG_DEBUG(g_log) << this << " " << api << "(" << m_sock << ", "
+        << fd << ", " << length << "): " << rc;
+    return rc;
+}
+
+size_t
+Socket::sendFile(int fd, size_t length)
+{
+    return doSendFile<false>(fd, length);
+}
+
+size_t
+Socket::splice(int fd, size_t length)
+{
+    return doSendFile<true>(fd, length);
+}
+
+bool
+Socket::canSendFile() const
+{
+    return !m_ioManager || !m_ioManager->usingIoUring();
+}
+#endif
+
 void
 Socket::getOption(int level, int option, void *result, size_t *len)
 {
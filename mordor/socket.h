@@ -131,6 +131,23 @@ public:
     size_t receiveFrom(void *buffer, size_t length, Address &from, int *flags = NULL);
     size_t receiveFrom(iovec *buffers, size_t length, Address &from, int *flags = NULL);
 
+#ifdef LINUX
+    /// Send up to length bytes from fd without copying them through user
+    /// space
+    ///
+    /// sendFile() uses sendfile(2), and so fd must be a file that supports
+    /// mmap-like operations; its offset is advanced by the amount sent.
+    /// splice() uses splice(2), and so fd must be the read end of a pipe.
+    /// Both honor sendTimeout() and cancelSend() the same as send().
+    /// @pre canSendFile()
+    size_t sendFile(int fd, size_t length);
+    size_t splice(int fd, size_t length);
+    /// If sendFile() and splice() can wait for the socket without blocking
+    /// the thread; not if its IOManager uses io_uring, which leaves sockets
+    /// in blocking mode
+    bool canSendFile() const;
+#endif
+
     boost::shared_ptr<Address> emptyAddress();
     boost::shared_ptr<Address> remoteAddress();
     boost::shared_ptr<Address> localAddress();
@@ -151,6 +168,10 @@ public:
 private:
     template <bool isSend>
     size_t doIO(iovec *buffers, size_t length, int &flags, Address *address = NULL);
+#ifdef LINUX
+    template <bool isSplice>
+    size_t doSendFile(int fd, size_t length);
+#endif
     static void callOnRemoteClose(weak_ptr self);
     void registerForRemoteClose();
     void accept(Socket &target);
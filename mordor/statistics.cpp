@@ -2,11 +2,43 @@
 
 #include "statistics.h"
 
+#include <sstream>
+
+#include <boost/bind.hpp>
+
 #include "atomic.h"
+#include "log.h"
+#include "thread_local_storage.h"
 #include "timer.h"
 
 namespace Mordor {
 
+static Logger::ptr g_log = Log::lookup("mordor:statistics");
+
+// One more than the calling thread's stripe; 0 until it has one.  Statistics
+// can be updated during static initialization and destruction, so this is
+// created on first use, and never destroyed
+static ThreadLocalStorage<size_t> &
+threadStripe()
+{
+    static ThreadLocalStorage<size_t> *stripe =
+        new ThreadLocalStorage<size_t>();
+    return *stripe;
+}
+
+size_t
+PerThreadStatistic::stripe()
+{
+    static size_t nextStripe;
+    ThreadLocalStorage<size_t> &tls = threadStripe();
+    size_t result = tls.get();
+    if (!result) {
+        result = atomicIncrement(nextStripe) % STRIPES + 1;
+        tls = result;
+    }
+    return result - 1;
+}
+
 Statistic *Statistics::lookup(const std::string &name)
 {
     StatisticsCache::const_iterator it = stats().find(name);
@@ -40,10 +72,12 @@ Statistic::dump(std::ostream &os)
 }
 
 std::ostream &
-Statistics::dump(std::ostream &os)
+Statistics::dump(std::ostream &os, const std::string &prefix)
 {
-    for (StatisticsCache::const_iterator it = statistics().begin();
-        it != statistics().end();
+    for (StatisticsCache::const_iterator it =
+        statistics().lower_bound(prefix);
+        it != statistics().end() &&
+        it->first.compare(0, prefix.size(), prefix) == 0;
         ++it) {
         os << it->first;
         if (!it->second.first.empty())
@@ -54,4 +88,20 @@ Statistics::dump(std::ostream &os)
     return os;
 }
 
+static void
+dumpToLog(const std::string &prefix)
+{
+    std::ostringstream os;
+    Statistics::dump(os, prefix);
+    MORDOR_LOG_INFO(g_log) << "statistics:" << std::endl << os.str();
+}
+
+Timer::ptr
+Statistics::dumpPeriodically(TimerManager &timerManager,
+    unsigned long long interval, const std::string &prefix)
+{
+    return timerManager.registerTimer(interval,
+        boost::bind(&dumpToLog, prefix), true);
+}
+
 }
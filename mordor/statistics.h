@@ -231,6 +231,184 @@ struct AverageMinMaxStatistic : AverageStatistic<T>
     }
 };
 
+/// Counts values in power-of-two sized buckets
+
+/// Cheap enough to update on every scheduling decision, while still giving an
+/// idea of the tail.  Serializes as the (inclusive upper bounds of the buckets
+/// containing the) 50th, 90th and 99th percentiles.  T must be unsigned.
+template <class T>
+struct HistogramStatistic : Statistic
+{
+    typedef T value_type;
+
+    HistogramStatistic(const char *units = NULL)
+        : Statistic(units)
+    { reset(); }
+
+    /// Bucket 0 counts zeroes; bucket n counts values in [2^(n-1), 2^n)
+    volatile unsigned long long buckets[sizeof(T) * 8 + 1];
+
+    void reset()
+    {
+        for (size_t i = 0; i < sizeof(buckets) / sizeof(buckets[0]); ++i)
+            buckets[i] = 0;
+    }
+
+    void update(T value) { atomicIncrement(buckets[bucket(value)]); }
+
+    static size_t bucket(T value)
+    {
+        size_t result = 0;
+        while (value) {
+            value >>= 1;
+            ++result;
+        }
+        return result;
+    }
+
+    unsigned long long count() const
+    {
+        unsigned long long result = 0;
+        for (size_t i = 0; i < sizeof(buckets) / sizeof(buckets[0]); ++i)
+            result += buckets[i];
+        return result;
+    }
+
+    /// @return The largest value in the bucket that the value at
+    /// @c fraction of the way through the distribution falls in
+    T percentile(double fraction) const
+    {
+        unsigned long long target =
+            (unsigned long long)(count() * fraction + 0.5);
+        unsigned long long seen = 0;
+        size_t i = 0;
+        for (; i < sizeof(buckets) / sizeof(buckets[0]) - 1; ++i) {
+            seen += buckets[i];
+            if (seen >= target)
+                break;
+        }
+        return i == 0 ? T() : (T)(((T)2 << (i - 1)) - 1);
+    }
+
+    std::ostream &serialize(std::ostream &os) const
+    {
+        return os << "p50 <= " << percentile(0.5) << ", p90 <= "
+            << percentile(0.9) << ", p99 <= " << percentile(0.99);
+    }
+
+    void merge(const HistogramStatistic<T> &stat)
+    {
+        for (size_t i = 0; i < sizeof(buckets) / sizeof(buckets[0]); ++i)
+            atomicAdd(buckets[i], stat.buckets[i]);
+    }
+};
+
+/// Base for statistics updated on hot paths by many threads at once.  Each
+/// thread updates its own stripe, on its own cache lines, so they don't
+/// fight over one; reading sums the stripes.  Stripes are handed out to
+/// threads round-robin, so with more threads than stripes some share one
+/// (updates are still atomic).
+struct PerThreadStatistic : Statistic
+{
+    enum { STRIPES = 16, CACHE_LINE = 64 };
+
+    PerThreadStatistic(const char *units = NULL) : Statistic(units) {}
+
+    /// @return The stripe the calling thread updates
+    static size_t stripe();
+};
+
+/// A CountStatistic with a count per thread; a count may be decremented by a
+/// different thread than incremented it, which only leaves single stripes
+/// wrapped around, not their sum
+template <class T>
+struct PerThreadCountStatistic : PerThreadStatistic
+{
+    typedef T value_type;
+
+    PerThreadCountStatistic(const char *units = NULL)
+        : PerThreadStatistic(units)
+    { reset(); }
+
+    void reset()
+    {
+        for (size_t i = 0; i < STRIPES; ++i)
+            m_stripes[i].count = T();
+    }
+
+    std::ostream &serialize(std::ostream &os) const
+    { return os << count(); }
+
+    void increment() { atomicIncrement(m_stripes[stripe()].count); }
+    void decrement() { atomicDecrement(m_stripes[stripe()].count); }
+    void add(value_type value) { atomicAdd(m_stripes[stripe()].count, value); }
+
+    value_type count() const
+    {
+        value_type result = T();
+        for (size_t i = 0; i < STRIPES; ++i)
+            result += m_stripes[i].count;
+        return result;
+    }
+
+private:
+    struct Stripe
+    {
+        volatile value_type count;
+        char pad[CACHE_LINE - sizeof(value_type)];
+    };
+    Stripe m_stripes[STRIPES];
+};
+
+/// A HistogramStatistic with buckets per thread
+template <class T>
+struct PerThreadHistogramStatistic : PerThreadStatistic
+{
+    typedef T value_type;
+
+    PerThreadHistogramStatistic(const char *units = NULL)
+        : PerThreadStatistic(units)
+    {}
+
+    void reset()
+    {
+        for (size_t i = 0; i < STRIPES; ++i)
+            m_stripes[i].histogram.reset();
+    }
+
+    void update(T value)
+    {
+        volatile unsigned long long *buckets =
+            m_stripes[stripe()].histogram.buckets;
+        atomicIncrement(buckets[HistogramStatistic<T>::bucket(value)]);
+    }
+
+    /// @return All of the stripes, summed
+    HistogramStatistic<T> total() const
+    {
+        HistogramStatistic<T> result;
+        for (size_t i = 0; i < STRIPES; ++i)
+            result.merge(m_stripes[i].histogram);
+        return result;
+    }
+
+    unsigned long long count() const { return total().count(); }
+    T percentile(double fraction) const
+    { return total().percentile(fraction); }
+
+    std::ostream &serialize(std::ostream &os) const
+    { return total().serialize(os); }
+
+private:
+    struct Stripe
+    {
+        HistogramStatistic<T> histogram;
+        // Keep the ends of neighbouring stripes off each other's lines
+        char pad[CACHE_LINE];
+    };
+    Stripe m_stripes[STRIPES];
+};
+
 template <class T, class U>
 struct ThroughputStatistic : Statistic
 {
@@ -328,8 +506,16 @@ public:
     }
 
     static Statistic *lookup(const std::string &name);
-    static std::ostream &dump(std::ostream &os);
+    /// @param prefix Only dump the statistics whose names start with this
+    static std::ostream &dump(std::ostream &os,
+        const std::string &prefix = std::string());
     static StatisticsDumper dump() { return StatisticsDumper(); }
+    /// Log the statistics (at INFO, to mordor:statistics) every @c interval
+    /// microseconds, until the returned Timer is cancelled
+    /// @param prefix Only dump the statistics whose names start with this
+    static boost::shared_ptr<Timer> dumpPeriodically(
+        TimerManager &timerManager, unsigned long long interval,
+        const std::string &prefix = std::string());
 
     static const StatisticsCache &statistics()
     {
@@ -5,9 +5,31 @@
 #include <string.h>
 #include <algorithm>
 
+#include <boost/static_assert.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
 #include "mordor/assert.h"
+#include "mordor/atomic.h"
+#include "mordor/config.h"
+#include "mordor/statistics.h"
+#include "mordor/thread.h"
+#include "mordor/thread_local_storage.h"
 #include "mordor/util.h"
 
+#ifdef POSIX
+#include <sys/mman.h>
+#endif
+#ifdef X86_64
+#include <emmintrin.h>
+#ifdef GCC
+#include <immintrin.h>
+#endif
+#ifdef MSVC
+#include <intrin.h>
+#endif
+#endif
+
 #ifdef WINDOWS
 static u_long iovLength(size_t length)
 {
@@ -22,6 +44,363 @@ static size_t iovLength(size_t length)
 
 namespace Mordor {
 
+static ConfigVar<bool>::ptr g_pool = Config::lookup(
+    "buffer.pool", true,
+    "Allocate buffer segments from pooled slabs, instead of from the heap; "
+    "a slab goes back to the system once all of its segments are freed, "
+    "except for one spare per size class");
+static ConfigVar<bool>::ptr g_hugePages = Config::lookup(
+    "buffer.hugepages", false,
+    "Back buffer segment slabs with huge pages, where available");
+static ConfigVar<std::string>::ptr g_findKernel = Config::lookup(
+    "buffer.findkernel", std::string("auto"),
+    "Instruction set Buffer::find searches with (avx2, sse2 or scalar; auto "
+    "is avx2 where the processor supports it, and scalar otherwise); avx2 "
+    "falls back to sse2 where the processor doesn't support it");
+
+static CountStatistic<unsigned long long> &g_statArena =
+    Statistics::registerStatistic("buffer.pool.arena",
+    CountStatistic<unsigned long long>("bytes"),
+    "memory carved into slabs for buffer segments");
+static PerThreadCountStatistic<unsigned long long> &g_statInUse =
+    Statistics::registerStatistic("buffer.pool.inuse",
+    PerThreadCountStatistic<unsigned long long>("bytes"),
+    "slab memory currently holding buffer segments");
+static CountStatistic<unsigned long long> &g_statRefills =
+    Statistics::registerStatistic("buffer.pool.refills",
+    CountStatistic<unsigned long long>(),
+    "times a thread's cache of free chunks went to the shared pool");
+static CountStatistic<unsigned long long> &g_statOversize =
+    Statistics::registerStatistic("buffer.pool.oversize",
+    CountStatistic<unsigned long long>(),
+    "segments allocated from the heap, because they were too big for the "
+    "pool (or it was disabled)");
+
+// Segment sizes the pool serves, at powers of two and half way between, so
+// at most a third of a chunk goes unused
+static const size_t g_sizeClasses[] = {
+    256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096, 6144, 8192, 12288,
+    16384, 24576, 32768, 49152, 65536, 98304, 131072, 196608, 262144
+};
+static const size_t g_sizeClassCount =
+    sizeof(g_sizeClasses) / sizeof(g_sizeClasses[0]);
+// Room for the Block in front of each chunk's data, and its Slab behind it
+static const size_t g_chunkHeader = 32;
+// One huge page
+static const size_t g_slabSize = 2 * 1024 * 1024;
+// How much free memory (per size class) a thread keeps to itself
+static const size_t g_cacheBytes = 512 * 1024;
+
+namespace {
+/// A slab carved up into chunks of one size class, and those of them that
+/// aren't in use or in a thread's cache
+struct Slab
+{
+    char *memory;
+    void *head;
+    size_t free, chunks;
+    /// Siblings in SharedChunks::slabs, while free is non-zero
+    Slab *prev, *next;
+};
+
+/// Slabs of one size class with free chunks, shared by all threads
+struct SharedChunks
+{
+    SharedChunks() : slabs(NULL), emptySlabs(0) {}
+
+    boost::mutex mutex;
+    Slab *slabs;
+    size_t emptySlabs;
+};
+
+/// A thread's free chunks, so that most allocations and frees don't touch
+/// shared state; free lists are threaded through the chunks themselves
+struct ChunkCache
+{
+    ChunkCache();
+    ~ChunkCache();
+
+    void *heads[g_sizeClassCount];
+    size_t counts[g_sizeClassCount];
+};
+}
+
+static SharedChunks g_sharedChunks[g_sizeClassCount];
+static ThreadLocalStorage<ChunkCache *> t_chunkCache;
+static boost::thread_specific_ptr<ChunkCache> t_chunkCacheOwner;
+
+static void *&nextChunk(void *chunk)
+{
+    return *(void **)chunk;
+}
+
+static size_t chunkSize(size_t sizeClass)
+{
+    return g_chunkHeader + g_sizeClasses[sizeClass];
+}
+
+static Slab *&chunkSlab(void *chunk)
+{
+    return *(Slab **)((char *)chunk + g_chunkHeader - sizeof(Slab *));
+}
+
+static size_t cacheLimit(size_t sizeClass)
+{
+    return (std::max)((size_t)2, g_cacheBytes / g_sizeClasses[sizeClass]);
+}
+
+static Slab *allocateSlab(size_t sizeClass)
+{
+#ifdef POSIX
+    void *slab = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    // Only works if huge pages have been reserved...
+    if (g_hugePages->val())
+        slab = mmap(NULL, g_slabSize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANON | MAP_HUGETLB, -1, 0);
+#endif
+    if (slab == MAP_FAILED) {
+        slab = mmap(NULL, g_slabSize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (slab == MAP_FAILED)
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mmap");
+#ifdef MADV_HUGEPAGE
+        // ... otherwise ask for transparent huge pages
+        if (g_hugePages->val())
+            madvise(slab, g_slabSize, MADV_HUGEPAGE);
+#endif
+    }
+#else
+    void *slab = ::operator new(g_slabSize);
+#endif
+    numaPreferLocal(slab, g_slabSize);
+    g_statArena.add(g_slabSize);
+
+    Slab *result = new Slab();
+    result->memory = (char *)slab;
+    result->head = NULL;
+    result->free = result->chunks = 0;
+    result->prev = result->next = NULL;
+    size_t size = chunkSize(sizeClass);
+    for (size_t offset = 0; offset + size <= g_slabSize; offset += size) {
+        void *chunk = result->memory + offset;
+        chunkSlab(chunk) = result;
+        nextChunk(chunk) = result->head;
+        result->head = chunk;
+        ++result->chunks;
+    }
+    result->free = result->chunks;
+    return result;
+}
+
+static void freeSlab(Slab *slab)
+{
+#ifdef POSIX
+    munmap(slab->memory, g_slabSize);
+#else
+    ::operator delete(slab->memory);
+#endif
+    g_statArena.add(-(unsigned long long)g_slabSize);
+    delete slab;
+}
+
+static void linkSlab(SharedChunks &shared, Slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = shared.slabs;
+    if (shared.slabs)
+        shared.slabs->prev = slab;
+    shared.slabs = slab;
+}
+
+static void unlinkSlab(SharedChunks &shared, Slab *slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        shared.slabs = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+/// Move free chunks from the shared pool into @c cache, carving up a new
+/// slab if the shared pool is empty
+static void refill(ChunkCache &cache, size_t sizeClass)
+{
+    g_statRefills.increment();
+    size_t want = (cacheLimit(sizeClass) + 1) / 2;
+    SharedChunks &shared = g_sharedChunks[sizeClass];
+    boost::mutex::scoped_lock lock(shared.mutex);
+    if (!shared.slabs) {
+        linkSlab(shared, allocateSlab(sizeClass));
+        ++shared.emptySlabs;
+    }
+    while (shared.slabs && cache.counts[sizeClass] < want) {
+        Slab *slab = shared.slabs;
+        if (slab->free == slab->chunks)
+            --shared.emptySlabs;
+        while (slab->head && cache.counts[sizeClass] < want) {
+            void *chunk = slab->head;
+            slab->head = nextChunk(chunk);
+            --slab->free;
+            nextChunk(chunk) = cache.heads[sizeClass];
+            cache.heads[sizeClass] = chunk;
+            ++cache.counts[sizeClass];
+        }
+        if (!slab->head)
+            unlinkSlab(shared, slab);
+    }
+}
+
+/// Give all but @c keep of @c cache's free chunks back to their slabs,
+/// releasing slabs that end up wholly free beyond one spare
+static void drain(ChunkCache &cache, size_t sizeClass, size_t keep)
+{
+    if (cache.counts[sizeClass] <= keep)
+        return;
+    SharedChunks &shared = g_sharedChunks[sizeClass];
+    boost::mutex::scoped_lock lock(shared.mutex);
+    while (cache.counts[sizeClass] > keep) {
+        void *chunk = cache.heads[sizeClass];
+        cache.heads[sizeClass] = nextChunk(chunk);
+        --cache.counts[sizeClass];
+        Slab *slab = chunkSlab(chunk);
+        nextChunk(chunk) = slab->head;
+        slab->head = chunk;
+        if (slab->free++ == 0)
+            linkSlab(shared, slab);
+        if (slab->free == slab->chunks) {
+            if (shared.emptySlabs) {
+                unlinkSlab(shared, slab);
+                freeSlab(slab);
+            } else {
+                ++shared.emptySlabs;
+            }
+        }
+    }
+}
+
+ChunkCache::ChunkCache()
+{
+    for (size_t i = 0; i < g_sizeClassCount; ++i) {
+        heads[i] = NULL;
+        counts[i] = 0;
+    }
+}
+
+ChunkCache::~ChunkCache()
+{
+    t_chunkCache = NULL;
+    for (size_t i = 0; i < g_sizeClassCount; ++i)
+        drain(*this, i, 0);
+}
+
+static ChunkCache &chunkCache()
+{
+    ChunkCache *cache = t_chunkCache.get();
+    if (!cache) {
+        cache = new ChunkCache();
+        t_chunkCacheOwner.reset(cache);
+        t_chunkCache = cache;
+    }
+    return *cache;
+}
+
+static void *allocateChunk(size_t sizeClass)
+{
+    ChunkCache &cache = chunkCache();
+    if (!cache.heads[sizeClass])
+        refill(cache, sizeClass);
+    void *chunk = cache.heads[sizeClass];
+    cache.heads[sizeClass] = nextChunk(chunk);
+    --cache.counts[sizeClass];
+    g_statInUse.add(g_sizeClasses[sizeClass]);
+    return chunk;
+}
+
+static void freeChunk(void *chunk, size_t sizeClass)
+{
+    g_statInUse.add(-(unsigned long long)g_sizeClasses[sizeClass]);
+    ChunkCache &cache = chunkCache();
+    nextChunk(chunk) = cache.heads[sizeClass];
+    cache.heads[sizeClass] = chunk;
+    if (++cache.counts[sizeClass] > cacheLimit(sizeClass))
+        drain(cache, sizeClass, cacheLimit(sizeClass) / 2);
+}
+
+struct Buffer::Block
+{
+    /// sizeClass for storage that didn't come from the pool
+    enum {
+        HEAP = ~0u,
+        ADOPTED = ~0u - 1
+    };
+
+    static Block *allocate(size_t length);
+    static Block *adopt(void *buffer);
+    void free();
+
+    volatile size_t refs;
+    size_t sizeClass;
+    unsigned char *data;
+};
+
+Buffer::Block *
+Buffer::Block::allocate(size_t length)
+{
+    // Mustn't reach the chunk's Slab pointer
+    BOOST_STATIC_ASSERT(sizeof(Block) <= g_chunkHeader - sizeof(void *));
+    Block *block;
+    size_t sizeClass = std::lower_bound(g_sizeClasses,
+        g_sizeClasses + g_sizeClassCount, length) - g_sizeClasses;
+    if (sizeClass < g_sizeClassCount && g_pool->val()) {
+        block = (Block *)allocateChunk(sizeClass);
+    } else {
+        g_statOversize.increment();
+        block = (Block *)::operator new(g_chunkHeader + length);
+        numaPreferLocal(block, g_chunkHeader + length);
+        sizeClass = HEAP;
+    }
+    block->refs = 0;
+    block->sizeClass = sizeClass;
+    block->data = (unsigned char *)block + g_chunkHeader;
+    return block;
+}
+
+Buffer::Block *
+Buffer::Block::adopt(void *buffer)
+{
+    Block *block = new Block();
+    block->refs = 0;
+    block->sizeClass = ADOPTED;
+    block->data = (unsigned char *)buffer;
+    return block;
+}
+
+void
+Buffer::Block::free()
+{
+    if (sizeClass == (size_t)ADOPTED)
+        delete this;
+    else if (sizeClass == (size_t)HEAP)
+        ::operator delete(this);
+    else
+        freeChunk(this, sizeClass);
+}
+
+void
+intrusive_ptr_add_ref(Buffer::Block *block)
+{
+    atomicIncrement(block->refs);
+}
+
+void
+intrusive_ptr_release(Buffer::Block *block)
+{
+    if (atomicDecrement(block->refs) == 0)
+        block->free();
+}
+
 Buffer::SegmentData::SegmentData()
 {
     start(NULL);
@@ -29,16 +408,16 @@ Buffer::SegmentData::SegmentData()
 }
 
 Buffer::SegmentData::SegmentData(size_t length)
+    : m_block(Block::allocate(length))
 {
-    m_array.reset(new unsigned char[length]);
-    start(m_array.get());
+    start(m_block->data);
     this->length(length);
 }
 
 Buffer::SegmentData::SegmentData(void *buffer, size_t length)
+    : m_block(Block::adopt(buffer))
 {
-    m_array.reset((unsigned char *)buffer, &nop<unsigned char *>);
-    start(m_array.get());
+    start(m_block->data);
     this->length(length);
 }
 
@@ -50,7 +429,7 @@ Buffer::SegmentData::slice(size_t start, size_t length)
     MORDOR_ASSERT(start <= this->length());
     MORDOR_ASSERT(length + start <= this->length());
     SegmentData result;
-    result.m_array = m_array;
+    result.m_block = m_block;
     result.start((unsigned char*)this->start() + start);
     result.length(length);
     return result;
@@ -64,7 +443,7 @@ Buffer::SegmentData::slice(size_t start, size_t length) const
     MORDOR_ASSERT(start <= this->length());
     MORDOR_ASSERT(length + start <= this->length());
     SegmentData result;
-    result.m_array = m_array;
+    result.m_block = m_block;
     result.start((unsigned char*)this->start() + start);
     result.length(length);
     return result;
@@ -77,6 +456,14 @@ Buffer::SegmentData::extend(size_t length)
     m_length += length;
 }
 
+void
+Buffer::SegmentData::consume(size_t length)
+{
+    MORDOR_ASSERT(length <= m_length);
+    m_start = (unsigned char *)m_start + length;
+    m_length -= length;
+}
+
 Buffer::Segment::Segment(size_t length)
 : m_writeIndex(0), m_data(length)
 {
@@ -129,7 +516,7 @@ Buffer::Segment::consume(size_t length)
 {
     MORDOR_ASSERT(length <= readAvailable());
     m_writeIndex -= length;
-    m_data = m_data.slice(length);
+    m_data.consume(length);
     invariant();
 }
 
@@ -177,39 +564,153 @@ Buffer::Segment::invariant() const
     MORDOR_ASSERT(m_writeIndex <= m_data.length());
 }
 
+Buffer::SegmentList::SegmentList()
+    : m_segments((Segment *)m_inline.bytes),
+      m_capacity(INLINE_SEGMENTS),
+      m_head(0),
+      m_size(0)
+{}
+
+Buffer::SegmentList::~SegmentList()
+{
+    clear();
+    if (m_segments != (Segment *)m_inline.bytes)
+        ::operator delete(m_segments);
+}
+
+void
+Buffer::SegmentList::push_front(const Segment &segment)
+{
+    if (m_size == m_capacity)
+        grow();
+    m_head = (m_head - 1) & (m_capacity - 1);
+    new (slot(0)) Segment(segment);
+    ++m_size;
+}
+
+void
+Buffer::SegmentList::push_back(const Segment &segment)
+{
+    if (m_size == m_capacity)
+        grow();
+    new (slot(m_size)) Segment(segment);
+    ++m_size;
+}
+
+void
+Buffer::SegmentList::insert(size_t index, const Segment &segment)
+{
+    MORDOR_ASSERT(index <= m_size);
+    if (m_size == m_capacity)
+        grow();
+    // Make room on whichever side has fewer Segments to move
+    if (index < m_size / 2) {
+        m_head = (m_head - 1) & (m_capacity - 1);
+        for (size_t i = 0; i < index; ++i)
+            move(i + 1, i);
+    } else {
+        for (size_t i = m_size; i > index; --i)
+            move(i - 1, i);
+    }
+    new (slot(index)) Segment(segment);
+    ++m_size;
+}
+
+void
+Buffer::SegmentList::pop_front()
+{
+    MORDOR_ASSERT(m_size > 0);
+    slot(0)->~Segment();
+    m_head = (m_head + 1) & (m_capacity - 1);
+    --m_size;
+}
+
+void
+Buffer::SegmentList::erase(size_t first, size_t last)
+{
+    MORDOR_ASSERT(first <= last);
+    MORDOR_ASSERT(last <= m_size);
+    size_t count = last - first;
+    if (count == 0)
+        return;
+    for (size_t i = first; i < last; ++i)
+        slot(i)->~Segment();
+    // Close the gap from whichever side has fewer Segments to move
+    if (first < m_size - last) {
+        for (size_t i = first; i > 0; --i)
+            move(i - 1, i - 1 + count);
+        m_head = (m_head + count) & (m_capacity - 1);
+    } else {
+        for (size_t i = last; i < m_size; ++i)
+            move(i, i - count);
+    }
+    m_size -= count;
+}
+
+void
+Buffer::SegmentList::clear()
+{
+    for (size_t i = 0; i < m_size; ++i)
+        slot(i)->~Segment();
+    m_head = m_size = 0;
+}
+
+// Segments only hold pointers (and a reference to their Block), so they can
+// be moved around as raw bytes, without touching reference counts
+void
+Buffer::SegmentList::move(size_t from, size_t to)
+{
+    memcpy((void *)slot(to), (const void *)slot(from), sizeof(Segment));
+}
+
+void
+Buffer::SegmentList::grow()
+{
+    Segment *segments =
+        (Segment *)::operator new(m_capacity * 2 * sizeof(Segment));
+    for (size_t i = 0; i < m_size; ++i)
+        memcpy((void *)(segments + i), (const void *)slot(i),
+            sizeof(Segment));
+    if (m_segments != (Segment *)m_inline.bytes)
+        ::operator delete(m_segments);
+    m_segments = segments;
+    m_capacity *= 2;
+    m_head = 0;
+}
+
 
 Buffer::Buffer()
 {
     m_readAvailable = m_writeAvailable = 0;
-    m_writeIt = m_segments.end();
+    m_writeSegment = 0;
     invariant();
 }
 
 Buffer::Buffer(const Buffer &copy)
 {
     m_readAvailable = m_writeAvailable = 0;
-    m_writeIt = m_segments.end();
+    m_writeSegment = 0;
     copyIn(copy);
 }
 
 Buffer::Buffer(const char *string)
 {
     m_readAvailable = m_writeAvailable = 0;
-    m_writeIt = m_segments.end();
+    m_writeSegment = 0;
     copyIn(string, strlen(string));
 }
 
 Buffer::Buffer(const std::string &string)
 {
     m_readAvailable = m_writeAvailable = 0;
-    m_writeIt = m_segments.end();
+    m_writeSegment = 0;
     copyIn(string);
 }
 
 Buffer::Buffer(const void *data, size_t length)
 {
     m_readAvailable = m_writeAvailable = 0;
-    m_writeIt = m_segments.end();
+    m_writeSegment = 0;
     copyIn(data, length);
 }
 
@@ -248,13 +749,10 @@ Buffer::adopt(void *buffer, size_t length)
         // put the new buffer at the front if possible to avoid
         // fragmentation
         m_segments.push_front(newSegment);
-        m_writeIt = m_segments.begin();
+        m_writeSegment = 0;
     } else {
+        // If there wasn't a write segment, this is it now
         m_segments.push_back(newSegment);
-        if (m_writeAvailable == 0) {
-            m_writeIt = m_segments.end();
-            --m_writeIt;
-        }
     }
     m_writeAvailable += length;
     invariant();
@@ -270,13 +768,10 @@ Buffer::reserve(size_t length)
             // put the new buffer at the front if possible to avoid
             // fragmentation
             m_segments.push_front(newSegment);
-            m_writeIt = m_segments.begin();
+            m_writeSegment = 0;
         } else {
+            // If there wasn't a write segment, this is it now
             m_segments.push_back(newSegment);
-            if (m_writeAvailable == 0) {
-                m_writeIt = m_segments.end();
-                --m_writeIt;
-            }
         }
         m_writeAvailable += newSegment.length();
         invariant();
@@ -287,12 +782,13 @@ void
 Buffer::compact()
 {
     invariant();
-    if (m_writeIt != m_segments.end()) {
-        if (m_writeIt->readAvailable() > 0) {
-            Segment newSegment = Segment(m_writeIt->readBuffer());
-            m_segments.insert(m_writeIt, newSegment);
+    if (m_writeSegment != m_segments.size()) {
+        Segment &segment = m_segments[m_writeSegment];
+        if (segment.readAvailable() > 0) {
+            Segment newSegment = Segment(segment.readBuffer());
+            m_segments.insert(m_writeSegment++, newSegment);
         }
-        m_writeIt = m_segments.erase(m_writeIt, m_segments.end());
+        m_segments.erase(m_writeSegment, m_segments.size());
         m_writeAvailable = 0;
     }
     MORDOR_ASSERT(writeAvailable() == 0);
@@ -305,12 +801,16 @@ Buffer::clear(bool clearWriteAvailableAsWell)
     if (clearWriteAvailableAsWell) {
         m_readAvailable = m_writeAvailable = 0;
         m_segments.clear();
-        m_writeIt = m_segments.end();
+        m_writeSegment = 0;
     } else {
         m_readAvailable = 0;
-        if (m_writeIt != m_segments.end() && m_writeIt->readAvailable())
-            m_writeIt->consume(m_writeIt->readAvailable());
-        m_segments.erase(m_segments.begin(), m_writeIt);
+        if (m_writeSegment != m_segments.size()) {
+            Segment &segment = m_segments[m_writeSegment];
+            if (segment.readAvailable())
+                segment.consume(segment.readAvailable());
+        }
+        m_segments.erase(0, m_writeSegment);
+        m_writeSegment = 0;
     }
     invariant();
     MORDOR_ASSERT(m_readAvailable == 0);
@@ -323,12 +823,12 @@ Buffer::produce(size_t length)
     m_readAvailable += length;
     m_writeAvailable -= length;
     while (length > 0) {
-        Segment &segment = *m_writeIt;
+        Segment &segment = m_segments[m_writeSegment];
         size_t toProduce = (std::min)(segment.writeAvailable(), length);
         segment.produce(toProduce);
         length -= toProduce;
         if (segment.writeAvailable() == 0)
-            ++m_writeIt;
+            ++m_writeSegment;
     }
     MORDOR_ASSERT(length == 0);
     invariant();
@@ -340,12 +840,15 @@ Buffer::consume(size_t length)
     MORDOR_ASSERT(length <= readAvailable());
     m_readAvailable -= length;
     while (length > 0) {
-        Segment &segment = *m_segments.begin();
+        Segment &segment = m_segments.front();
         size_t toConsume = (std::min)(segment.readAvailable(), length);
         segment.consume(toConsume);
         length -= toConsume;
-        if (segment.length() == 0)
+        if (segment.length() == 0) {
+            MORDOR_ASSERT(m_writeSegment > 0);
             m_segments.pop_front();
+            --m_writeSegment;
+        }
     }
     MORDOR_ASSERT(length == 0);
     invariant();
@@ -358,28 +861,28 @@ Buffer::truncate(size_t length)
     if (length == m_readAvailable)
         return;
     // Split any mixed read/write bufs
-    if (m_writeIt != m_segments.end() && m_writeIt->readAvailable() != 0) {
-        m_segments.insert(m_writeIt, Segment(m_writeIt->readBuffer()));
-        m_writeIt->consume(m_writeIt->readAvailable());
-    }
+    splitWriteSegment();
     m_readAvailable = length;
-    std::list<Segment>::iterator it;
-    for (it = m_segments.begin(); it != m_segments.end() && length > 0; ++it) {
-        Segment &segment = *it;
+    size_t i;
+    for (i = 0; i < m_segments.size() && length > 0; ++i) {
+        Segment &segment = m_segments[i];
         if (length <= segment.readAvailable()) {
             segment.truncate(length);
             length = 0;
-            ++it;
+            ++i;
             break;
         } else {
             length -= segment.readAvailable();
         }
     }
     MORDOR_ASSERT(length == 0);
-    while (it != m_segments.end() && it->readAvailable() > 0) {
-        MORDOR_ASSERT(it->writeAvailable() == 0);
-        it = m_segments.erase(it);
+    size_t last = i;
+    while (last < m_segments.size() && m_segments[last].readAvailable() > 0) {
+        MORDOR_ASSERT(m_segments[last].writeAvailable() == 0);
+        ++last;
     }
+    m_segments.erase(i, last);
+    m_writeSegment -= last - i;
     invariant();
 }
 
@@ -392,11 +895,11 @@ Buffer::readBuffers(size_t length) const
     std::vector<iovec> result;
     result.reserve(m_segments.size());
     size_t remaining = length;
-    std::list<Segment>::const_iterator it;
-    for (it = m_segments.begin(); it != m_segments.end(); ++it) {
-        size_t toConsume = (std::min)(it->readAvailable(), remaining);
-        SegmentData data = it->readBuffer().slice(0, toConsume);
+    for (size_t i = 0; i < m_segments.size(); ++i) {
+        const Segment &segment = m_segments[i];
+        size_t toConsume = (std::min)(segment.readAvailable(), remaining);
 #ifdef WINDOWS
+        SegmentData data = segment.readBuffer().slice(0, toConsume);
         while (data.length() > 0) {
             iovec wsabuf;
             wsabuf.iov_base = (void *)data.start();
@@ -406,8 +909,8 @@ Buffer::readBuffers(size_t length) const
         }
 #else
         iovec iov;
-        iov.iov_base = (void *)data.start();
-        iov.iov_len = data.length();
+        iov.iov_base = (void *)segment.start();
+        iov.iov_len = toConsume;
         result.push_back(iov);
 #endif
         remaining -= toConsume;
@@ -449,15 +952,16 @@ Buffer::readBuffer(size_t length, bool coalesce) const
     // Breaking constness!
     Buffer* _this = const_cast<Buffer*>(this);
     // try to avoid allocation
-    if (m_writeIt != m_segments.end() && m_writeIt->writeAvailable()
-        >= readAvailable()) {
-        copyOut(m_writeIt->writeBuffer().start(), readAvailable());
-        Segment newSegment = Segment(m_writeIt->writeBuffer().slice(0,
+    if (m_writeSegment != m_segments.size() &&
+        m_segments[m_writeSegment].writeAvailable() >= readAvailable()) {
+        Segment &writeSegment = _this->m_segments[m_writeSegment];
+        copyOut(writeSegment.writeBuffer().start(), readAvailable());
+        Segment newSegment = Segment(writeSegment.writeBuffer().slice(0,
             readAvailable()));
         _this->m_segments.clear();
         _this->m_segments.push_back(newSegment);
         _this->m_writeAvailable = 0;
-        _this->m_writeIt = _this->m_segments.end();
+        _this->m_writeSegment = 1;
         invariant();
         SegmentData data = newSegment.readBuffer().slice(0, length);
         result.iov_base = data.start();
@@ -470,7 +974,7 @@ Buffer::readBuffer(size_t length, bool coalesce) const
     _this->m_segments.clear();
     _this->m_segments.push_back(newSegment);
     _this->m_writeAvailable = 0;
-    _this->m_writeIt = _this->m_segments.end();
+    _this->m_writeSegment = 1;
     invariant();
     SegmentData data = newSegment.readBuffer().slice(0, length);
     result.iov_base = data.start();
@@ -487,9 +991,9 @@ Buffer::writeBuffers(size_t length)
     std::vector<iovec> result;
     result.reserve(m_segments.size());
     size_t remaining = length;
-    std::list<Segment>::iterator it = m_writeIt;
+    size_t i = m_writeSegment;
     while (remaining > 0) {
-        Segment& segment = *it;
+        Segment& segment = m_segments[i];
         size_t toProduce = (std::min)(segment.writeAvailable(), remaining);
         SegmentData data = segment.writeBuffer().slice(0, toProduce);
 #ifdef WINDOWS
@@ -507,7 +1011,7 @@ Buffer::writeBuffers(size_t length)
         result.push_back(iov);
 #endif
         remaining -= toProduce;
-        ++it;
+        ++i;
     }
     MORDOR_ASSERT(remaining == 0);
     invariant();
@@ -525,16 +1029,18 @@ Buffer::writeBuffer(size_t length, bool coalesce)
     // Must allocate just the write segment
     if (writeAvailable() == 0) {
         reserve(length);
-        MORDOR_ASSERT(m_writeIt != m_segments.end());
-        MORDOR_ASSERT(m_writeIt->writeAvailable() >= length);
-        SegmentData data = m_writeIt->writeBuffer().slice(0, length);
+        MORDOR_ASSERT(m_writeSegment != m_segments.size());
+        MORDOR_ASSERT(m_segments[m_writeSegment].writeAvailable() >= length);
+        SegmentData data = m_segments[m_writeSegment].writeBuffer().slice(0,
+            length);
         result.iov_base = data.start();
         result.iov_len = iovLength(data.length());
         return result;
     }
     // Can use an existing write segment
-    if (writeAvailable() > 0 && m_writeIt->writeAvailable() >= length) {
-        SegmentData data = m_writeIt->writeBuffer().slice(0, length);
+    Segment &writeSegment = m_segments[m_writeSegment];
+    if (writeSegment.writeAvailable() >= length) {
+        SegmentData data = writeSegment.writeBuffer().slice(0, length);
         result.iov_base = data.start();
         result.iov_len = iovLength(data.length());
         return result;
@@ -542,7 +1048,7 @@ Buffer::writeBuffer(size_t length, bool coalesce)
     // If they don't want us to coalesce, just return as much as we can from
     // the first segment
     if (!coalesce) {
-        SegmentData data = m_writeIt->writeBuffer();
+        SegmentData data = writeSegment.writeBuffer();
         result.iov_base = data.start();
         result.iov_len = iovLength(data.length());
         return result;
@@ -550,9 +1056,10 @@ Buffer::writeBuffer(size_t length, bool coalesce)
     // Existing bufs are insufficient... remove them and reserve anew
     compact();
     reserve(length);
-    MORDOR_ASSERT(m_writeIt != m_segments.end());
-    MORDOR_ASSERT(m_writeIt->writeAvailable() >= length);
-    SegmentData data = m_writeIt->writeBuffer().slice(0, length);
+    MORDOR_ASSERT(m_writeSegment != m_segments.size());
+    MORDOR_ASSERT(m_segments[m_writeSegment].writeAvailable() >= length);
+    SegmentData data = m_segments[m_writeSegment].writeBuffer().slice(0,
+        length);
     result.iov_base = data.start();
     result.iov_len = iovLength(data.length());
     return result;
@@ -571,31 +1078,27 @@ Buffer::copyIn(const Buffer &buffer, size_t length, size_t pos)
     if (length == 0)
         return;
 
-    // Split any mixed read/write bufs
-    if (m_writeIt != m_segments.end() && m_writeIt->readAvailable() != 0) {
-        m_segments.insert(m_writeIt, Segment(m_writeIt->readBuffer()));
-        m_writeIt->consume(m_writeIt->readAvailable());
-        invariant();
-    }
+    splitWriteSegment();
+    invariant();
 
-    std::list<Segment>::const_iterator it = buffer.m_segments.begin();
-    while (pos != 0 && it != buffer.m_segments.end()) {
-        if (pos < it->readAvailable())
+    size_t i = 0;
+    while (pos != 0 && i < buffer.m_segments.size()) {
+        if (pos < buffer.m_segments[i].readAvailable())
             break;
-        pos -= it->readAvailable();
-        ++it;
-    }
-    MORDOR_ASSERT(it != buffer.m_segments.end());
-    for (; it != buffer.m_segments.end(); ++it) {
-        size_t toConsume = (std::min)(it->readAvailable() - pos, length);
-        if (m_readAvailable != 0 && it == buffer.m_segments.begin()) {
-            std::list<Segment>::iterator previousIt = m_writeIt;
-            --previousIt;
-            if ((char *)previousIt->readBuffer().start() +
-                previousIt->readBuffer().length() == (char *)it->readBuffer().start() + pos &&
-                previousIt->m_data.m_array.get() == it->m_data.m_array.get()) {
-                MORDOR_ASSERT(previousIt->writeAvailable() == 0);
-                previousIt->extend(toConsume);
+        pos -= buffer.m_segments[i].readAvailable();
+        ++i;
+    }
+    MORDOR_ASSERT(i < buffer.m_segments.size());
+    for (; i < buffer.m_segments.size(); ++i) {
+        const Segment &segment = buffer.m_segments[i];
+        size_t toConsume = (std::min)(segment.readAvailable() - pos, length);
+        if (m_readAvailable != 0 && i == 0) {
+            Segment &previous = m_segments[m_writeSegment - 1];
+            if ((char *)previous.start() +
+                previous.readAvailable() == (char *)segment.start() + pos &&
+                previous.m_data.m_block.get() == segment.m_data.m_block.get()) {
+                MORDOR_ASSERT(previous.writeAvailable() == 0);
+                previous.extend(toConsume);
                 m_readAvailable += toConsume;
                 length -= toConsume;
                 pos = 0;
@@ -604,8 +1107,8 @@ Buffer::copyIn(const Buffer &buffer, size_t length, size_t pos)
                 continue;
             }
         }
-        Segment newSegment = Segment(it->readBuffer().slice(pos, toConsume));
-        m_segments.insert(m_writeIt, newSegment);
+        Segment newSegment = Segment(segment.readBuffer().slice(pos, toConsume));
+        m_segments.insert(m_writeSegment++, newSegment);
         m_readAvailable += toConsume;
         length -= toConsume;
         pos = 0;
@@ -621,16 +1124,17 @@ Buffer::copyIn(const void *data, size_t length)
 {
     invariant();
 
-    while (m_writeIt != m_segments.end() && length > 0) {
-        size_t todo = (std::min)(length, m_writeIt->writeAvailable());
-        memcpy(m_writeIt->writeBuffer().start(), data, todo);
-        m_writeIt->produce(todo);
+    while (m_writeSegment != m_segments.size() && length > 0) {
+        Segment &segment = m_segments[m_writeSegment];
+        size_t todo = (std::min)(length, segment.writeAvailable());
+        memcpy(segment.writeBuffer().start(), data, todo);
+        segment.produce(todo);
         m_writeAvailable -= todo;
         m_readAvailable += todo;
         data = (unsigned char*)data + todo;
         length -= todo;
-        if (m_writeIt->writeAvailable() == 0)
-            ++m_writeIt;
+        if (segment.writeAvailable() == 0)
+            ++m_writeSegment;
         invariant();
     }
 
@@ -639,6 +1143,7 @@ Buffer::copyIn(const void *data, size_t length)
         memcpy(newSegment.writeBuffer().start(), data, length);
         newSegment.produce(length);
         m_segments.push_back(newSegment);
+        ++m_writeSegment;
         m_readAvailable += length;
     }
 
@@ -665,17 +1170,18 @@ Buffer::copyOut(void *buffer, size_t length, size_t pos) const
 
     MORDOR_ASSERT(length + pos <= readAvailable());
     unsigned char *next = (unsigned char*)buffer;
-    std::list<Segment>::const_iterator it = m_segments.begin();
-    while (pos != 0 && it != m_segments.end()) {
-        if (pos < it->readAvailable())
+    size_t i = 0;
+    while (pos != 0 && i < m_segments.size()) {
+        if (pos < m_segments[i].readAvailable())
             break;
-        pos -= it->readAvailable();
-        ++it;
+        pos -= m_segments[i].readAvailable();
+        ++i;
     }
-    MORDOR_ASSERT(it != m_segments.end());
-    for (; it != m_segments.end(); ++it) {
-        size_t todo = (std::min)(length, it->readAvailable() - pos);
-        memcpy(next, (char *)it->readBuffer().start() + pos, todo);
+    MORDOR_ASSERT(i < m_segments.size());
+    for (; i < m_segments.size(); ++i) {
+        const Segment &segment = m_segments[i];
+        size_t todo = (std::min)(length, segment.readAvailable() - pos);
+        memcpy(next, (char *)segment.start() + pos, todo);
         next += todo;
         length -= todo;
         pos = 0;
@@ -685,6 +1191,213 @@ Buffer::copyOut(void *buffer, size_t length, size_t pos) const
     MORDOR_ASSERT(length == 0);
 }
 
+// Search kernels for find(); each returns the first match that fits entirely
+// within [start, start + length), or NULL
+typedef const unsigned char *(*FindByteKernel)(const unsigned char *start,
+    size_t length, unsigned char byte);
+typedef const unsigned char *(*FindStringKernel)(const unsigned char *start,
+    size_t length, const unsigned char *string, size_t stringLength);
+
+static const unsigned char *
+findByteScalar(const unsigned char *start, size_t length, unsigned char byte)
+{
+    return (const unsigned char *)memchr(start, byte, length);
+}
+
+static const unsigned char *
+findStringScalar(const unsigned char *start, size_t length,
+    const unsigned char *string, size_t stringLength)
+{
+    if (length < stringLength)
+        return NULL;
+    const unsigned char *last = start + length - stringLength;
+    while (start <= last) {
+        const unsigned char *point = (const unsigned char *)memchr(start,
+            string[0], last - start + 1);
+        if (!point)
+            return NULL;
+        if (memcmp(point + 1, string + 1, stringLength - 1) == 0)
+            return point;
+        start = point + 1;
+    }
+    return NULL;
+}
+
+#ifdef X86_64
+static inline unsigned int
+firstSetBit(unsigned int mask)
+{
+#ifdef MSVC
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+static const unsigned char *
+findByteSSE2(const unsigned char *start, size_t length, unsigned char byte)
+{
+    const __m128i needle = _mm_set1_epi8((char)byte);
+    for (int i = 0; i < 4 && length >= 16; ++i, start += 16, length -= 16) {
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(needle,
+            _mm_loadu_si128((const __m128i *)start)));
+        if (mask)
+            return start + firstSetBit(mask);
+    }
+    return findByteScalar(start, length, byte);
+}
+
+static inline unsigned int
+matchEndsSSE2(const unsigned char *block, __m128i first, __m128i last,
+    size_t stringLength)
+{
+    return _mm_movemask_epi8(_mm_and_si128(
+        _mm_cmpeq_epi8(first, _mm_loadu_si128((const __m128i *)block)),
+        _mm_cmpeq_epi8(last, _mm_loadu_si128(
+            (const __m128i *)(block + stringLength - 1)))));
+}
+
+// Compares 32 candidate positions at a time against the first and last bytes
+// of string, and only memcmps the rest where both match
+static const unsigned char *
+findStringSSE2(const unsigned char *start, size_t length,
+    const unsigned char *string, size_t stringLength)
+{
+    MORDOR_ASSERT(stringLength >= 2);
+    if (length < stringLength)
+        return NULL;
+    const __m128i first = _mm_set1_epi8((char)string[0]);
+    const __m128i last = _mm_set1_epi8((char)string[stringLength - 1]);
+    size_t candidates = length - stringLength + 1;
+    size_t i = 0;
+    for (; i + 32 <= candidates; i += 32) {
+        const unsigned char *block = start + i;
+        unsigned int mask = matchEndsSSE2(block, first, last, stringLength);
+        mask |= matchEndsSSE2(block + 16, first, last, stringLength) << 16;
+        for (; mask; mask &= mask - 1) {
+            const unsigned char *point = block + firstSetBit(mask);
+            if (memcmp(point + 1, string + 1, stringLength - 2) == 0)
+                return point;
+        }
+    }
+    return findStringScalar(start + i, length - i, string, stringLength);
+}
+
+#ifdef GCC
+// Delimiters are usually close (the end of a header line, a chunk size), so
+// check the first 64 bytes inline, and leave longer scans to memchr, which
+// the C library already unrolls further than this
+__attribute__((target("avx2"))) static const unsigned char *
+findByteAVX2(const unsigned char *start, size_t length, unsigned char byte)
+{
+    const __m256i needle = _mm256_set1_epi8((char)byte);
+    for (int i = 0; i < 2 && length >= 32; ++i, start += 32, length -= 32) {
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(needle,
+            _mm256_loadu_si256((const __m256i *)start)));
+        if (mask)
+            return start + firstSetBit(mask);
+    }
+    return findByteScalar(start, length, byte);
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+matchEndsAVX2(const unsigned char *block, __m256i first, __m256i last,
+    size_t stringLength)
+{
+    return _mm256_and_si256(
+        _mm256_cmpeq_epi8(first, _mm256_loadu_si256((const __m256i *)block)),
+        _mm256_cmpeq_epi8(last, _mm256_loadu_si256(
+            (const __m256i *)(block + stringLength - 1))));
+}
+
+// Like findStringSSE2, but skipping 128 candidates at a time when none of
+// them match at both ends
+__attribute__((target("avx2"))) static const unsigned char *
+findStringAVX2(const unsigned char *start, size_t length,
+    const unsigned char *string, size_t stringLength)
+{
+    MORDOR_ASSERT(stringLength >= 2);
+    if (length < stringLength)
+        return NULL;
+    const __m256i first = _mm256_set1_epi8((char)string[0]);
+    const __m256i last = _mm256_set1_epi8((char)string[stringLength - 1]);
+    size_t candidates = length - stringLength + 1;
+    size_t i = 0;
+    while (i + 32 <= candidates) {
+        if (i + 128 <= candidates) {
+            const unsigned char *block = start + i;
+            __m256i any = _mm256_or_si256(
+                _mm256_or_si256(
+                    matchEndsAVX2(block, first, last, stringLength),
+                    matchEndsAVX2(block + 32, first, last, stringLength)),
+                _mm256_or_si256(
+                    matchEndsAVX2(block + 64, first, last, stringLength),
+                    matchEndsAVX2(block + 96, first, last, stringLength)));
+            if (!_mm256_movemask_epi8(any)) {
+                i += 128;
+                continue;
+            }
+        }
+        unsigned int mask = _mm256_movemask_epi8(
+            matchEndsAVX2(start + i, first, last, stringLength));
+        for (; mask; mask &= mask - 1) {
+            const unsigned char *point = start + i + firstSetBit(mask);
+            if (memcmp(point + 1, string + 1, stringLength - 2) == 0)
+                return point;
+        }
+        i += 32;
+    }
+    return findStringSSE2(start + i, length - i, string, stringLength);
+}
+#endif
+#endif
+
+// Scalar until the initializer below has looked at the processor
+static FindByteKernel g_findByte = &findByteScalar;
+static FindStringKernel g_findString = &findStringScalar;
+
+static void selectFindKernels()
+{
+    std::string kernel = g_findKernel->val();
+    g_findByte = &findByteScalar;
+    g_findString = &findStringScalar;
+    if (kernel == "scalar")
+        return;
+#ifdef X86_64
+    bool avx2 = false;
+#ifdef GCC
+    __builtin_cpu_init();
+    avx2 = __builtin_cpu_supports("avx2");
+#endif
+    // SSE2 is part of x86-64, but its string kernel loses to scalar on
+    // inputs dense with candidate first bytes (binary multipart bodies,
+    // short header lines), so auto only goes vector with AVX2
+    if (kernel == "auto" && !avx2)
+        return;
+    g_findByte = &findByteSSE2;
+    g_findString = &findStringSSE2;
+    if (kernel == "sse2" || !avx2)
+        return;
+#ifdef GCC
+    g_findByte = &findByteAVX2;
+    g_findString = &findStringAVX2;
+#endif
+#endif
+}
+
+namespace {
+static struct FindKernelInitializer
+{
+    FindKernelInitializer()
+    {
+        selectFindKernels();
+        g_findKernel->monitor(&selectFindKernels);
+    }
+} g_findKernelInitializer;
+}
+
 ptrdiff_t
 Buffer::find(char delimiter, size_t length) const
 {
@@ -695,11 +1408,12 @@ Buffer::find(char delimiter, size_t length) const
     size_t totalLength = 0;
     bool success = false;
 
-    std::list<Segment>::const_iterator it;
-    for (it = m_segments.begin(); it != m_segments.end(); ++it) {
-        const void *start = it->readBuffer().start();
-        size_t toscan = (std::min)(length, it->readAvailable());
-        const void *point = memchr(start, delimiter, toscan);
+    for (size_t i = 0; i < m_segments.size(); ++i) {
+        const unsigned char *start =
+            (const unsigned char *)m_segments[i].start();
+        size_t toscan = (std::min)(length, m_segments[i].readAvailable());
+        const unsigned char *point = g_findByte(start, toscan,
+            (unsigned char)delimiter);
         if (point != NULL) {
             success = true;
             totalLength += (unsigned char*)point - (unsigned char*)start;
@@ -723,54 +1437,52 @@ Buffer::find(const std::string &string, size_t length) const
     MORDOR_ASSERT(length <= readAvailable());
     MORDOR_ASSERT(!string.empty());
 
+    if (string.size() == 1)
+        return find(string[0], length);
+    const unsigned char *needle = (const unsigned char *)string.c_str();
+
     size_t totalLength = 0;
-    size_t foundSoFar = 0;
-
-    std::list<Segment>::const_iterator it;
-    for (it = m_segments.begin(); it != m_segments.end(); ++it) {
-        const void *start = it->readBuffer().start();
-        size_t toscan = (std::min)(length, it->readAvailable());
-        while (toscan > 0) {
-            if (foundSoFar == 0) {
-                const void *point = memchr(start, string[0], toscan);
-                if (point != NULL) {
-                    foundSoFar = 1;
-                    size_t found = (unsigned char*)point -
-                        (unsigned char*)start;
-                    toscan -= found + 1;
-                    length -= found + 1;
-                    totalLength += found;
-                    start = (unsigned char*)point + 1;
-                } else {
-                    totalLength += toscan;
-                    length -= toscan;
-                    toscan = 0;
-                    continue;
-                }
-            }
-            MORDOR_ASSERT(foundSoFar != 0);
-            size_t tocompare = (std::min)(toscan, string.size() - foundSoFar);
-            if (memcmp(start, string.c_str() + foundSoFar, tocompare) == 0) {
-                foundSoFar += tocompare;
-                toscan -= tocompare;
-                length -= tocompare;
-                if (foundSoFar == string.size())
-                    break;
-            } else {
-                totalLength += foundSoFar;
-                foundSoFar = 0;
-            }
-        }
-        if (foundSoFar == string.size())
-            break;
-        if (length == 0)
+    for (size_t i = 0; i < m_segments.size(); ++i) {
+        if (totalLength + string.size() > length)
             break;
+        const unsigned char *start =
+            (const unsigned char *)m_segments[i].start();
+        size_t toscan = (std::min)(length - totalLength,
+            m_segments[i].readAvailable());
+        const unsigned char *point = g_findString(start, toscan, needle,
+            string.size());
+        if (point != NULL)
+            return totalLength + (point - start);
+        // Now the matches that start in this segment, but end in a later one
+        size_t offset = toscan < string.size() ? 0 : toscan - string.size() + 1;
+        for (; offset < toscan; ++offset) {
+            if (totalLength + offset + string.size() > length)
+                break;
+            if (start[offset] == needle[0] && matches(i, offset, string))
+                return totalLength + offset;
+        }
+        totalLength += toscan;
     }
-    if (foundSoFar == string.size())
-        return totalLength;
     return -1;
 }
 
+bool
+Buffer::matches(size_t segment, size_t offset, const std::string &string) const
+{
+    size_t matched = 0;
+    for (; segment < m_segments.size() && matched < string.size(); ++segment) {
+        const Segment &current = m_segments[segment];
+        size_t tocompare = (std::min)(current.readAvailable() - offset,
+            string.size() - matched);
+        if (memcmp((const unsigned char *)current.start() + offset,
+            string.c_str() + matched, tocompare) != 0)
+            return false;
+        matched += tocompare;
+        offset = 0;
+    }
+    return matched == string.size();
+}
+
 std::string
 Buffer::toString() const
 {
@@ -830,11 +1542,10 @@ Buffer::visit(boost::function<void (const void *, size_t)> dg, size_t length) co
         length = readAvailable();
     MORDOR_ASSERT(length <= readAvailable());
 
-    std::list<Segment>::const_iterator it;
-    for (it = m_segments.begin(); it != m_segments.end() && length > 0; ++it) {
-        size_t todo = (std::min)(length, it->readAvailable());
+    for (size_t i = 0; i < m_segments.size() && length > 0; ++i) {
+        size_t todo = (std::min)(length, m_segments[i].readAvailable());
         MORDOR_ASSERT(todo != 0);
-        dg(it->readBuffer().start(), todo);
+        dg(m_segments[i].start(), todo);
         length -= todo;
     }
     MORDOR_ASSERT(length == 0);
@@ -893,12 +1604,13 @@ Buffer::operator!= (const char *string) const
 int
 Buffer::opCmp(const Buffer &rhs) const
 {
-    std::list<Segment>::const_iterator leftIt, rightIt;
     int lengthResult = (int)((ptrdiff_t)readAvailable() - (ptrdiff_t)rhs.readAvailable());
-    leftIt = m_segments.begin(); rightIt = rhs.m_segments.begin();
+    size_t left = 0, right = 0;
     size_t leftOffset = 0, rightOffset = 0;
-    while (leftIt != m_segments.end() && rightIt != rhs.m_segments.end())
+    while (left < m_segments.size() && right < rhs.m_segments.size())
     {
+        const Segment *leftIt = &m_segments[left];
+        const Segment *rightIt = &rhs.m_segments[right];
         MORDOR_ASSERT(leftOffset <= leftIt->readAvailable());
         MORDOR_ASSERT(rightOffset <= rightIt->readAvailable());
         size_t tocompare = (std::min)(leftIt->readAvailable() - leftOffset,
@@ -906,8 +1618,8 @@ Buffer::opCmp(const Buffer &rhs) const
         if (tocompare == 0)
             break;
         int result = memcmp(
-            (const unsigned char *)leftIt->readBuffer().start() + leftOffset,
-            (const unsigned char *)rightIt->readBuffer().start() + rightOffset,
+            (const unsigned char *)leftIt->start() + leftOffset,
+            (const unsigned char *)rightIt->start() + rightOffset,
             tocompare);
         if (result != 0)
             return result;
@@ -915,11 +1627,11 @@ Buffer::opCmp(const Buffer &rhs) const
         rightOffset += tocompare;
         if (leftOffset == leftIt->readAvailable()) {
             leftOffset = 0;
-            ++leftIt;
+            ++left;
         }
         if (rightOffset == rightIt->readAvailable()) {
             rightOffset = 0;
-            ++rightIt;
+            ++right;
         }
     }
     return lengthResult;
@@ -929,13 +1641,13 @@ int
 Buffer::opCmp(const char *string, size_t length) const
 {
     size_t offset = 0;
-    std::list<Segment>::const_iterator it;
     int lengthResult = (int)((ptrdiff_t)readAvailable() - (ptrdiff_t)length);
     if (lengthResult > 0)
         length = readAvailable();
-    for (it = m_segments.begin(); it != m_segments.end(); ++it) {
-        size_t tocompare = (std::min)(it->readAvailable(), length);
-        int result = memcmp(it->readBuffer().start(), string + offset, tocompare);
+    for (size_t i = 0; i < m_segments.size(); ++i) {
+        size_t tocompare = (std::min)(m_segments[i].readAvailable(), length);
+        int result = memcmp(m_segments[i].start(), string + offset,
+            tocompare);
         if (result != 0)
             return result;
         length -= tocompare;
@@ -946,6 +1658,19 @@ Buffer::opCmp(const char *string, size_t length) const
     return lengthResult;
 }
 
+void
+Buffer::splitWriteSegment()
+{
+    // Split any mixed read/write bufs
+    if (m_writeSegment != m_segments.size() &&
+        m_segments[m_writeSegment].readAvailable() != 0) {
+        Segment readSegment(m_segments[m_writeSegment].readBuffer());
+        m_segments.insert(m_writeSegment++, readSegment);
+        Segment &writeSegment = m_segments[m_writeSegment];
+        writeSegment.consume(writeSegment.readAvailable());
+    }
+}
+
 void
 Buffer::invariant() const
 {
@@ -953,38 +1678,36 @@ Buffer::invariant() const
     size_t read = 0;
     size_t write = 0;
     bool seenWrite = false;
-    std::list<Segment>::const_iterator it;
-    for (it = m_segments.begin(); it != m_segments.end(); ++it) {
-        const Segment &segment = *it;
+    for (size_t i = 0; i < m_segments.size(); ++i) {
+        const Segment &segment = m_segments[i];
         // Strict ordering
         MORDOR_ASSERT(!seenWrite || (seenWrite && segment.readAvailable() == 0));
         read += segment.readAvailable();
         write += segment.writeAvailable();
         if (!seenWrite && segment.writeAvailable() != 0) {
             seenWrite = true;
-            MORDOR_ASSERT(m_writeIt == it);
+            MORDOR_ASSERT(m_writeSegment == i);
         }
         // We should keep segments optimally merged together
-        std::list<Segment>::const_iterator nextIt = it;
-        ++nextIt;
-        if (nextIt != m_segments.end()) {
-            const Segment& next = *nextIt;
+        if (i + 1 < m_segments.size()) {
+            const Segment& next = m_segments[i + 1];
             if (segment.writeAvailable() == 0 &&
                 next.readAvailable() != 0) {
                 MORDOR_ASSERT((const unsigned char*)segment.readBuffer().start() +
                     segment.readAvailable() != next.readBuffer().start() ||
-                    segment.m_data.m_array.get() != next.m_data.m_array.get());
+                    segment.m_data.m_block.get() != next.m_data.m_block.get());
             } else if (segment.writeAvailable() != 0 &&
                 next.readAvailable() == 0) {
                 MORDOR_ASSERT((const unsigned char*)segment.writeBuffer().start() +
                     segment.writeAvailable() != next.writeBuffer().start() ||
-                    segment.m_data.m_array.get() != next.m_data.m_array.get());
+                    segment.m_data.m_block.get() != next.m_data.m_block.get());
             }
         }
     }
     MORDOR_ASSERT(read == m_readAvailable);
     MORDOR_ASSERT(write == m_writeAvailable);
-    MORDOR_ASSERT(write != 0 || (write == 0 && m_writeIt == m_segments.end()));
+    MORDOR_ASSERT(write != 0 || (write == 0 &&
+        m_writeSegment == m_segments.size()));
 #endif
 }
 
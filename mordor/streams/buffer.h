@@ -4,8 +4,9 @@
 #include <list>
 #include <vector>
 
-#include <boost/shared_array.hpp>
 #include <boost/function.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/noncopyable.hpp>
 
 #include "mordor/socket.h"
 
@@ -14,6 +15,15 @@ namespace Mordor {
 struct Buffer
 {
 private:
+    /// Reference counted storage shared by SegmentDatas
+    ///
+    /// Storage for new segments comes from a pool of size-classed slabs,
+    /// with the Block header in front of the data, so a segment is a single
+    /// allocation, and usually not even that.
+    struct Block;
+    friend void intrusive_ptr_add_ref(Block *block);
+    friend void intrusive_ptr_release(Block *block);
+
     struct SegmentData
     {
         friend struct Buffer;
@@ -26,6 +36,8 @@ private:
         const SegmentData slice(size_t start, size_t length = ~0) const;
 
         void extend(size_t len);
+        /// slice(len), in place
+        void consume(size_t len);
 
     public:
         void *start() { return m_start; }
@@ -37,7 +49,7 @@ private:
         void *m_start;
         size_t m_length;
     private:
-        boost::shared_array<unsigned char> m_array;
+        boost::intrusive_ptr<Block> m_block;
     };
 
     struct Segment
@@ -58,6 +70,8 @@ private:
         const SegmentData readBuffer() const;
         const SegmentData writeBuffer() const;
         SegmentData writeBuffer();
+        /// readBuffer().start(), without copying the SegmentData
+        const void *start() const { return m_data.start(); }
 
     private:
         size_t m_writeIndex;
@@ -66,6 +80,56 @@ private:
         void invariant() const;
     };
 
+    /// The Segments of a Buffer, in order
+    ///
+    /// A ring with room for a few Segments inline, because most Buffers only
+    /// ever hold one to three of them; consuming from the front and
+    /// producing at the back don't allocate or move anything.  Positions are
+    /// indexes from the front, so adding or removing Segments before a
+    /// position shifts it.
+    struct SegmentList : boost::noncopyable
+    {
+    public:
+        SegmentList();
+        ~SegmentList();
+
+        size_t size() const { return m_size; }
+        bool empty() const { return m_size == 0; }
+
+        Segment &operator[](size_t index)
+        { return m_segments[(m_head + index) & (m_capacity - 1)]; }
+        const Segment &operator[](size_t index) const
+        { return m_segments[(m_head + index) & (m_capacity - 1)]; }
+        Segment &front() { return (*this)[0]; }
+        const Segment &front() const { return (*this)[0]; }
+
+        // segment must not already be in the list
+        void push_front(const Segment &segment);
+        void push_back(const Segment &segment);
+        /// Inserts segment before index
+        void insert(size_t index, const Segment &segment);
+        void pop_front();
+        /// Erases [first, last)
+        void erase(size_t first, size_t last);
+        void clear();
+
+    private:
+        Segment *slot(size_t index)
+        { return &(*this)[index]; }
+        void move(size_t from, size_t to);
+        void grow();
+
+    private:
+        enum { INLINE_SEGMENTS = 4 };
+
+        Segment *m_segments;
+        size_t m_capacity, m_head, m_size;
+        union {
+            unsigned char bytes[INLINE_SEGMENTS * sizeof(Segment)];
+            void *align;
+        } m_inline;
+    };
+
 public:
     Buffer();
     Buffer(const Buffer &copy);
@@ -120,14 +184,19 @@ public:
     bool operator!= (const char *str) const;
 
 private:
-    std::list<Segment> m_segments;
+    SegmentList m_segments;
     size_t m_readAvailable;
     size_t m_writeAvailable;
-    std::list<Segment>::iterator m_writeIt;
+    // Index of the first Segment with writeAvailable, or m_segments.size()
+    size_t m_writeSegment;
 
     int opCmp(const Buffer &rhs) const;
     int opCmp(const char *string, size_t length) const;
 
+    void splitWriteSegment();
+    /// If string is at offset in the segment'th Segment (and onward)
+    bool matches(size_t segment, size_t offset, const std::string &string) const;
+
     void invariant() const;
 };
 
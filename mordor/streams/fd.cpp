@@ -19,6 +19,57 @@ namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:streams:fd");
 
+// If the IOManager is using io_uring, I/O is submitted to the ring, and the
+// calling Fiber waits there for it to complete; otherwise it's attempted
+// directly, and the caller waits for readiness on EAGAIN
+static ssize_t
+doReadv(IOManager *ioManager, int fd, const iovec *iov, int iovcnt)
+{
+#ifdef LINUX
+    if (ioManager && ioManager->usingIoUring()) {
+        int rc = ioManager->readv(fd, iov, iovcnt);
+        if (rc < 0) {
+            errno = -rc;
+            return -1;
+        }
+        return rc;
+    }
+#endif
+    return ::readv(fd, iov, iovcnt);
+}
+
+static ssize_t
+doWritev(IOManager *ioManager, int fd, const iovec *iov, int iovcnt)
+{
+#ifdef LINUX
+    if (ioManager && ioManager->usingIoUring()) {
+        int rc = ioManager->writev(fd, iov, iovcnt);
+        if (rc < 0) {
+            errno = -rc;
+            return -1;
+        }
+        return rc;
+    }
+#endif
+    return ::writev(fd, iov, iovcnt);
+}
+
+static int
+doFsync(IOManager *ioManager, int fd)
+{
+#ifdef LINUX
+    if (ioManager && ioManager->usingIoUring()) {
+        int rc = ioManager->fsync(fd);
+        if (rc < 0) {
+            errno = -rc;
+            return -1;
+        }
+        return rc;
+    }
+#endif
+    return ::fsync(fd);
+}
+
 FDStream::FDStream()
 : m_ioManager(NULL),
   m_scheduler(NULL),
@@ -34,7 +85,13 @@ FDStream::init(int fd, IOManager *ioManager, Scheduler *scheduler, bool own)
     m_scheduler = scheduler;
     m_fd = fd;
     m_own = own;
+    // io_uring waits for blocking fds itself; it would just fail
+    // non-blocking ones with EAGAIN
+#ifdef LINUX
+    if (m_ioManager && !m_ioManager->usingIoUring()) {
+#else
     if (m_ioManager) {
+#endif
         if (fcntl(m_fd, F_SETFL, O_NONBLOCK)) {
             error_t error = lastError();
             if (own) {
@@ -80,13 +137,13 @@ FDStream::read(Buffer &buffer, size_t length)
     if (length > 0xfffffffe)
         length = 0xfffffffe;
     std::vector<iovec> iovs = buffer.writeBuffers(length);
-    int rc = readv(m_fd, &iovs[0], iovs.size());
+    int rc = doReadv(m_ioManager, m_fd, &iovs[0], iovs.size());
     while (rc < 0 && errno == EAGAIN && m_ioManager) {
         MORDOR_LOG_TRACE(g_log) << this << " readv(" << m_fd << ", " << length
             << "): " << rc << " (EAGAIN)";
         m_ioManager->registerEvent(m_fd, IOManager::READ);
         Scheduler::yieldTo();
-        rc = readv(m_fd, &iovs[0], iovs.size());
+        rc = doReadv(m_ioManager, m_fd, &iovs[0], iovs.size());
     }
     error_t error = lastError();
     MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::ERROR : Log::DEBUG) << this
@@ -105,13 +162,16 @@ FDStream::read(void *buffer, size_t length)
     MORDOR_ASSERT(m_fd >= 0);
     if (length > 0xfffffffe)
         length = 0xfffffffe;
-    int rc = ::read(m_fd, buffer, length);
+    iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = length;
+    int rc = doReadv(m_ioManager, m_fd, &iov, 1);
     while (rc < 0 && errno == EAGAIN && m_ioManager) {
         MORDOR_LOG_TRACE(g_log) << this << " read(" << m_fd << ", " << length
             << "): " << rc << " (EAGAIN)";
         m_ioManager->registerEvent(m_fd, IOManager::READ);
         Scheduler::yieldTo();
-        rc = ::read(m_fd, buffer, length);
+        rc = doReadv(m_ioManager, m_fd, &iov, 1);
     }
     error_t error = lastError();
     MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::ERROR : Log::DEBUG) << this
@@ -131,7 +191,7 @@ FDStream::write(const Buffer &buffer, size_t length)
     const std::vector<iovec> iovs = buffer.readBuffers(length);
     ssize_t rc = 0;
     const int count = std::min(iovs.size(), (size_t)IOV_MAX);
-    while ((rc = writev(m_fd, &iovs[0], count)) < 0 &&
+    while ((rc = doWritev(m_ioManager, m_fd, &iovs[0], count)) < 0 &&
            errno == EAGAIN && m_ioManager) {
         MORDOR_LOG_TRACE(g_log) << this << " writev(" << m_fd << ", " << length
             << "): " << rc << " (EAGAIN)";
@@ -156,13 +216,16 @@ FDStream::write(const void *buffer, size_t length)
     MORDOR_ASSERT(m_fd >= 0);
     if (length > 0xfffffffe)
         length = 0xfffffffe;
-    int rc = ::write(m_fd, buffer, length);
+    iovec iov;
+    iov.iov_base = (void *)buffer;
+    iov.iov_len = length;
+    int rc = doWritev(m_ioManager, m_fd, &iov, 1);
     while (rc < 0 && errno == EAGAIN && m_ioManager) {
         MORDOR_LOG_TRACE(g_log) << this << " write(" << m_fd << ", " << length
             << "): " << rc << " (EAGAIN)";
         m_ioManager->registerEvent(m_fd, IOManager::WRITE);
         Scheduler::yieldTo();
-        rc = ::write(m_fd, buffer, length);
+        rc = doWritev(m_ioManager, m_fd, &iov, 1);
     }
     error_t error = lastError();
     MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::ERROR : Log::DEBUG) << this
@@ -222,9 +285,15 @@ FDStream::truncate(long long size)
 void
 FDStream::flush(bool flushParent)
 {
+#ifdef LINUX
+    // The ring doesn't block this thread, so there's no need to switch
+    SchedulerSwitcher switcher(m_ioManager && m_ioManager->usingIoUring() ?
+        NULL : m_scheduler);
+#else
     SchedulerSwitcher switcher(m_scheduler);
+#endif
     MORDOR_ASSERT(m_fd >= 0);
-    int rc = fsync(m_fd);
+    int rc = doFsync(m_ioManager, m_fd);
     error_t error = lastError();
     MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
         << " fsync(" << m_fd << "): " << rc << " (" << error << ")";
@@ -16,6 +16,9 @@ public:
 
     void reset() { m_pos = 0; }
     void reset(long long size) { m_pos = 0; m_size = size; }
+    /// Account for len bytes that were written directly to parent(),
+    /// bypassing this stream
+    void advance(long long len) { m_pos += len; }
 
     bool strict() { return m_strict; }
     void strict(bool strict) { m_strict = strict; }
@@ -2,22 +2,72 @@
 
 #include "transfer.h"
 
+#include <deque>
+#include <list>
+
 #include <boost/bind.hpp>
 
 #include "mordor/assert.h"
 #include "mordor/config.h"
 #include "mordor/fiber.h"
+#include "mordor/fibersynchronization.h"
 #include "mordor/parallel.h"
+#include "mordor/scheduler.h"
+#include "mordor/statistics.h"
 #include "mordor/streams/buffer.h"
 #include "mordor/streams/null.h"
+#include "mordor/timer.h"
+#include "mordor/version.h"
 #include "stream.h"
 
+#ifdef LINUX
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mordor/socket.h"
+#include "mordor/streams/buffered.h"
+#include "mordor/streams/fd.h"
+#include "mordor/streams/limited.h"
+#include "mordor/streams/notify.h"
+#include "mordor/streams/singleplex.h"
+#include "mordor/streams/socket.h"
+#endif
+
 namespace Mordor {
 
 static ConfigVar<size_t>::ptr g_chunkSize =
     Config::lookup("transferstream.chunksize",
                    (size_t)65536,
                    "transfer chunk size.");
+static ConfigVar<bool>::ptr g_adaptive =
+    Config::lookup("transferstream.adaptive",
+                   false,
+                   "adjust chunk size and buffers in flight to what the "
+                   "streams can keep up with.");
+static ConfigVar<size_t>::ptr g_budget =
+    Config::lookup("transferstream.budget",
+                   (size_t)1024 * 1024,
+                   "most memory an adaptive transfer may hold in buffers.");
+#ifdef LINUX
+static ConfigVar<bool>::ptr g_zeroCopy =
+    Config::lookup("transferstream.zerocopy",
+                   true,
+                   "use sendfile/splice to transfer from a file to a socket.");
+static CountStatistic<unsigned long long> &g_statZeroCopy =
+    Statistics::registerStatistic("transferstream.zerocopy",
+    CountStatistic<unsigned long long>("bytes"),
+    "bytes transferred from a file to a socket with sendfile or splice");
+#endif
+static CountStatistic<unsigned long long> &g_statAdjustments =
+    Statistics::registerStatistic("transferstream.adaptive.adjustments",
+    CountStatistic<unsigned long long>("adjustments"),
+    "times an adaptive transfer changed its chunk size or depth");
+static ThroughputStatistic<unsigned long long, unsigned long long> &
+    g_statThroughput = Statistics::registerStatistic(
+    "transferstream.throughput",
+    ThroughputStatistic<unsigned long long, unsigned long long>("bytes", "us"),
+    "data moved by transferStream, and how long it took");
 static Logger::ptr g_log = Log::lookup("mordor:stream:transfer");
 
 static void readOne(Stream &src, Buffer *&buffer, size_t len, size_t &result)
@@ -36,9 +86,430 @@ static void writeOne(Stream &dst, Buffer *&buffer)
     }
 }
 
-unsigned long long transferStream(Stream &src, Stream &dst,
-                                  unsigned long long toTransfer,
-                                  ExactLength exactLength)
+#ifdef LINUX
+namespace {
+struct Pipe
+{
+    Pipe() { fds[0] = fds[1] = -1; }
+    ~Pipe() { if (fds[0] != -1) { close(fds[0]); close(fds[1]); } }
+
+    int fds[2];
+};
+}
+
+// Moves up to length bytes from file to socket, by way of a pipe; returns -1
+// if file doesn't support splice either
+static long long spliceOne(int file, Socket &socket, Pipe &pipe, size_t length)
+{
+    if (pipe.fds[0] == -1) {
+        if (pipe2(pipe.fds, O_CLOEXEC))
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("pipe2");
+        // A bigger pipe means fewer round trips; it's fine if we can't have it
+        fcntl(pipe.fds[1], F_SETPIPE_SZ, 1024 * 1024);
+    }
+    int capacity = fcntl(pipe.fds[1], F_GETPIPE_SZ);
+    if (capacity > 0 && length > (size_t)capacity)
+        length = capacity;
+    ssize_t rc;
+    do {
+        rc = splice(file, NULL, pipe.fds[1], NULL, length,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (rc == -1 && errno == EINTR);
+    if (rc == -1 && (errno == EINVAL || errno == ENOSYS))
+        return -1;
+    if (rc == -1)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("splice");
+    for (size_t inPipe = rc; inPipe > 0;)
+        inPipe -= socket.splice(pipe.fds[0], inPipe);
+    return rc;
+}
+
+// If src is a regular file, and dst is a socket (possibly behind filters that
+// pass writes through unchanged) that can wait without blocking the thread,
+// sends from one to the other in the kernel with sendfile, or splice when the
+// file doesn't support sendfile; returns false without having transferred
+// anything otherwise
+static bool zeroCopy(Stream &src, Stream &dst, unsigned long long toTransfer,
+                     ExactLength exactLength, unsigned long long &result)
+{
+    FDStream *file = dynamic_cast<FDStream *>(&src);
+    struct stat st;
+    if (!file || fstat(file->fd(), &st) || !S_ISREG(st.st_mode))
+        return false;
+    unsigned long long available = toTransfer;
+    if (exactLength == UNTILEOF) {
+        off_t pos = lseek(file->fd(), 0, SEEK_CUR);
+        if (pos != -1 && pos <= st.st_size &&
+            (unsigned long long)(st.st_size - pos) < available)
+            available = st.st_size - pos;
+    }
+
+    unsigned long long toSend = toTransfer;
+    std::vector<NotifyStream *> notifies;
+    std::vector<LimitedStream *> limits;
+    std::vector<BufferedStream *> buffers;
+    Stream *stream = &dst;
+    SocketStream *socketStream;
+    while (!(socketStream = dynamic_cast<SocketStream *>(stream))) {
+        if (NotifyStream *notify = dynamic_cast<NotifyStream *>(stream)) {
+            notifies.push_back(notify);
+        } else if (LimitedStream *limited =
+            dynamic_cast<LimitedStream *>(stream)) {
+            // Let the normal path deal with writing beyond the limit
+            unsigned long long remaining = limited->size() - limited->tell();
+            if (remaining < available)
+                return false;
+            toSend = std::min(toSend, remaining);
+            limits.push_back(limited);
+        } else if (BufferedStream *buffered =
+            dynamic_cast<BufferedStream *>(stream)) {
+            buffers.push_back(buffered);
+        } else if (!dynamic_cast<SingleplexStream *>(stream)) {
+            return false;
+        }
+        stream = static_cast<FilterStream *>(stream)->parent().get();
+    }
+    Socket &socket = *socketStream->socket();
+    if (!socket.canSendFile())
+        return false;
+
+    MORDOR_LOG_DEBUG(g_log) << "zero-copy transferring " << toTransfer
+        << " bytes from " << &src << " to " << &dst;
+    Pipe pipe;
+    bool useSplice = false;
+    result = 0;
+    try {
+        // Anything already written has to go out first
+        for (size_t i = 0; i < buffers.size(); ++i)
+            buffers[i]->flush(false);
+        while (result < toSend) {
+            size_t todo = (size_t)std::min<unsigned long long>(
+                toSend - result, 0x7ffff000);
+            long long sent = -1;
+            if (!useSplice) {
+                try {
+                    sent = socket.sendFile(file->fd(), todo);
+                } catch (NativeException &ex) {
+                    const int *error =
+                        boost::get_error_info<errinfo_nativeerror>(ex);
+                    if (!error || (*error != EINVAL && *error != ENOSYS))
+                        throw;
+                    useSplice = true;
+                }
+            }
+            if (useSplice) {
+                sent = spliceOne(file->fd(), socket, pipe, todo);
+                if (sent == -1) {
+                    if (result == 0)
+                        return false;
+                    MORDOR_THROW_EXCEPTION_FROM_ERROR_API(errno, "splice");
+                }
+            }
+            MORDOR_LOG_TRACE(g_log) << "sent " << sent << " bytes from "
+                << &src << " to " << &dst;
+            for (size_t i = 0; i < limits.size(); ++i)
+                limits[i]->advance(sent);
+            result += sent;
+            g_statZeroCopy.add(sent);
+            if (sent == 0)
+                break;
+        }
+    } catch (...) {
+        for (size_t i = 0; i < notifies.size(); ++i)
+            if (notifies[i]->notifyOnException)
+                notifies[i]->notifyOnException();
+        throw;
+    }
+    if (result < toTransfer && exactLength == EXACT) {
+        MORDOR_LOG_ERROR(g_log) << "only read " << result << "/"
+            << toTransfer << " from " << &src;
+        MORDOR_THROW_EXCEPTION(UnexpectedEofException());
+    }
+    return true;
+}
+#endif
+
+namespace {
+// A reader and a writer fiber joined by a queue of buffers; the reader
+// periodically resizes the chunks it reads and the number of buffers it may
+// fill ahead of the writer, based on what both have seen since last time
+class AdaptiveTransfer
+{
+public:
+    AdaptiveTransfer(Stream &src, Stream &dst, unsigned long long toTransfer,
+        ExactLength exactLength);
+
+    unsigned long long run();
+
+private:
+    void read();
+    void write();
+    Buffer *nextFree();
+    void adjust();
+    void fail();
+
+private:
+    Stream &m_src, &m_dst;
+    unsigned long long m_toTransfer, m_totalRead;
+    ExactLength m_exactLength;
+    size_t m_chunkSize, m_depth, m_budget;
+    FiberMutex m_mutex;
+    FiberCondition m_freed, m_filled;
+    // Owns every buffer; the rest point into it
+    std::list<Buffer> m_buffers;
+    std::vector<Buffer *> m_free;
+    // NULL means the reader is done
+    std::deque<Buffer *> m_queue;
+    bool m_failed;
+
+    // Observations since the last adjustment
+    size_t m_reads, m_writes;
+    unsigned long long m_readBytes, m_writeBytes;
+    unsigned long long m_readerWait, m_writerWait, m_windowStart;
+};
+}
+
+// Reads a chunk is never shrunk below, and how many reads between adjustments
+static const size_t g_minChunkSize = 4096;
+static const size_t g_adjustInterval = 16;
+
+// Buffer::reserve over-reserves by 2x, so that's what a chunk in flight costs
+static size_t footprint(size_t chunkSize, size_t depth)
+{
+    return 2 * chunkSize * depth;
+}
+
+AdaptiveTransfer::AdaptiveTransfer(Stream &src, Stream &dst,
+    unsigned long long toTransfer, ExactLength exactLength)
+    : m_src(src),
+      m_dst(dst),
+      m_toTransfer(toTransfer),
+      m_totalRead(0),
+      m_exactLength(exactLength),
+      m_chunkSize(g_chunkSize->val()),
+      m_depth(2),
+      m_budget(g_budget->val()),
+      m_freed(m_mutex),
+      m_filled(m_mutex),
+      m_failed(false),
+      m_reads(0),
+      m_writes(0),
+      m_readBytes(0),
+      m_writeBytes(0),
+      m_readerWait(0),
+      m_writerWait(0),
+      m_windowStart(TimerManager::now())
+{
+    while (m_chunkSize > g_minChunkSize &&
+        footprint(m_chunkSize, m_depth) > m_budget)
+        m_chunkSize /= 2;
+}
+
+unsigned long long
+AdaptiveTransfer::run()
+{
+    std::vector<boost::function<void ()> > dgs;
+    dgs.push_back(boost::bind(&AdaptiveTransfer::read, this));
+    dgs.push_back(boost::bind(&AdaptiveTransfer::write, this));
+    parallel_do(dgs);
+    return m_totalRead;
+}
+
+Buffer *
+AdaptiveTransfer::nextFree()
+{
+    unsigned long long start = TimerManager::now();
+    while (!m_failed && m_free.empty() && m_buffers.size() >= m_depth)
+        m_freed.wait();
+    m_readerWait += TimerManager::now() - start;
+    if (m_failed)
+        return NULL;
+    if (m_free.empty()) {
+        m_buffers.push_back(Buffer());
+        return &m_buffers.back();
+    }
+    Buffer *buffer = m_free.back();
+    m_free.pop_back();
+    return buffer;
+}
+
+void
+AdaptiveTransfer::read()
+{
+    try {
+        while (true) {
+            Buffer *buffer;
+            size_t todo;
+            {
+                FiberMutex::ScopedLock lock(m_mutex);
+                buffer = nextFree();
+                if (!buffer)
+                    return;
+                todo = m_chunkSize;
+                if (m_toTransfer - m_totalRead < (unsigned long long)todo)
+                    todo = (size_t)(m_toTransfer - m_totalRead);
+            }
+            size_t result = m_src.read(*buffer, todo);
+            MORDOR_LOG_TRACE(g_log) << "read " << result << " bytes from "
+                << &m_src;
+            FiberMutex::ScopedLock lock(m_mutex);
+            m_totalRead += result;
+            if (result == 0 && m_exactLength == EXACT &&
+                m_totalRead < m_toTransfer) {
+                MORDOR_LOG_ERROR(g_log) << "only read " << m_totalRead << "/"
+                    << m_toTransfer << " from " << &m_src;
+                MORDOR_THROW_EXCEPTION(UnexpectedEofException());
+            }
+            if (result == 0) {
+                m_free.push_back(buffer);
+            } else {
+                m_queue.push_back(buffer);
+                m_readBytes += result;
+                if (++m_reads == g_adjustInterval)
+                    adjust();
+            }
+            bool done = result == 0 || m_totalRead == m_toTransfer;
+            if (done)
+                m_queue.push_back(NULL);
+            m_filled.signal();
+            if (done)
+                return;
+        }
+    } catch (...) {
+        fail();
+        throw;
+    }
+}
+
+void
+AdaptiveTransfer::write()
+{
+    try {
+        while (true) {
+            Buffer *buffer;
+            {
+                FiberMutex::ScopedLock lock(m_mutex);
+                unsigned long long start = TimerManager::now();
+                while (!m_failed && m_queue.empty())
+                    m_filled.wait();
+                m_writerWait += TimerManager::now() - start;
+                if (m_failed)
+                    return;
+                buffer = m_queue.front();
+                m_queue.pop_front();
+            }
+            if (!buffer)
+                return;
+            size_t writes = 0, written = 0;
+            while (buffer->readAvailable() > 0) {
+                size_t result = m_dst.write(*buffer, buffer->readAvailable());
+                MORDOR_LOG_TRACE(g_log) << "wrote " << result << " bytes to "
+                    << &m_dst;
+                buffer->consume(result);
+                ++writes;
+                written += result;
+            }
+            FiberMutex::ScopedLock lock(m_mutex);
+            m_writes += writes;
+            m_writeBytes += written;
+            if (m_buffers.size() > m_depth) {
+                // Shrunk since this one was handed out
+                for (std::list<Buffer>::iterator it = m_buffers.begin();
+                    it != m_buffers.end();
+                    ++it) {
+                    if (&*it == buffer) {
+                        m_buffers.erase(it);
+                        break;
+                    }
+                }
+            } else {
+                if (buffer->writeAvailable() > 2 * m_chunkSize)
+                    buffer->clear();
+                m_free.push_back(buffer);
+            }
+            m_freed.signal();
+        }
+    } catch (...) {
+        fail();
+        throw;
+    }
+}
+
+void
+AdaptiveTransfer::adjust()
+{
+    unsigned long long now = TimerManager::now();
+    unsigned long long elapsed = now - m_windowStart;
+    size_t perRead = (size_t)(m_readBytes / m_reads);
+    size_t perWrite = m_writes ? (size_t)(m_writeBytes / m_writes) :
+        m_chunkSize;
+    size_t perCall = (std::min)(perRead, perWrite);
+    // Either side spending more than a tenth of the time waiting on the
+    // other counts
+    bool readerWaited = m_readerWait * 10 > elapsed;
+    bool writerWaited = m_writerWait * 10 > elapsed;
+    size_t chunkSize = m_chunkSize, depth = m_depth;
+
+    if (perCall < m_chunkSize / 2) {
+        // One of the streams doesn't do this much per call; holding more is
+        // a waste
+        while (m_chunkSize > g_minChunkSize && perCall <= m_chunkSize / 2)
+            m_chunkSize /= 2;
+    } else if (perRead >= m_chunkSize && perWrite >= m_chunkSize &&
+        footprint(m_chunkSize * 2, m_depth) <= m_budget) {
+        // Both keep up with whole chunks; bigger ones mean fewer calls
+        m_chunkSize *= 2;
+    }
+
+    if (readerWaited && writerWaited) {
+        // Each side is stalling on bursts from the other; let the reader get
+        // further ahead to smooth them out
+        if (footprint(m_chunkSize, m_depth + 1) <= m_budget)
+            ++m_depth;
+    } else if (readerWaited != writerWaited && m_depth > 2) {
+        // One side is simply slower; more buffers would just sit in the
+        // queue (for a slow writer) or on the free list (for a slow reader)
+        --m_depth;
+    }
+    while (m_depth > 2 && footprint(m_chunkSize, m_depth) > m_budget)
+        --m_depth;
+    if (m_chunkSize != chunkSize || m_depth != depth)
+        g_statAdjustments.increment();
+    while (!m_free.empty() && m_buffers.size() > m_depth) {
+        Buffer *buffer = m_free.back();
+        m_free.pop_back();
+        for (std::list<Buffer>::iterator it = m_buffers.begin();
+            it != m_buffers.end();
+            ++it) {
+            if (&*it == buffer) {
+                m_buffers.erase(it);
+                break;
+            }
+        }
+    }
+
+    MORDOR_LOG_DEBUG(g_log) << this << " " << perRead << " bytes per read, "
+        << perWrite << " per write, reader waited " << m_readerWait << "us, "
+        << "writer waited " << m_writerWait << "us of " << elapsed
+        << "us; chunk size " << m_chunkSize << ", depth " << m_depth;
+    m_reads = m_writes = 0;
+    m_readBytes = m_writeBytes = 0;
+    m_readerWait = m_writerWait = 0;
+    m_windowStart = now;
+}
+
+void
+AdaptiveTransfer::fail()
+{
+    FiberMutex::ScopedLock lock(m_mutex);
+    m_failed = true;
+    m_freed.broadcast();
+    m_filled.broadcast();
+}
+
+static unsigned long long transfer(Stream &src, Stream &dst,
+                                   unsigned long long toTransfer,
+                                   ExactLength exactLength)
 {
     MORDOR_LOG_DEBUG(g_log) << "transferring " << toTransfer << " bytes from "
         << &src << " to " << &dst;
@@ -56,6 +527,17 @@ unsigned long long transferStream(Stream &src, Stream &dst,
         exactLength = (toTransfer == ~0ull ? UNTILEOF : EXACT);
     MORDOR_ASSERT(exactLength == EXACT || exactLength == UNTILEOF);
 
+#ifdef LINUX
+    if (g_zeroCopy->val() && zeroCopy(src, dst, toTransfer, exactLength,
+        totalRead))
+        return totalRead;
+#endif
+
+    // Without a Scheduler, the reader and writer can't overlap anyway
+    if (g_adaptive->val() && Scheduler::getThis() &&
+        &dst != &NullStream::get())
+        return AdaptiveTransfer(src, dst, toTransfer, exactLength).run();
+
     readBuffer = &buf1;
     todo = chunkSize;
     if (toTransfer - totalRead < (unsigned long long)todo)
@@ -115,9 +597,21 @@ unsigned long long transferStream(Stream &src, Stream &dst,
     }
     writeBuffer = readBuffer;
     writeOne(dst, writeBuffer);
-    MORDOR_LOG_VERBOSE(g_log) << "transferred " << totalRead << "/" << toTransfer
-        << " from " << &src << " to " << &dst;
     return totalRead;
 }
 
+unsigned long long transferStream(Stream &src, Stream &dst,
+                                  unsigned long long toTransfer,
+                                  ExactLength exactLength)
+{
+    unsigned long long start = TimerManager::now();
+    unsigned long long result = transfer(src, dst, toTransfer, exactLength);
+    unsigned long long elapsed = TimerManager::now() - start;
+    g_statThroughput.update(result, elapsed);
+    MORDOR_LOG_VERBOSE(g_log) << "transferred " << result << "/" << toTransfer
+        << " from " << &src << " to " << &dst << " in " << elapsed << "us ("
+        << (elapsed ? (double)result / elapsed : 0.0) << " MB/s)";
+    return result;
+}
+
 }
@@ -2,8 +2,15 @@
 
 #include <boost/bind.hpp>
 
+#ifdef LINUX
+#include <ucontext.h>
+#endif
+
+#include "mordor/config.h"
 #include "mordor/fiber.h"
+#include "mordor/statistics.h"
 #include "mordor/test/test.h"
+#include "mordor/timer.h"
 
 using namespace Mordor;
 using namespace Mordor::Test;
@@ -604,3 +611,130 @@ MORDOR_UNITTEST(Fibers, exceptionDestructsBeforeFiberDestructs)
     }
     MORDOR_TEST_ASSERT_EQUAL(++sequence, 7);
 }
+
+#ifdef POSIX
+static unsigned long long stackPoolHits()
+{
+    return Statistics::lookup<CountStatistic<unsigned long long> >(
+        "fiber.stackpool.hits")->count;
+}
+
+static void doNothing()
+{}
+
+MORDOR_UNITTEST(Fibers, stackPoolReuse)
+{
+    // An unusual size, so nothing else has left one of these in the pool
+    const size_t stacksize = 192 * 1024;
+    unsigned long long hits = stackPoolHits();
+    {
+        Fiber::ptr f(new Fiber(&doNothing, stacksize));
+        f->call();
+    }
+    MORDOR_TEST_ASSERT_EQUAL(stackPoolHits(), hits);
+    {
+        Fiber::ptr f(new Fiber(&doNothing, stacksize));
+        f->call();
+    }
+    MORDOR_TEST_ASSERT_EQUAL(stackPoolHits(), hits + 1);
+}
+
+static unsigned long long createFibers(int count)
+{
+    unsigned long long before = TimerManager::now();
+    for (int i = 0; i < count; ++i) {
+        Fiber::ptr f(new Fiber(&eatSomeStack));
+        f->call();
+    }
+    return TimerManager::now() - before;
+}
+
+static void eatLotsOfStack(size_t &highWaterMark)
+{
+    char stackEater[64 * 1024];
+    memset(stackEater, 1, sizeof(stackEater));
+    highWaterMark = Fiber::getThis()->stackHighWaterMark();
+}
+
+MORDOR_UNITTEST(Fibers, stackHighWaterMark)
+{
+    ConfigVarBase::ptr guard = Config::lookup("fiber.stackguard");
+    std::string oldGuard = guard->toString();
+    guard->fromString("1");
+    // An unusual size, so it's not recycled from the pool
+    const size_t stacksize = 448 * 1024;
+    size_t highWaterMark = 0;
+    Fiber::ptr f(new Fiber(boost::bind(&eatLotsOfStack,
+        boost::ref(highWaterMark)), stacksize));
+    guard->fromString(oldGuard);
+    f->call();
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(highWaterMark, 64u * 1024);
+    MORDOR_TEST_ASSERT_LESS_THAN(highWaterMark, stacksize);
+    MORDOR_TEST_ASSERT_EQUAL(f->stackHighWaterMark(), highWaterMark);
+    MORDOR_TEST_ASSERT_EQUAL(Fiber::getThis()->stackHighWaterMark(), 0u);
+}
+
+MORDOR_UNITTEST(Fibers, stackPoolPerformance)
+{
+    const int count = 10000;
+    ConfigVarBase::ptr poolSize = Config::lookup("fiber.stackpoolsize");
+    std::string oldPoolSize = poolSize->toString();
+    poolSize->fromString("0");
+    unsigned long long unpooled = createFibers(count);
+    poolSize->fromString(oldPoolSize);
+    unsigned long long pooled = createFibers(count);
+    MORDOR_LOG_INFO(Mordor::Log::root()) << "unpooled elapse: " << unpooled
+        << " pooled elapse: " << pooled;
+}
+#endif
+
+static void pingPong(int count)
+{
+    for (int i = 0; i < count; ++i)
+        Fiber::yield();
+}
+
+#ifdef LINUX
+static ucontext_t g_mainCtx, g_pingCtx;
+
+static void ucontextPingPong()
+{
+    while (true)
+        swapcontext(&g_pingCtx, &g_mainCtx);
+}
+#endif
+
+MORDOR_UNITTEST(Fibers, switchPerformance)
+{
+#ifndef NDEBUG_PERF
+    const int count = 100000;
+#else
+    const int count = 10000000;
+#endif
+    Fiber::ptr f(new Fiber(boost::bind(&pingPong, count)));
+    unsigned long long before = TimerManager::now();
+    for (int i = 0; i <= count; ++i)
+        f->call();
+    unsigned long long fiberElapse = TimerManager::now() - before;
+    MORDOR_TEST_ASSERT(f->state() == Fiber::TERM);
+    // Each call() is two switches: into the fiber, and back out
+    MORDOR_LOG_INFO(Mordor::Log::root()) << "fiber switch elapse: "
+        << fiberElapse << " ns per switch: "
+        << fiberElapse * 1000.0 / (2.0 * count);
+#ifdef LINUX
+    // The same ping-pong on raw ucontext, for comparison
+    std::vector<char> stack(64 * 1024);
+    getcontext(&g_pingCtx);
+    g_pingCtx.uc_stack.ss_sp = &stack[0];
+    g_pingCtx.uc_stack.ss_size = stack.size();
+    g_pingCtx.uc_link = NULL;
+    makecontext(&g_pingCtx, &ucontextPingPong, 0);
+    before = TimerManager::now();
+    for (int i = 0; i <= count; ++i)
+        swapcontext(&g_mainCtx, &g_pingCtx);
+    unsigned long long ucontextElapse = TimerManager::now() - before;
+    MORDOR_LOG_INFO(Mordor::Log::root()) << "ucontext switch elapse: "
+        << ucontextElapse << " ns per switch: "
+        << ucontextElapse * 1000.0 / (2.0 * count);
+#endif
+}
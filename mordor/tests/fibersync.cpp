@@ -1,5 +1,7 @@
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <map>
+
 #include <boost/bind.hpp>
 
 #include "mordor/atomic.h"
@@ -139,6 +141,112 @@ MORDOR_UNITTEST(FiberMutex, mutexPerformance)
     test_mutex_performance<FiberMutex>();
 }
 
+template<typename M> struct AdaptiveMutex : M
+{
+    AdaptiveMutex() : M(M::ADAPTIVE) {}
+};
+
+MORDOR_UNITTEST(FiberMutex, adaptiveBasic)
+{
+    test_mutex_basic<AdaptiveMutex<FiberMutex> >();
+}
+
+MORDOR_UNITTEST(FiberMutex, adaptiveContention)
+{
+    test_mutex_contention<AdaptiveMutex<FiberMutex> >();
+}
+
+MORDOR_UNITTEST(FiberMutex, adaptiveUnlockUnique)
+{
+    test_mutex_unlockUnique<AdaptiveMutex<FiberMutex> >();
+}
+
+static void
+incrementUnderLock(FiberMutex &mutex, int &counter, int iterations)
+{
+    for (int i = 0; i < iterations; ++i) {
+        FiberMutex::ScopedLock lock(mutex);
+        ++counter;
+        // Give others a chance to find it locked
+        if (i % 64 == 0)
+            Scheduler::yield();
+    }
+}
+
+static unsigned long long
+contendedIncrements(FiberMutex::Policy policy, size_t threads, int fibers,
+    int iterations)
+{
+    FiberMutex mutex(policy);
+    int counter = 0;
+    unsigned long long before = TimerManager::now();
+    {
+        WorkerPool pool(threads, false);
+        for (int i = 0; i < fibers; ++i)
+            pool.schedule(boost::bind(&incrementUnderLock, boost::ref(mutex),
+                boost::ref(counter), iterations));
+        pool.stop();
+    }
+    unsigned long long elapsed = TimerManager::now() - before;
+    MORDOR_TEST_ASSERT_EQUAL(counter, fibers * iterations);
+    return elapsed;
+}
+
+MORDOR_UNITTEST(FiberMutex, adaptivePerformance)
+{
+#ifndef NDEBUG_PERF
+    const int iterations = 2000;
+#else
+    const int iterations = 100000;
+#endif
+    const int fibers = 32;
+    for (size_t threads = 1; threads <= 16; threads *= 4) {
+        unsigned long long fifo = contendedIncrements(FiberMutex::FIFO,
+            threads, fibers, iterations);
+        unsigned long long adaptive = contendedIncrements(FiberMutex::ADAPTIVE,
+            threads, fibers, iterations);
+        MORDOR_LOG_INFO(Mordor::Log::root()) << threads << " threads fifo: "
+            << fifo << " adaptive: " << adaptive << " ("
+            << fibers * iterations * 1000000ull / fifo << " vs "
+            << fibers * iterations * 1000000ull / adaptive << " locks/s)";
+    }
+}
+
+static void
+waitForCondition(FiberMutex &mutex, FiberCondition &condition, int &sequence)
+{
+    FiberMutex::ScopedLock lock(mutex);
+    ++sequence;
+    condition.wait();
+    ++sequence;
+}
+
+MORDOR_UNITTEST(FiberCondition, adaptive)
+{
+    WorkerPool pool;
+    FiberMutex mutex(FiberMutex::ADAPTIVE);
+    FiberCondition condition(mutex);
+    int sequence = 0;
+    pool.schedule(boost::bind(&waitForCondition, boost::ref(mutex),
+        boost::ref(condition), boost::ref(sequence)));
+    pool.schedule(boost::bind(&waitForCondition, boost::ref(mutex),
+        boost::ref(condition), boost::ref(sequence)));
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(sequence, 2);
+    {
+        FiberMutex::ScopedLock lock(mutex);
+        condition.signal();
+        pool.dispatch();
+        // Still locked by us
+        MORDOR_TEST_ASSERT_EQUAL(sequence, 2);
+    }
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(sequence, 3);
+    condition.broadcast();
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(sequence, 4);
+}
+
 MORDOR_UNITTEST(RecursiveFiberMutex, basic)
 {
     test_mutex_basic<RecursiveFiberMutex>();
@@ -173,6 +281,192 @@ MORDOR_UNITTEST(RecursiveFiberMutex, unlockUnique)
     test_mutex_unlockUnique<RecursiveFiberMutex>();
 }
 
+MORDOR_UNITTEST(FiberRWMutex, basic)
+{
+    test_mutex_basic<FiberRWMutex>();
+}
+
+MORDOR_UNITTEST(FiberRWMutex, contention)
+{
+    test_mutex_contention<FiberRWMutex>();
+}
+
+#ifndef NDEBUG
+MORDOR_UNITTEST(FiberRWMutex, notRecursive)
+{
+    WorkerPool pool;
+    FiberRWMutex mutex;
+
+    FiberRWMutex::ScopedLock lock(mutex);
+    MORDOR_TEST_ASSERT_ASSERTED(mutex.lockShared());
+}
+#endif
+
+static void
+readUnderLock(FiberRWMutex &mutex, std::string &sequence)
+{
+    FiberRWMutex::SharedScopedLock lock(mutex);
+    sequence += 'R';
+}
+
+static void
+writeUnderLock(FiberRWMutex &mutex, std::string &sequence)
+{
+    FiberRWMutex::ScopedLock lock(mutex);
+    sequence += 'W';
+}
+
+MORDOR_UNITTEST(FiberRWMutex, shared)
+{
+    WorkerPool pool;
+    FiberRWMutex mutex;
+    std::string sequence;
+    {
+        FiberRWMutex::SharedScopedLock lock(mutex);
+        for (int i = 0; i < 3; ++i)
+            pool.schedule(boost::bind(&readUnderLock, boost::ref(mutex),
+                boost::ref(sequence)));
+        pool.dispatch();
+        MORDOR_TEST_ASSERT_EQUAL(sequence, "RRR");
+    }
+    {
+        FiberRWMutex::ScopedLock lock(mutex);
+        for (int i = 0; i < 3; ++i)
+            pool.schedule(boost::bind(&readUnderLock, boost::ref(mutex),
+                boost::ref(sequence)));
+        pool.dispatch();
+        MORDOR_TEST_ASSERT_EQUAL(sequence, "RRR");
+    }
+    // All let in at once
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(sequence, "RRRRRR");
+}
+
+static std::string
+readerBehindWaitingWriter(FiberRWMutex::Policy policy)
+{
+    WorkerPool pool;
+    FiberRWMutex mutex(policy);
+    std::string sequence;
+    {
+        FiberRWMutex::SharedScopedLock lock(mutex);
+        pool.schedule(boost::bind(&writeUnderLock, boost::ref(mutex),
+            boost::ref(sequence)));
+        pool.dispatch();
+        pool.schedule(boost::bind(&readUnderLock, boost::ref(mutex),
+            boost::ref(sequence)));
+        pool.dispatch();
+    }
+    pool.dispatch();
+    return sequence;
+}
+
+MORDOR_UNITTEST(FiberRWMutex, writerPreference)
+{
+    MORDOR_TEST_ASSERT_EQUAL(
+        readerBehindWaitingWriter(FiberRWMutex::WRITER_PREFERENCE), "WR");
+}
+
+MORDOR_UNITTEST(FiberRWMutex, readerPreference)
+{
+    MORDOR_TEST_ASSERT_EQUAL(
+        readerBehindWaitingWriter(FiberRWMutex::READER_PREFERENCE), "RW");
+}
+
+MORDOR_UNITTEST(FiberRWMutex, writersBeforeReaders)
+{
+    WorkerPool pool;
+    FiberRWMutex mutex;
+    std::string sequence;
+    {
+        FiberRWMutex::ScopedLock lock(mutex);
+        pool.schedule(boost::bind(&readUnderLock, boost::ref(mutex),
+            boost::ref(sequence)));
+        pool.schedule(boost::bind(&writeUnderLock, boost::ref(mutex),
+            boost::ref(sequence)));
+        pool.schedule(boost::bind(&readUnderLock, boost::ref(mutex),
+            boost::ref(sequence)));
+        pool.schedule(boost::bind(&writeUnderLock, boost::ref(mutex),
+            boost::ref(sequence)));
+        pool.dispatch();
+        MORDOR_TEST_ASSERT(sequence.empty());
+    }
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(sequence, "WWRR");
+}
+
+template <class M, class L>
+static void
+lookUpUnderLock(M &mutex, std::map<int, int> &map, int iterations,
+    int &writes)
+{
+    for (int i = 0; i < iterations; ++i) {
+        if (i % 32 == 0) {
+            typename M::ScopedLock lock(mutex);
+            ++map[i % 1024];
+            ++writes;
+        } else {
+            L lock(mutex);
+            MORDOR_TEST_ASSERT(map.find(i % 1024) != map.end());
+        }
+        // Give others a chance to find it locked
+        if (i % 64 == 0)
+            Scheduler::yield();
+    }
+}
+
+template <class M, class L>
+static unsigned long long
+readHeavyLookups(M &mutex, size_t threads, int fibers, int iterations)
+{
+    std::map<int, int> map;
+    for (int i = 0; i < 1024; ++i)
+        map[i] = 0;
+    int writes = 0;
+    unsigned long long before = TimerManager::now();
+    {
+        WorkerPool pool(threads, false);
+        for (int i = 0; i < fibers; ++i)
+            pool.schedule(boost::bind(&lookUpUnderLock<M, L>,
+                boost::ref(mutex), boost::ref(map), iterations,
+                boost::ref(writes)));
+        pool.stop();
+    }
+    unsigned long long elapsed = TimerManager::now() - before;
+    MORDOR_TEST_ASSERT_EQUAL(writes, fibers * ((iterations + 31) / 32));
+    return elapsed;
+}
+
+MORDOR_UNITTEST(FiberRWMutex, readHeavyPerformance)
+{
+#ifndef NDEBUG_PERF
+    const int iterations = 2000;
+#else
+    const int iterations = 100000;
+#endif
+    const int fibers = 32;
+    for (size_t threads = 1; threads <= 16; threads *= 4) {
+        FiberMutex mutex;
+        FiberRWMutex writerPreference(FiberRWMutex::WRITER_PREFERENCE),
+            readerPreference(FiberRWMutex::READER_PREFERENCE);
+        unsigned long long exclusive =
+            readHeavyLookups<FiberMutex, FiberMutex::ScopedLock>(mutex,
+                threads, fibers, iterations);
+        unsigned long long writer = readHeavyLookups<FiberRWMutex,
+            FiberRWMutex::SharedScopedLock>(writerPreference, threads,
+                fibers, iterations);
+        unsigned long long reader = readHeavyLookups<FiberRWMutex,
+            FiberRWMutex::SharedScopedLock>(readerPreference, threads,
+                fibers, iterations);
+        MORDOR_LOG_INFO(Mordor::Log::root()) << threads << " threads "
+            << fibers * iterations * 1000000ull / exclusive << " (FiberMutex) "
+            << fibers * iterations * 1000000ull / writer
+            << " (writer preference) "
+            << fibers * iterations * 1000000ull / reader
+            << " (reader preference) lookups/s";
+    }
+}
+
 static void signalMe(FiberCondition &condition, int &sequence)
 {
     MORDOR_TEST_ASSERT_EQUAL(++sequence, 2);
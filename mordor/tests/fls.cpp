@@ -5,6 +5,8 @@
 #include "mordor/fiber.h"
 #include "mordor/scheduler.h"
 #include "mordor/test/test.h"
+#include "mordor/timer.h"
+#include "mordor/workerpool.h"
 
 using namespace Mordor;
 
@@ -52,3 +54,195 @@ MORDOR_UNITTEST(FLS, basic)
     fiber->call();
     MORDOR_TEST_ASSERT_EQUAL(fls.get(), 1);
 }
+
+static void typed(FiberLocal<std::string> &fls)
+{
+    MORDOR_TEST_ASSERT(!fls.exists());
+    MORDOR_TEST_ASSERT(fls->empty());
+    fls = "fiber";
+    Fiber::yield();
+    MORDOR_TEST_ASSERT_EQUAL(*fls, "fiber");
+}
+
+MORDOR_UNITTEST(FLS, typed)
+{
+    FiberLocal<std::string> fls;
+    fls = "thread";
+    Fiber::ptr fiber(new Fiber(boost::bind(&typed, boost::ref(fls))));
+    fiber->call();
+    MORDOR_TEST_ASSERT_EQUAL(fls.get(), "thread");
+    fiber->call();
+    MORDOR_TEST_ASSERT_EQUAL(fls.get(), "thread");
+    fls.reset();
+    MORDOR_TEST_ASSERT(!fls.exists());
+    MORDOR_TEST_ASSERT(fls->empty());
+}
+
+namespace {
+struct Counted
+{
+    Counted() { ++live; }
+    Counted(const Counted &copy) : value(copy.value) { ++live; }
+    ~Counted() { --live; }
+
+    int value;
+    // Too big to fit in the Fiber
+    char padding[128];
+    static int live;
+};
+int Counted::live;
+}
+
+static void setCounted(FiberLocal<Counted> &fls, FiberLocal<int> &small)
+{
+    fls->value = 1;
+    small = 2;
+    MORDOR_TEST_ASSERT_EQUAL(Counted::live, 1);
+}
+
+MORDOR_UNITTEST(FLS, typedDestroyed)
+{
+    FiberLocal<Counted> fls;
+    FiberLocal<int> small;
+    Fiber::ptr fiber(new Fiber(boost::bind(&setCounted, boost::ref(fls),
+        boost::ref(small))));
+    fiber->call();
+    MORDOR_TEST_ASSERT_EQUAL(Counted::live, 1);
+    fiber->reset(boost::bind(&setCounted, boost::ref(fls),
+        boost::ref(small)));
+    MORDOR_TEST_ASSERT_EQUAL(Counted::live, 0);
+    fiber->call();
+    MORDOR_TEST_ASSERT_EQUAL(Counted::live, 1);
+    fiber.reset();
+    MORDOR_TEST_ASSERT_EQUAL(Counted::live, 0);
+}
+
+static void checkInherited(FiberLocal<std::string> &inherited,
+    FiberLocal<std::string> &notInherited)
+{
+    MORDOR_TEST_ASSERT_EQUAL(*inherited, "request");
+    MORDOR_TEST_ASSERT(!notInherited.exists());
+    inherited = "child";
+}
+
+MORDOR_UNITTEST(FLS, typedInherited)
+{
+    FiberLocal<std::string> inherited(true), notInherited;
+    inherited = "request";
+    notInherited = "request";
+    Fiber::ptr fiber(new Fiber(boost::bind(&checkInherited,
+        boost::ref(inherited), boost::ref(notInherited))));
+    fiber->call();
+    MORDOR_TEST_ASSERT_EQUAL(*inherited, "request");
+    inherited.reset();
+    notInherited.reset();
+}
+
+namespace {
+// Uses FLS of its own when copied to a child Fiber
+struct CopiesWithFiberLocal
+{
+    CopiesWithFiberLocal() : copied(false) {}
+    CopiesWithFiberLocal(const CopiesWithFiberLocal &copy) : copied(true)
+    {
+        FiberLocal<int> scratch;
+        scratch = 1;
+    }
+
+    bool copied;
+};
+}
+
+static void checkCopied(FiberLocal<CopiesWithFiberLocal> &fls)
+{
+    MORDOR_TEST_ASSERT(fls->copied);
+}
+
+MORDOR_UNITTEST(FLS, typedInheritedCopyUsesFLS)
+{
+    FiberLocal<CopiesWithFiberLocal> fls(true);
+    MORDOR_TEST_ASSERT(!fls->copied);
+    Fiber::ptr fiber(new Fiber(boost::bind(&checkCopied, boost::ref(fls))));
+    fiber->call();
+    fls.reset();
+}
+
+#ifdef GCC
+namespace {
+struct OverAligned
+{
+    char bytes[8];
+} __attribute__((aligned(64)));
+}
+
+static void checkAligned(FiberLocal<char> &small, FiberLocal<OverAligned> &fls)
+{
+    MORDOR_TEST_ASSERT_EQUAL(*small, 'a');
+    MORDOR_TEST_ASSERT_EQUAL((intptr_t)&fls.get() % 64, 0);
+}
+
+MORDOR_UNITTEST(FLS, typedOverAligned)
+{
+    // Inherited ahead of fls, so the Fiber's own space isn't aligned for it
+    FiberLocal<char> small(true);
+    FiberLocal<OverAligned> fls(true);
+    small = 'a';
+    MORDOR_TEST_ASSERT_EQUAL((intptr_t)&fls.get() % 64, 0);
+    for (int i = 0; i < 8; ++i) {
+        Fiber::ptr fiber(new Fiber(boost::bind(&checkAligned,
+            boost::ref(small), boost::ref(fls))));
+        fiber->call();
+    }
+    small.reset();
+    fls.reset();
+}
+#endif
+
+static void checkFresh(FiberLocal<int> &fls, int &fresh)
+{
+    if (fls.get() == 0)
+        ++fresh;
+    fls = 1;
+}
+
+MORDOR_UNITTEST(FLS, typedDelegatesStartFresh)
+{
+    FiberLocal<int> fls;
+    int fresh = 0;
+    WorkerPool pool(1, true, 4);
+    for (int i = 0; i < 4; ++i)
+        pool.schedule(boost::bind(&checkFresh, boost::ref(fls),
+            boost::ref(fresh)));
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(fresh, 4);
+}
+
+MORDOR_UNITTEST(FLS, accessPerformance)
+{
+#ifndef NDEBUG_PERF
+    const int iterations = 1000000;
+#else
+    const int iterations = 100000000;
+#endif
+    FiberLocalStorage<int> untyped;
+    FiberLocal<int> typed;
+    untyped = 0;
+    typed = 0;
+    unsigned long long before = TimerManager::now();
+    for (int i = 0; i < iterations; ++i)
+        untyped = untyped.get() + 1;
+    unsigned long long untypedElapsed = TimerManager::now() - before;
+    before = TimerManager::now();
+    for (int i = 0; i < iterations; ++i)
+        ++typed.get();
+    unsigned long long typedElapsed = TimerManager::now() - before;
+    MORDOR_TEST_ASSERT_EQUAL(untyped.get(), iterations);
+    MORDOR_TEST_ASSERT_EQUAL(typed.get(), iterations);
+    // Untyped keys get reused without clearing their old values
+    untyped = 0;
+    MORDOR_LOG_INFO(Mordor::Log::root()) << "FiberLocalStorage: "
+        << iterations * 1000000ull / (untypedElapsed ? untypedElapsed : 1)
+        << " accesses/s, FiberLocal: "
+        << iterations * 1000000ull / (typedElapsed ? typedElapsed : 1)
+        << " accesses/s";
+}
@@ -18,6 +18,11 @@ static void setResult(int &result, int value)
     result = value;
 }
 
+static void setSize(size_t &result, size_t value)
+{
+    result = value;
+}
+
 template <class T>
 void signal(T &future)
 {
@@ -248,3 +253,93 @@ MORDOR_UNITTEST(Future, waitAnyAsynchronousBoth)
     pool.schedule(boost::bind(&signal<Future<> >, boost::ref(future[1])));
     MORDOR_TEST_ASSERT_EQUAL(waitAny(future, future + 2), 0u);
 }
+
+MORDOR_UNITTEST(Future, thenBeforeSignal)
+{
+    int result = 0;
+    Future<int> future;
+    future.then(boost::bind(&setResult, boost::ref(result), _1));
+    MORDOR_TEST_ASSERT_EQUAL(result, 0);
+    future.result() = 1;
+    future.signal();
+    MORDOR_TEST_ASSERT_EQUAL(result, 1);
+}
+
+MORDOR_UNITTEST(Future, thenAfterSignal)
+{
+    bool signalled = false;
+    Future<> future;
+    future.signal();
+    future.then(boost::bind(&setTrue, boost::ref(signalled)));
+    MORDOR_TEST_ASSERT(signalled);
+}
+
+MORDOR_UNITTEST(Future, thenOtherScheduler)
+{
+    WorkerPool pool(1, false);
+    int result = 0;
+    Future<int> future;
+    future.result() = 1;
+    future.signal();
+    future.then(boost::bind(&setResultScheduler, boost::ref(result), _1,
+        &pool), &pool);
+    pool.stop();
+    MORDOR_TEST_ASSERT_EQUAL(result, 1);
+}
+
+MORDOR_UNITTEST(Future, whenAll)
+{
+    WorkerPool pool;
+    bool signalled = false;
+    Future<int> future[3];
+    future[1].result() = 1;
+    future[1].signal();
+    whenAll(future, future + 3)->then(boost::bind(&setTrue,
+        boost::ref(signalled)));
+    pool.schedule(boost::bind(&signal<Future<int> >, boost::ref(future[2])));
+    pool.dispatch();
+    MORDOR_TEST_ASSERT(!signalled);
+    signal(future[0]);
+    MORDOR_TEST_ASSERT(signalled);
+}
+
+MORDOR_UNITTEST(Future, whenAllEmpty)
+{
+    Future<> *none = NULL;
+    whenAll(none, none)->wait();
+}
+
+MORDOR_UNITTEST(Future, whenAllWait)
+{
+    WorkerPool pool;
+    Future<> future[2];
+    boost::shared_ptr<Future<> > all = whenAll(future, future + 2);
+    pool.schedule(boost::bind(&signal<Future<> >, boost::ref(future[1])));
+    pool.schedule(boost::bind(&signal<Future<> >, boost::ref(future[0])));
+    all->wait();
+}
+
+MORDOR_UNITTEST(Future, whenAny)
+{
+    WorkerPool pool;
+    Future<> future[3];
+    boost::shared_ptr<Future<size_t> > any = whenAny(future, future + 3);
+    pool.schedule(boost::bind(&signal<Future<> >, boost::ref(future[2])));
+    pool.schedule(boost::bind(&signal<Future<> >, boost::ref(future[0])));
+    MORDOR_TEST_ASSERT_EQUAL(any->wait(), 2u);
+    any.reset();
+    // The rest still get to clean up
+    future[1].signal();
+    pool.dispatch();
+}
+
+MORDOR_UNITTEST(Future, whenAnyAlreadySignalled)
+{
+    Future<> future[2];
+    future[1].signal();
+    size_t result = ~0u;
+    whenAny(future, future + 2)->then(boost::bind(&setSize,
+        boost::ref(result), _1));
+    MORDOR_TEST_ASSERT_EQUAL(result, 1u);
+    future[0].signal();
+}
@@ -2,17 +2,23 @@
 
 #include <boost/bind.hpp>
 
+#include "mordor/config.h"
 #include "mordor/fiber.h"
 #include "mordor/http/broker.h"
 #include "mordor/http/client.h"
 #include "mordor/http/multipart.h"
 #include "mordor/http/parser.h"
 #include "mordor/http/server.h"
+#include "mordor/iomanager.h"
+#include "mordor/socket.h"
+#include "mordor/statistics.h"
 #include "mordor/streams/duplex.h"
+#include "mordor/streams/fd.h"
 #include "mordor/streams/limited.h"
 #include "mordor/streams/null.h"
 #include "mordor/streams/memory.h"
 #include "mordor/streams/random.h"
+#include "mordor/streams/socket.h"
 #include "mordor/streams/test.h"
 #include "mordor/streams/transfer.h"
 #include "mordor/test/test.h"
@@ -823,3 +829,79 @@ MORDOR_UNITTEST(HTTPServer, badRequestOnExpectContinueWithNoRequestBody)
     ClientRequest::ptr request = requestBroker.request(requestHeaders);
     MORDOR_TEST_ASSERT_EQUAL(request->response().status.status, BAD_REQUEST);
 }
+
+#ifdef LINUX
+static void acceptOne(Socket::ptr listen, Socket::ptr &accepted)
+{
+    accepted = listen->accept();
+}
+
+static void respondFile(Stream::ptr file, ServerRequest::ptr request)
+{
+    respondStream(request, file);
+}
+
+MORDOR_UNITTEST(HTTPServer, respondStreamZeroCopy)
+{
+    ConfigVar<bool>::ptr zeroCopy =
+        boost::dynamic_pointer_cast<ConfigVar<bool> >(
+            Config::lookup("transferstream.zerocopy"));
+    if (!zeroCopy->val())
+        throw TestSkippedException();
+    CountStatistic<unsigned long long> &zeroCopied =
+        *Statistics::lookup<CountStatistic<unsigned long long> >(
+            "transferstream.zerocopy");
+    unsigned long long zeroCopiedBefore = zeroCopied.count;
+
+    std::string path("/tmp/mordorXXXXXX");
+    int fd = mkstemp(&path[0]);
+    if (fd < 0)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mkstemp");
+    unlink(path.c_str());
+    Stream::ptr file(new FDStream(fd));
+    // Big enough to take more than one sendfile()
+    const char chunk[] = "0123456789abcdef";
+    MemoryStream expected;
+    for (size_t i = 0; i < 65536; ++i)
+        expected.write(chunk, 16);
+    expected.seek(0);
+    transferStream(expected, file);
+    file->seek(0);
+    unsigned long long size = expected.size();
+
+    IOManager ioManager;
+    IPv4Address address("127.0.0.1");
+    Socket::ptr listen = address.createSocket(ioManager, SOCK_STREAM);
+    listen->bind(address);
+    listen->listen();
+    Socket::ptr accepted;
+    ioManager.schedule(boost::bind(&acceptOne, listen, boost::ref(accepted)));
+    Socket::ptr sender = address.createSocket(ioManager, SOCK_STREAM);
+    sender->connect(listen->localAddress());
+    ioManager.dispatch();
+
+    ServerConnection::ptr server(new ServerConnection(
+        Stream::ptr(new SocketStream(accepted)),
+        boost::bind(&respondFile, file, _1)));
+    server->processRequests();
+    ClientConnection::ptr client(new ClientConnection(
+        Stream::ptr(new SocketStream(sender))));
+
+    Request requestHeaders;
+    requestHeaders.requestLine.uri = "/";
+    requestHeaders.request.host = "localhost";
+    ClientRequest::ptr request = client->request(requestHeaders);
+    MORDOR_TEST_ASSERT_EQUAL(request->response().status.status, OK);
+    MORDOR_TEST_ASSERT_EQUAL(request->response().entity.contentLength, size);
+    MemoryStream response;
+    MORDOR_TEST_ASSERT_EQUAL(transferStream(request->responseStream(),
+        response), size);
+    MORDOR_TEST_ASSERT(response.buffer() == expected.buffer());
+    // With io_uring, the socket is blocking, so it's copied instead
+    MORDOR_TEST_ASSERT_EQUAL(zeroCopied.count,
+        zeroCopiedBefore + (accepted->canSendFile() ? size : 0));
+
+    sender->shutdown();
+    ioManager.dispatch();
+}
+#endif
@@ -1,9 +1,13 @@
 // Copyright (c) 2009 - Mozy, Inc.
 
 #include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
 
+#include "mordor/config.h"
 #include "mordor/future.h"
 #include "mordor/iomanager.h"
+#include "mordor/statistics.h"
+#include "mordor/streams/fd.h"
 #include "mordor/test/test.h"
 #include "mordor/thread.h"
 #include "mordor/version.h"
@@ -170,3 +174,234 @@ MORDOR_UNITTEST(IOManager, tickleDeadlock)
                      tidB);
     manager.stop();
 }
+
+#ifdef LINUX
+static void
+countEvent(int &count)
+{
+    ++count;
+}
+
+MORDOR_UNITTEST(IOManager, batchedWakeup)
+{
+    // More ready fds than fit in the initial event array, so it has to grow
+    const int count = 200;
+    AverageMinMaxStatistic<unsigned int> *eventsPerWakeup =
+        Statistics::lookup<AverageMinMaxStatistic<unsigned int> >(
+            "iomanager.epoll.eventsperwakeup");
+    eventsPerWakeup->reset();
+    int fired = 0;
+    std::vector<int> fds;
+    IOManager manager;
+    if (manager.usingIoUring())
+        throw TestSkippedException();
+    for (int i = 0; i < count; ++i) {
+        int pipes[2];
+        MORDOR_TEST_ASSERT_EQUAL(pipe(pipes), 0);
+        fds.push_back(pipes[0]);
+        fds.push_back(pipes[1]);
+        MORDOR_TEST_ASSERT_EQUAL(write(pipes[1], "T", 1), 1);
+        manager.registerEvent(pipes[0], IOManager::READ,
+            boost::bind(&countEvent, boost::ref(fired)));
+    }
+    manager.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(fired, count);
+    MORDOR_TEST_ASSERT_GREATER_THAN(eventsPerWakeup->maximum.maximum, 64u);
+    for (size_t i = 0; i < fds.size(); ++i)
+        close(fds[i]);
+}
+
+MORDOR_UNITTEST(IOManager, fdBeyondAsyncStateTable)
+{
+    // Only possible once RLIMIT_NOFILE is raised past the table; it doesn't
+    // have to be open to show it's refused
+    const int fd = 4096 * 1024 + 1;
+    int fired = 0;
+    IOManager manager;
+    MORDOR_TEST_ASSERT_EXCEPTION(manager.registerEvent(fd, IOManager::READ,
+        boost::bind(&countEvent, boost::ref(fired))), std::out_of_range);
+    MORDOR_TEST_ASSERT(!manager.unregisterEvent(fd, IOManager::READ));
+    MORDOR_TEST_ASSERT(!manager.cancelEvent(fd, IOManager::READ));
+}
+#endif
+
+#ifdef LINUX
+static void
+pipePingPong(IOManager &manager, int iterations)
+{
+    int fds[2];
+    MORDOR_TEST_ASSERT_EQUAL(pipe(fds), 0);
+    MORDOR_TEST_ASSERT_EQUAL(fcntl(fds[0], F_SETFL, O_NONBLOCK), 0);
+    char byte;
+    for (int i = 0; i < iterations; ++i) {
+        MORDOR_TEST_ASSERT_EQUAL(write(fds[1], "T", 1), 1);
+        manager.registerEvent(fds[0], IOManager::READ);
+        Scheduler::yieldTo();
+        MORDOR_TEST_ASSERT_EQUAL(read(fds[0], &byte, 1), 1);
+    }
+    close(fds[0]);
+    close(fds[1]);
+}
+
+MORDOR_UNITTEST(IOManager, registerEventPerformance)
+{
+#ifndef NDEBUG_PERF
+    const int iterations = 2000;
+#else
+    const int iterations = 100000;
+#endif
+    // Four fibers per thread, each waiting on its own pipe over and over
+    for (size_t threads = 1; threads <= 8; threads *= 2) {
+        unsigned long long before = TimerManager::now();
+        {
+            IOManager manager(threads, false);
+            for (size_t i = 0; i < threads * 4; ++i)
+                manager.schedule(boost::bind(&pipePingPong,
+                    boost::ref(manager), iterations));
+            manager.stop();
+        }
+        unsigned long long elapsed = TimerManager::now() - before;
+        MORDOR_LOG_INFO(Mordor::Log::root()) << threads << " threads elapse: "
+            << elapsed << " events/s: "
+            << threads * 4 * iterations * 1000000ull / elapsed;
+    }
+}
+#endif
+
+#ifdef LINUX
+// Constructs an IOManager with iomanager.iouring set, skipping the test if
+// the kernel doesn't support it
+static IOManager *
+createIoUringManager(size_t threads = 1, bool useCaller = true)
+{
+    ConfigVarBase::ptr ioUring = Config::lookup("iomanager.iouring");
+    std::string oldIoUring = ioUring->toString();
+    ioUring->fromString("1");
+    IOManager *manager;
+    try {
+        manager = new IOManager(threads, useCaller);
+    } catch (...) {
+        ioUring->fromString(oldIoUring);
+        throw;
+    }
+    ioUring->fromString(oldIoUring);
+    if (!manager->usingIoUring()) {
+        delete manager;
+        throw TestSkippedException();
+    }
+    return manager;
+}
+
+static void
+ringRead(IOManager &manager, int fd, int &result, char &byte)
+{
+    iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    result = manager.readv(fd, &iov, 1);
+}
+
+MORDOR_UNITTEST(IOManager, ioUringOperations)
+{
+    boost::scoped_ptr<IOManager> manager(createIoUringManager());
+    int fds[2];
+    MORDOR_TEST_ASSERT_EQUAL(pipe(fds), 0);
+    int result = 0;
+    char byte = 0;
+    // Waits for the write
+    manager->schedule(boost::bind(&ringRead, boost::ref(*manager), fds[0],
+        boost::ref(result), boost::ref(byte)));
+    manager->schedule(boost::bind(&write, fds[1], "T", 1));
+    manager->dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(result, 1);
+    MORDOR_TEST_ASSERT_EQUAL(byte, 'T');
+
+    // Cancelled while waiting
+    manager->schedule(boost::bind(&ringRead, boost::ref(*manager), fds[0],
+        boost::ref(result), boost::ref(byte)));
+    manager->schedule(boost::bind(&IOManager::cancelEvent, manager.get(),
+        fds[0], IOManager::READ));
+    manager->dispatch();
+    MORDOR_TEST_ASSERT(result == -ECANCELED || result == -EINTR);
+
+    // And readiness still works alongside operations
+    int fired = 0;
+    MORDOR_TEST_ASSERT_EQUAL(write(fds[1], "T", 1), 1);
+    manager->registerEvent(fds[0], IOManager::READ,
+        boost::bind(&countEvent, boost::ref(fired)));
+    manager->dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(fired, 1);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void
+ringWriteAndFlush(IOManager &manager, int fd)
+{
+    FDStream stream(fd, &manager, NULL, false);
+    MORDOR_TEST_ASSERT_EQUAL(stream.write("hello", 5), 5u);
+    // fsync, through the ring
+    stream.flush();
+}
+
+MORDOR_UNITTEST(IOManager, ioUringFDStreamFlush)
+{
+    boost::scoped_ptr<IOManager> manager(createIoUringManager());
+    std::string path("/tmp/mordorXXXXXX");
+    int fd = mkstemp(&path[0]);
+    MORDOR_TEST_ASSERT(fd >= 0);
+    unlink(path.c_str());
+    manager->schedule(boost::bind(&ringWriteAndFlush, boost::ref(*manager),
+        fd));
+    manager->dispatch();
+    char buffer[5];
+    MORDOR_TEST_ASSERT_EQUAL(pread(fd, buffer, 5, 0), 5);
+    MORDOR_TEST_ASSERT(memcmp(buffer, "hello", 5) == 0);
+    close(fd);
+}
+
+static void
+pipePingPongIoUring(IOManager &manager, int iterations)
+{
+    int fds[2];
+    MORDOR_TEST_ASSERT_EQUAL(pipe(fds), 0);
+    char byte;
+    iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    for (int i = 0; i < iterations; ++i) {
+        MORDOR_TEST_ASSERT_EQUAL(write(fds[1], "T", 1), 1);
+        MORDOR_TEST_ASSERT_EQUAL(manager.readv(fds[0], &iov, 1), 1);
+    }
+    close(fds[0]);
+    close(fds[1]);
+}
+
+MORDOR_UNITTEST(IOManager, ioUringPerformance)
+{
+#ifndef NDEBUG_PERF
+    const int iterations = 2000;
+#else
+    const int iterations = 100000;
+#endif
+    // The same ping pong as registerEventPerformance, waiting with a poll and
+    // then reading, versus submitting the read itself
+    for (int ring = 0; ring < 3; ++ring) {
+        unsigned long long before = TimerManager::now();
+        {
+            boost::scoped_ptr<IOManager> manager(ring ?
+                createIoUringManager(1, false) : new IOManager(1, false));
+            for (size_t i = 0; i < 4; ++i)
+                manager->schedule(boost::bind(ring == 2 ?
+                    &pipePingPongIoUring : &pipePingPong,
+                    boost::ref(*manager), iterations));
+            manager->stop();
+        }
+        unsigned long long elapsed = TimerManager::now() - before;
+        MORDOR_LOG_INFO(Mordor::Log::root())
+            << (ring == 0 ? "epoll" : ring == 1 ? "io_uring poll" :
+                "io_uring readv") << " elapse: " << elapsed << " ops/s: "
+            << 4 * iterations * 1000000ull / elapsed;
+    }
+}
+#endif
@@ -8,6 +8,7 @@
 #include "mordor/iomanager.h"
 #include "mordor/parallel.h"
 #include "mordor/sleep.h"
+#include "mordor/statistics.h"
 #include "mordor/test/test.h"
 #include "mordor/workerpool.h"
 #include "mordor/util.h"
@@ -341,6 +342,117 @@ MORDOR_UNITTEST(Scheduler, parallelForEachStopShortParallel)
     MORDOR_TEST_ASSERT_LESS_THAN(sequence, 10);
 }
 
+static void countVisit(int x, std::vector<int> &visits)
+{
+    atomicIncrement(visits[x]);
+}
+
+MORDOR_UNITTEST(Scheduler, parallelForEachChunked)
+{
+    std::vector<int> values(100000), visits(values.size());
+    for (size_t i = 0; i < values.size(); ++i)
+        values[i] = (int)i;
+    WorkerPool pool(4);
+    parallel_foreach(values.begin(), values.end(), boost::bind(
+        &countVisit, _1, boost::ref(visits)), 8);
+    for (size_t i = 0; i < visits.size(); ++i)
+        MORDOR_TEST_ASSERT_EQUAL(visits[i], 1);
+}
+
+static int add(int lhs, int rhs)
+{
+    return lhs + rhs;
+}
+
+MORDOR_UNITTEST(Scheduler, parallelReduce)
+{
+    std::vector<int> values(10000);
+    for (size_t i = 0; i < values.size(); ++i)
+        values[i] = (int)i;
+    WorkerPool pool(2);
+    MORDOR_TEST_ASSERT_EQUAL(parallel_reduce(values.begin(), values.end(), 0,
+        &add), 10000 * 9999 / 2);
+    MORDOR_TEST_ASSERT_EQUAL(parallel_reduce(values.begin(), values.begin(),
+        0, &add), 0);
+}
+
+MORDOR_UNITTEST(Scheduler, parallelReduceNoScheduler)
+{
+    const int values[] = { 1, 2, 3, 4, 5 };
+    MORDOR_TEST_ASSERT_EQUAL(parallel_reduce(&values[0], &values[5], 0,
+        &add), 15);
+}
+
+static int square(int x)
+{
+    return x * x;
+}
+
+MORDOR_UNITTEST(Scheduler, parallelTransform)
+{
+    std::vector<int> values(1000), squares(values.size());
+    for (size_t i = 0; i < values.size(); ++i)
+        values[i] = (int)i;
+    WorkerPool pool(2);
+    parallel_transform(values.begin(), values.end(), squares.begin(),
+        &square);
+    for (size_t i = 0; i < squares.size(); ++i)
+        MORDOR_TEST_ASSERT_EQUAL(squares[i], (int)(i * i));
+}
+
+static int addStop5(int lhs, int rhs, int &sequence)
+{
+    if (++sequence >= 5)
+        MORDOR_THROW_EXCEPTION(OperationAbortedException());
+    return lhs + rhs;
+}
+
+MORDOR_UNITTEST(Scheduler, parallelReduceStopShort)
+{
+    std::vector<int> values(100);
+    WorkerPool pool;
+
+    int sequence = 0;
+    MORDOR_TEST_ASSERT_EXCEPTION(parallel_reduce(values.begin(), values.end(),
+        0, boost::bind(&addStop5, _1, _2, boost::ref(sequence))),
+        OperationAbortedException);
+    // Deterministic on a single thread
+    MORDOR_TEST_ASSERT_EQUAL(sequence, 5);
+}
+
+static void touch(int &x)
+{
+    x += 1;
+}
+
+MORDOR_UNITTEST(Scheduler, parallelForEachChunkedPerformance)
+{
+#ifndef NDEBUG_PERF
+    const size_t size = 100000;
+#else
+    const size_t size = 10000000;
+#endif
+    std::vector<int> values(size);
+    for (size_t threads = 1; threads <= 4; threads *= 2) {
+        WorkerPool pool(threads);
+        boost::function<void (int &)> functor = &touch;
+        unsigned long long before = TimerManager::now();
+        // Force the one-at-a-time path
+        Detail::parallel_foreach(values.begin(), values.end(), functor, 4,
+            std::input_iterator_tag());
+        unsigned long long locked = TimerManager::now() - before;
+        before = TimerManager::now();
+        parallel_foreach(values.begin(), values.end(), functor, 4);
+        unsigned long long chunked = TimerManager::now() - before;
+        MORDOR_LOG_INFO(Mordor::Log::root()) << threads << " threads: "
+            << size * 1000000ull / (locked ? locked : 1) << " (locked) vs "
+            << size * 1000000ull / (chunked ? chunked : 1)
+            << " (chunked) items/s";
+    }
+    for (size_t i = 0; i < values.size(); ++i)
+        MORDOR_TEST_ASSERT_EQUAL(values[i], 6);
+}
+
 // #ifndef NDEBUG
 // MORDOR_UNITTEST(Scheduler, scheduleForThreadNotOnScheduler)
 // {
@@ -533,3 +645,469 @@ MORDOR_UNITTEST(Scheduler, allowYieldInDestructor)
             new Fiber(boost::bind(fun, boost::shared_ptr<DummyClass>(new DummyClass)))));
     pool.stop();
 }
+
+MORDOR_UNITTEST(Scheduler, workStealingSpreadTheLoad)
+{
+    std::set<tid_t> threads;
+    {
+        boost::mutex mutex;
+        WorkerPool pool(8);
+        pool.workStealing(true);
+        // Wait for the other threads to get to idle first
+        Mordor::sleep(100000);
+
+        // All of the fibers land on one thread's local queue; the others have
+        // to steal them
+        pool.schedule(boost::bind(&startTheFibers, boost::ref(threads),
+            boost::ref(mutex)));
+        pool.stop();
+    }
+    // Make sure we hit every thread
+    MORDOR_TEST_ASSERT_ABOUT_EQUAL(threads.size(), 8u, 2u);
+}
+
+static void checkThread(tid_t expected, int &count)
+{
+    MORDOR_TEST_ASSERT_EQUAL(gettid(), expected);
+    atomicIncrement(count);
+}
+
+static void scheduleForEachThread(const std::vector<tid_t> &threads,
+    int &count)
+{
+    for (size_t i = 0; i < 10; ++i) {
+        for (std::vector<tid_t>::const_iterator it = threads.begin();
+            it != threads.end();
+            ++it)
+            Scheduler::getThis()->schedule(boost::bind(&checkThread, *it,
+                boost::ref(count)), *it);
+    }
+}
+
+MORDOR_UNITTEST(Scheduler, workStealingThreadTargeted)
+{
+    int count = 0;
+    {
+        WorkerPool pool(4, false);
+        pool.workStealing(true);
+        std::vector<tid_t> threads;
+        for (std::vector<boost::shared_ptr<Thread> >::const_iterator it =
+            pool.threads().begin();
+            it != pool.threads().end();
+            ++it)
+            threads.push_back((*it)->tid());
+        pool.schedule(boost::bind(&scheduleForEachThread,
+            boost::cref(threads), boost::ref(count)));
+        pool.stop();
+    }
+    MORDOR_TEST_ASSERT_EQUAL(count, 40);
+}
+
+static void decrement(Atomic<int> &counter)
+{
+    --counter;
+}
+
+static void fanOut(int width, Atomic<int> &counter)
+{
+    Scheduler *scheduler = Scheduler::getThis();
+    for (int i = 0; i < width; ++i)
+        scheduler->schedule(boost::bind(&decrement, boost::ref(counter)));
+}
+
+static unsigned long long scheduleFanOut(bool workStealing)
+{
+    const int seeds = 100, width = 1000;
+    Atomic<int> counter = seeds * width;
+    WorkerPool pool(4, false);
+    pool.workStealing(workStealing);
+    unsigned long long before = TimerManager::now();
+    for (int i = 0; i < seeds; ++i)
+        pool.schedule(boost::bind(&fanOut, width, boost::ref(counter)));
+    pool.stop();
+    MORDOR_TEST_ASSERT_EQUAL((int)counter, 0);
+    return TimerManager::now() - before;
+}
+
+MORDOR_UNITTEST(Scheduler, workStealingPerformance)
+{
+    unsigned long long shared = scheduleFanOut(false);
+    unsigned long long stealing = scheduleFanOut(true);
+    MORDOR_LOG_INFO(Mordor::Log::root()) << "shared queue elapse: " << shared
+        << " work stealing elapse: " << stealing;
+}
+
+static void recordCpu(std::set<unsigned int> &cpus, boost::mutex &mutex)
+{
+    // Make sure we've been back through the scheduling loop (where the
+    // thread re-binds) since cpuAffinity() was called
+    Scheduler::yield();
+    boost::mutex::scoped_lock lock(mutex);
+    cpus.insert(currentCpu());
+}
+
+MORDOR_UNITTEST(Scheduler, cpuAffinity)
+{
+#ifdef OSX
+    throw TestSkippedException();
+#endif
+    std::vector<unsigned int> cpus = numaNodeCpus(0);
+    MORDOR_TEST_ASSERT(!cpus.empty());
+    cpus.resize(1);
+    std::set<unsigned int> ranOn;
+    boost::mutex mutex;
+    {
+        WorkerPool pool(4, false);
+        pool.cpuAffinity(Scheduler::PER_CPU, cpus);
+        for (int i = 0; i < 20; ++i)
+            pool.schedule(boost::bind(&recordCpu, boost::ref(ranOn),
+                boost::ref(mutex)));
+        pool.stop();
+    }
+    MORDOR_TEST_ASSERT_EQUAL(ranOn.size(), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(*ranOn.begin(), cpus.front());
+    ranOn.clear();
+    {
+        // Every node with CPUs gets threads; all CPUs of the node are allowed
+        WorkerPool pool(4, false);
+        pool.cpuAffinity(Scheduler::PER_NUMA_NODE);
+        pool.workStealing(true);
+        for (int i = 0; i < 20; ++i)
+            pool.schedule(boost::bind(&recordCpu, boost::ref(ranOn),
+                boost::ref(mutex)));
+        pool.stop();
+    }
+    MORDOR_TEST_ASSERT(!ranOn.empty());
+}
+
+static void spin(unsigned long long us)
+{
+    unsigned long long end = TimerManager::now() + us;
+    while (TimerManager::now() < end);
+}
+
+MORDOR_UNITTEST(Scheduler, utilization)
+{
+    WorkerPool pool(2, false);
+    Mordor::sleep(50000);
+    std::vector<Scheduler::ThreadUtilization> threads = pool.utilization();
+    MORDOR_TEST_ASSERT_EQUAL(threads.size(), 2u);
+    for (size_t i = 0; i < threads.size(); ++i) {
+        MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(threads[i].elapsed, 40000u);
+        // Nothing to do yet
+        MORDOR_TEST_ASSERT_GREATER_THAN(threads[i].idle,
+            threads[i].elapsed / 2);
+    }
+    pool.schedule(boost::bind(&spin, 100000ull));
+    Mordor::sleep(50000);
+    threads = pool.utilization();
+    MORDOR_TEST_ASSERT_EQUAL(threads.size(), 2u);
+    // One of them is now busy
+    unsigned long long busy = 0;
+    for (size_t i = 0; i < threads.size(); ++i)
+        busy = std::max(busy, threads[i].elapsed - threads[i].idle);
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(busy, 20000u);
+    pool.stop();
+    MORDOR_TEST_ASSERT(pool.utilization().empty());
+}
+
+static void measureLatency(unsigned long long scheduled,
+    unsigned long long &total, Semaphore &done)
+{
+    total += TimerManager::now() - scheduled;
+    done.notify();
+}
+
+static void burst(Atomic<int> &counter, Semaphore &done)
+{
+    if (--counter == 0)
+        done.notify();
+}
+
+MORDOR_UNITTEST(Scheduler, workerPoolWakeupPerformance)
+{
+#ifndef NDEBUG_PERF
+    const int pings = 200, bursts = 20;
+#else
+    const int pings = 10000, bursts = 1000;
+#endif
+    const int burstSize = 100;
+    for (size_t threads = 1; threads <= 8; threads *= 2) {
+        WorkerPool pool(threads, false);
+        Semaphore done;
+        // Latency: one task at a time, scheduled from outside, so that a
+        // worker always has to be woken up for it
+        unsigned long long total = 0;
+        for (int i = 0; i < pings; ++i) {
+            pool.schedule(boost::bind(&measureLatency, TimerManager::now(),
+                boost::ref(total), boost::ref(done)));
+            done.wait();
+        }
+        // Throughput: bursts of tiny tasks, most of which arrive while the
+        // workers are already awake
+        unsigned long long before = TimerManager::now();
+        for (int i = 0; i < bursts; ++i) {
+            Atomic<int> counter = burstSize;
+            for (int j = 0; j < burstSize; ++j)
+                pool.schedule(boost::bind(&burst, boost::ref(counter),
+                    boost::ref(done)));
+            done.wait();
+        }
+        unsigned long long elapsed = TimerManager::now() - before;
+        pool.stop();
+        MORDOR_LOG_INFO(Mordor::Log::root()) << threads << " threads: "
+            << total / pings << "us schedule-to-run, "
+            << bursts * burstSize * 1000000ull / (elapsed ? elapsed : 1)
+            << " tasks/s";
+    }
+}
+
+static void holdNothing(boost::shared_ptr<int> ptr1,
+    boost::shared_ptr<int> ptr2)
+{
+}
+
+MORDOR_UNITTEST(Scheduler, schedulePerformance)
+{
+#ifndef NDEBUG_PERF
+    const int rounds = 100;
+#else
+    const int rounds = 1000;
+#endif
+    // Schedule in bursts, so that task nodes get recycled between them
+    const int burst = 1000;
+    WorkerPool pool;
+    unsigned long long elapse = 0;
+    for (int i = 0; i < rounds; ++i) {
+        unsigned long long before = TimerManager::now();
+        for (int j = 0; j < burst; ++j)
+            pool.schedule(&doNothing);
+        elapse += TimerManager::now() - before;
+        pool.dispatch();
+    }
+    MORDOR_LOG_INFO(Mordor::Log::root()) << "small delegate schedules/sec: "
+        << rounds * burst * 1000000ull / (elapse ? elapse : 1);
+
+    // Too big to be stored inline by boost::function
+    boost::shared_ptr<int> ptr(new int());
+    elapse = 0;
+    for (int i = 0; i < rounds; ++i) {
+        unsigned long long before = TimerManager::now();
+        for (int j = 0; j < burst; ++j)
+            pool.schedule(boost::bind(&holdNothing, ptr, ptr));
+        elapse += TimerManager::now() - before;
+        pool.dispatch();
+    }
+    MORDOR_LOG_INFO(Mordor::Log::root()) << "large delegate schedules/sec: "
+        << rounds * burst * 1000000ull / (elapse ? elapse : 1);
+
+    // Only the first one actually runs; the rest find it terminated
+    Fiber::ptr fiber(new Fiber(&doNothing));
+    elapse = 0;
+    for (int i = 0; i < rounds; ++i) {
+        fiber->reset(&doNothing);
+        unsigned long long before = TimerManager::now();
+        for (int j = 0; j < burst; ++j)
+            pool.schedule(fiber);
+        elapse += TimerManager::now() - before;
+        pool.dispatch();
+    }
+    MORDOR_LOG_INFO(Mordor::Log::root()) << "fiber schedules/sec: "
+        << rounds * burst * 1000000ull / (elapse ? elapse : 1);
+}
+
+static void recordFiber(std::vector<Fiber *> &fibers, bool block)
+{
+    if (block)
+        Scheduler::yield();
+    fibers.push_back(Fiber::getThis().get());
+}
+
+MORDOR_UNITTEST(Scheduler, delegatesShareTrampoline)
+{
+    WorkerPool pool(1, true, 4);
+    std::vector<Fiber *> fibers;
+    for (int i = 0; i < 8; ++i)
+        pool.schedule(boost::bind(&recordFiber, boost::ref(fibers), false));
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(fibers.size(), 8u);
+    for (size_t i = 1; i < fibers.size(); ++i)
+        MORDOR_TEST_ASSERT_EQUAL(fibers[i], fibers[0]);
+}
+
+MORDOR_UNITTEST(Scheduler, delegateBlocksOnTrampoline)
+{
+    WorkerPool pool(1, true, 4);
+    std::vector<Fiber *> fibers;
+    pool.schedule(boost::bind(&recordFiber, boost::ref(fibers), false));
+    pool.schedule(boost::bind(&recordFiber, boost::ref(fibers), true));
+    pool.schedule(boost::bind(&recordFiber, boost::ref(fibers), false));
+    pool.schedule(boost::bind(&recordFiber, boost::ref(fibers), false));
+    pool.dispatch();
+    // The blocked delegate finished last, still on the trampoline it
+    // started on; the one after it needed a new trampoline
+    MORDOR_TEST_ASSERT_EQUAL(fibers.size(), 4u);
+    std::set<Fiber *> distinct(fibers.begin(), fibers.end());
+    MORDOR_TEST_ASSERT_EQUAL(distinct.size(), 2u);
+    MORDOR_TEST_ASSERT_NOT_EQUAL(fibers[3], fibers[2]);
+
+    // And a delegate that blocks across threads
+    WorkerPool other(1, false);
+    fibers.clear();
+    pool.schedule(boost::bind(&Scheduler::switchTo, &other, emptytid()));
+    pool.schedule(boost::bind(&recordFiber, boost::ref(fibers), false));
+    pool.dispatch();
+    other.stop();
+    MORDOR_TEST_ASSERT_EQUAL(fibers.size(), 1u);
+}
+
+MORDOR_UNITTEST(Scheduler, delegateDispatchPerformance)
+{
+#ifndef NDEBUG_PERF
+    const int count = 100000;
+#else
+    const int count = 1000000;
+#endif
+    for (size_t batchSize = 1; batchSize <= 64; batchSize *= 8) {
+        WorkerPool pool(1, true, batchSize);
+        int total = 0;
+        for (int i = 0; i < count; ++i)
+            pool.schedule(boost::bind(&increment, boost::ref(total)));
+        unsigned long long before = TimerManager::now();
+        pool.dispatch();
+        unsigned long long elapse = TimerManager::now() - before;
+        MORDOR_TEST_ASSERT_EQUAL(total, count);
+        MORDOR_LOG_INFO(Mordor::Log::root()) << "batch size " << batchSize
+            << ": " << count * 1000000ull / (elapse ? elapse : 1)
+            << " delegates/s";
+    }
+}
+
+static void recordPriority(std::vector<Scheduler::Priority> &order,
+    Scheduler::Priority priority)
+{
+    order.push_back(priority);
+}
+
+MORDOR_UNITTEST(Scheduler, priorities)
+{
+    PerThreadHistogramStatistic<unsigned long long> *highWait =
+        Statistics::lookup<PerThreadHistogramStatistic<unsigned long long> >(
+            "scheduler.high.wait");
+    MORDOR_TEST_ASSERT(highWait);
+    unsigned long long highRan = highWait->count();
+
+    WorkerPool pool;
+    std::vector<Scheduler::Priority> order;
+    Scheduler::Priority priorities[] =
+        { Scheduler::LOW, Scheduler::NORMAL, Scheduler::HIGH };
+    for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 3; ++j)
+            pool.schedule(boost::bind(&recordPriority, boost::ref(order),
+                priorities[i]), priorities[i]);
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(order.size(), 9u);
+    for (size_t i = 0; i < order.size(); ++i)
+        MORDOR_TEST_ASSERT_EQUAL(order[i], priorities[2 - i / 3]);
+    MORDOR_TEST_ASSERT_EQUAL(highWait->count(), highRan + 3);
+}
+
+static void rescheduleHigh(bool &lowRan, int &count)
+{
+    if (lowRan || ++count == 1000)
+        return;
+    Scheduler::getThis()->schedule(boost::bind(&rescheduleHigh,
+        boost::ref(lowRan), boost::ref(count)), Scheduler::HIGH);
+}
+
+static void setTrue(bool &flag)
+{
+    flag = true;
+}
+
+MORDOR_UNITTEST(Scheduler, lowPriorityNotStarved)
+{
+    WorkerPool pool;
+    bool lowRan = false;
+    int count = 0;
+    pool.schedule(boost::bind(&setTrue, boost::ref(lowRan)), Scheduler::LOW);
+    pool.schedule(boost::bind(&rescheduleHigh, boost::ref(lowRan),
+        boost::ref(count)), Scheduler::HIGH);
+    pool.dispatch();
+    MORDOR_TEST_ASSERT(lowRan);
+    MORDOR_TEST_ASSERT_LESS_THAN(count, 1000);
+}
+
+static void recordLatency(unsigned long long scheduled,
+    unsigned long long &latency)
+{
+    latency = TimerManager::now() - scheduled;
+}
+
+MORDOR_UNITTEST(Scheduler, priorityLatencyPerformance)
+{
+    // A backlog of bulk work, and then one latency-sensitive task
+    const int backlog = 200;
+    WorkerPool pool;
+    unsigned long long normal, high;
+    for (int i = 0; i < backlog; ++i)
+        pool.schedule(boost::bind(&spin, 50ull));
+    pool.schedule(boost::bind(&recordLatency, TimerManager::now(),
+        boost::ref(normal)));
+    pool.dispatch();
+    for (int i = 0; i < backlog; ++i)
+        pool.schedule(boost::bind(&spin, 50ull));
+    pool.schedule(boost::bind(&recordLatency, TimerManager::now(),
+        boost::ref(high)), Scheduler::HIGH);
+    pool.dispatch();
+    MORDOR_LOG_INFO(Mordor::Log::root()) << "latency behind " << backlog
+        << " tasks: " << normal << "us (NORMAL) vs " << high
+        << "us (HIGH)";
+    MORDOR_TEST_ASSERT_LESS_THAN(high, normal);
+}
+
+MORDOR_UNITTEST(Scheduler, instrumentation)
+{
+    PerThreadHistogramStatistic<unsigned long long> *latency =
+        Statistics::lookup<PerThreadHistogramStatistic<unsigned long long> >(
+            "scheduler.latency");
+    PerThreadHistogramStatistic<unsigned long long> *slice =
+        Statistics::lookup<PerThreadHistogramStatistic<unsigned long long> >(
+            "scheduler.slice");
+    HistogramStatistic<unsigned int> *depth =
+        Statistics::lookup<HistogramStatistic<unsigned int> >(
+            "scheduler.depth");
+    PerThreadCountStatistic<unsigned long long> *created =
+        Statistics::lookup<PerThreadCountStatistic<unsigned long long> >(
+            "fiber.created");
+    PerThreadCountStatistic<unsigned long long> *destroyed =
+        Statistics::lookup<PerThreadCountStatistic<unsigned long long> >(
+            "fiber.destroyed");
+    PerThreadCountStatistic<unsigned long long> *switches =
+        Statistics::lookup<PerThreadCountStatistic<unsigned long long> >(
+            "fiber.switches");
+    MORDOR_TEST_ASSERT(latency && slice && depth && created && destroyed &&
+        switches);
+    // This thread's own fiber outlives the pool, so make sure it's already
+    // there when run on its own
+    Fiber::getThis();
+    unsigned long long latencies = latency->count(), slices = slice->count(),
+        depths = depth->count(), creates = created->count(),
+        destroys = destroyed->count(), switched = switches->count();
+
+    {
+        WorkerPool pool;
+        for (int i = 0; i < 10; ++i)
+            pool.schedule(Fiber::ptr(new Fiber(&doNothing)));
+        pool.dispatch();
+    }
+    MORDOR_TEST_ASSERT_EQUAL(latency->count(), latencies + 10);
+    MORDOR_TEST_ASSERT_EQUAL(slice->count(), slices + 10);
+    MORDOR_TEST_ASSERT_GREATER_THAN(depth->count(), depths);
+    // Plus the Scheduler's own fibers, which are gone again too
+    MORDOR_TEST_ASSERT_GREATER_THAN(created->count(), creates + 10);
+    MORDOR_TEST_ASSERT_EQUAL(destroyed->count() - destroys,
+        created->count() - creates);
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(switches->count(),
+        switched + 20);
+}
@@ -1,5 +1,10 @@
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "mordor/log.h"
 #include "mordor/statistics.h"
 #include "mordor/test/test.h"
+#include "mordor/thread.h"
 
 using namespace Mordor;
 
@@ -14,3 +19,178 @@ MORDOR_UNITTEST(Statistics, dumpStat)
         << sumStat << " s" << std::endl;
     MORDOR_TEST_ASSERT_EQUAL(os.str(), expectedOS.str());
 }
+
+MORDOR_UNITTEST(Statistics, histogram)
+{
+    HistogramStatistic<unsigned int> histogram("us");
+    MORDOR_TEST_ASSERT_EQUAL(histogram.count(), 0u);
+    histogram.update(0);
+    histogram.update(1);
+    for (int i = 0; i < 97; ++i)
+        histogram.update(5);
+    histogram.update(1000);
+    MORDOR_TEST_ASSERT_EQUAL(histogram.count(), 100u);
+    MORDOR_TEST_ASSERT_EQUAL(histogram.buckets[0], 1u);
+    MORDOR_TEST_ASSERT_EQUAL(histogram.buckets[1], 1u);
+    MORDOR_TEST_ASSERT_EQUAL(histogram.buckets[3], 97u);
+    MORDOR_TEST_ASSERT_EQUAL(histogram.buckets[10], 1u);
+    MORDOR_TEST_ASSERT_EQUAL(histogram.percentile(0.01), 0u);
+    MORDOR_TEST_ASSERT_EQUAL(histogram.percentile(0.5), 7u);
+    MORDOR_TEST_ASSERT_EQUAL(histogram.percentile(0.99), 7u);
+    MORDOR_TEST_ASSERT_EQUAL(histogram.percentile(1.0), 1023u);
+    histogram.update(0xffffffffu);
+    MORDOR_TEST_ASSERT_EQUAL(histogram.percentile(1.0), 0xffffffffu);
+    histogram.reset();
+    MORDOR_TEST_ASSERT_EQUAL(histogram.count(), 0u);
+}
+
+template <class T>
+static void
+updateMany(T &stat, int count)
+{
+    for (int i = 0; i < count; ++i)
+        stat.update(i & 7);
+}
+
+template <class T>
+static void
+incrementMany(T &stat, int count)
+{
+    for (int i = 0; i < count; ++i)
+        stat.increment();
+}
+
+template <class T>
+static void
+decrementMany(T &stat, int count)
+{
+    for (int i = 0; i < count; ++i)
+        stat.decrement();
+}
+
+template <class T>
+static unsigned long long
+incrementFromThreads(T &stat, size_t threads, int count)
+{
+    std::vector<boost::shared_ptr<Thread> > running;
+    unsigned long long start = TimerManager::now();
+    for (size_t i = 0; i < threads; ++i)
+        running.push_back(boost::shared_ptr<Thread>(new Thread(
+            boost::bind(&incrementMany<T>, boost::ref(stat), count))));
+    for (size_t i = 0; i < threads; ++i)
+        running[i]->join();
+    return TimerManager::now() - start;
+}
+
+MORDOR_UNITTEST(Statistics, perThread)
+{
+    // More threads than stripes, so some share
+    const size_t threads = PerThreadStatistic::STRIPES + 4;
+    PerThreadCountStatistic<unsigned long long> count;
+    incrementFromThreads(count, threads, 1000);
+    MORDOR_TEST_ASSERT_EQUAL(count.count(), threads * 1000u);
+    count.add(5);
+    MORDOR_TEST_ASSERT_EQUAL(count.count(), threads * 1000u + 5);
+    // Decremented from a thread other than the ones that incremented
+    Thread decrementer(boost::bind(
+        &decrementMany<PerThreadCountStatistic<unsigned long long> >,
+        boost::ref(count), 5));
+    decrementer.join();
+    MORDOR_TEST_ASSERT_EQUAL(count.count(), threads * 1000u);
+    count.reset();
+    MORDOR_TEST_ASSERT_EQUAL(count.count(), 0u);
+
+    PerThreadHistogramStatistic<unsigned int> histogram;
+    std::vector<boost::shared_ptr<Thread> > running;
+    for (size_t i = 0; i < 4; ++i)
+        running.push_back(boost::shared_ptr<Thread>(new Thread(boost::bind(
+            &updateMany<PerThreadHistogramStatistic<unsigned int> >,
+            boost::ref(histogram), 800))));
+    for (size_t i = 0; i < running.size(); ++i)
+        running[i]->join();
+    MORDOR_TEST_ASSERT_EQUAL(histogram.count(), 3200u);
+    // 0 to 7, evenly
+    MORDOR_TEST_ASSERT_EQUAL(histogram.total().buckets[0], 400u);
+    MORDOR_TEST_ASSERT_EQUAL(histogram.total().buckets[3], 1600u);
+    MORDOR_TEST_ASSERT_EQUAL(histogram.percentile(0.5), 3u);
+    MORDOR_TEST_ASSERT_EQUAL(histogram.percentile(1.0), 7u);
+}
+
+MORDOR_UNITTEST(Statistics, perThreadPerformance)
+{
+#ifndef NDEBUG_PERF
+    const int count = 100000;
+#else
+    const int count = 10000000;
+#endif
+    for (size_t threads = 1; threads <= 8; threads *= 2) {
+        CountStatistic<unsigned long long> shared;
+        PerThreadCountStatistic<unsigned long long> perThread;
+        unsigned long long sharedElapsed =
+            incrementFromThreads(shared, threads, count);
+        unsigned long long perThreadElapsed =
+            incrementFromThreads(perThread, threads, count);
+        MORDOR_TEST_ASSERT_EQUAL(shared.count, threads * count);
+        MORDOR_TEST_ASSERT_EQUAL(perThread.count(), threads * count);
+        MORDOR_LOG_INFO(Mordor::Log::root()) << threads << " threads: "
+            << threads * count * 1000000ull / (sharedElapsed ? sharedElapsed : 1)
+            << " increments/s shared, "
+            << threads * count * 1000000ull /
+                (perThreadElapsed ? perThreadElapsed : 1)
+            << " per thread";
+    }
+}
+
+MORDOR_UNITTEST(Statistics, dumpPrefix)
+{
+    Statistics::registerStatistic("statisticstest.prefix.a",
+        CountStatistic<int>());
+    Statistics::registerStatistic("statisticstest.prefixb",
+        CountStatistic<int>());
+    std::ostringstream os;
+    Statistics::dump(os, "statisticstest.prefix.");
+    MORDOR_TEST_ASSERT_NOT_EQUAL(os.str().find("statisticstest.prefix.a"),
+        std::string::npos);
+    MORDOR_TEST_ASSERT_EQUAL(os.str().find("statisticstest.prefixb"),
+        std::string::npos);
+}
+
+namespace {
+class CaptureLogSink : public LogSink
+{
+public:
+    void log(const std::string &logger,
+             boost::posix_time::ptime now, unsigned long long elapsed,
+             tid_t thread, void *fiber,
+             Log::Level level, const std::string &str,
+             const char* file, int line)
+    {
+        messages.push_back(str);
+    }
+
+    std::vector<std::string> messages;
+};
+}
+
+MORDOR_UNITTEST(Statistics, dumpPeriodically)
+{
+    Statistics::registerStatistic("statisticstest.periodic",
+        CountStatistic<int>());
+    Logger::ptr logger = Log::lookup("mordor:statistics");
+    boost::shared_ptr<CaptureLogSink> sink(new CaptureLogSink());
+    Log::Level level = logger->level();
+    logger->level(Log::INFO);
+    logger->addSink(sink);
+    TimerManager timerManager;
+    Timer::ptr timer = Statistics::dumpPeriodically(timerManager, 0,
+        "statisticstest.periodic");
+    timerManager.executeTimers();
+    timerManager.executeTimers();
+    timer->cancel();
+    timerManager.executeTimers();
+    logger->removeSink(sink);
+    logger->level(level);
+    MORDOR_TEST_ASSERT_EQUAL(sink->messages.size(), 2u);
+    MORDOR_TEST_ASSERT_NOT_EQUAL(
+        sink->messages[0].find("statisticstest.periodic"), std::string::npos);
+}
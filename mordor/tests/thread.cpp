@@ -1,5 +1,7 @@
 // Copyright (c) 2010 - Mozy, Inc.
 
+#include <algorithm>
+
 #include <boost/bind.hpp>
 
 #include "mordor/test/test.h"
@@ -77,3 +79,42 @@ MORDOR_UNITTEST(Thread, exceptionRethrow)
     MORDOR_TEST_ASSERT_EXCEPTION(rethrowException(poolA, poolB), DummyException);
     poolA.switchTo();
 }
+
+static void bindToCpu(unsigned int cpu, unsigned int &runningOn)
+{
+    setThreadAffinity(std::vector<unsigned int>(1, cpu));
+    runningOn = currentCpu();
+    setThreadAffinity(std::vector<unsigned int>());
+}
+
+MORDOR_UNITTEST(Thread, affinity)
+{
+#ifdef OSX
+    throw Test::TestSkippedException();
+#endif
+    std::vector<unsigned int> cpus = numaNodeCpus(0);
+    MORDOR_TEST_ASSERT(!cpus.empty());
+    unsigned int runningOn = ~0u;
+    // Don't leave the test runner's thread bound
+    Thread t(boost::bind(&bindToCpu, cpus.back(), boost::ref(runningOn)));
+    t.join();
+    MORDOR_TEST_ASSERT_EQUAL(runningOn, cpus.back());
+}
+
+MORDOR_UNITTEST(Thread, numaTopology)
+{
+    size_t nodes = numaNodeCount();
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(nodes, 1u);
+    MORDOR_TEST_ASSERT_LESS_THAN(currentNumaNode(), nodes);
+    // Every CPU is on exactly one node, and we're on one of them
+    std::vector<unsigned int> all;
+    for (size_t node = 0; node < nodes; ++node) {
+        std::vector<unsigned int> cpus = numaNodeCpus(node);
+        all.insert(all.end(), cpus.begin(), cpus.end());
+    }
+    std::sort(all.begin(), all.end());
+    MORDOR_TEST_ASSERT(std::adjacent_find(all.begin(), all.end()) ==
+        all.end());
+    MORDOR_TEST_ASSERT(std::find(all.begin(), all.end(), currentCpu()) !=
+        all.end());
+}
@@ -2,6 +2,7 @@
 
 #include <boost/bind.hpp>
 
+#include "mordor/config.h"
 #include "mordor/timer.h"
 #include "mordor/workerpool.h"
 #include "mordor/test/test.h"
@@ -304,3 +305,285 @@ MORDOR_UNITTEST(Timer, workerPoolConditonInvalid)
     // TestTimerClass::timedOut is NOT executed
     MORDOR_TEST_ASSERT_EQUAL(sequence, 1);
 }
+
+static void
+recordExpiry(unsigned long long &clock, unsigned long long &expired)
+{
+    expired = clock;
+}
+
+MORDOR_UNITTEST(Timer, wheel)
+{
+    static unsigned long long clock = 1000000000ULL;
+    TimerManager::setClock(boost::bind(&fakeClock, boost::ref(clock)));
+
+    // One timer for each level of the wheel, and one beyond it
+    const unsigned long long resolution = 1000;
+    const unsigned long long delays[] = { 0, 1, 999, 1001, 255000, 300000,
+        16000000, 1000000000, 70000000000ULL, 5000000000000ULL };
+    const size_t count = sizeof(delays) / sizeof(delays[0]);
+    unsigned long long expired[count];
+    {
+        TimerManager manager(resolution);
+        MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), ~0ull);
+        unsigned long long start = clock;
+        for (size_t i = 0; i < count; ++i) {
+            expired[i] = 0;
+            manager.registerTimer(delays[i], boost::bind(&recordExpiry,
+                boost::ref(clock), boost::ref(expired[i])));
+        }
+        // Sleep until the next timer, like an IOManager would
+        size_t wakeups = 0;
+        unsigned long long next;
+        while ((next = manager.nextTimer()) != ~0ull) {
+            clock += next;
+            manager.executeTimers();
+            ++wakeups;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(expired[i],
+                start + delays[i]);
+            MORDOR_TEST_ASSERT_LESS_THAN(expired[i],
+                start + delays[i] + resolution);
+        }
+        // Cascading from the higher levels costs a few extra wakeups, but
+        // not many
+        MORDOR_TEST_ASSERT_LESS_THAN(wakeups, count * 5);
+    }
+
+    TimerManager::setClock();
+}
+
+MORDOR_UNITTEST(Timer, wheelStaggered)
+{
+    // A multiple of a level 2 slot (2^14 ticks), so the slots line up with
+    // the offsets below
+    static unsigned long long clock = 999424000ULL;
+    TimerManager::setClock(boost::bind(&fakeClock, boost::ref(clock)));
+
+    // Timers registered later, further down the wheel, but due after
+    // timers already waiting in a higher level, mustn't hide them (in order
+    // of registration)
+    const unsigned long long resolution = 1000;
+    const unsigned long long registerAt[] = { 0, 0, 200000, 15600000 };
+    const unsigned long long delays[] = { 256000, 16384000, 251000,
+        1100000 };
+    const size_t count = sizeof(delays) / sizeof(delays[0]);
+    unsigned long long expired[count];
+    {
+        TimerManager manager(resolution);
+        unsigned long long start = clock;
+        size_t registered = 0;
+        unsigned long long next;
+        while (true) {
+            for (; registered < count &&
+                start + registerAt[registered] <= clock; ++registered) {
+                expired[registered] = 0;
+                manager.registerTimer(delays[registered],
+                    boost::bind(&recordExpiry, boost::ref(clock),
+                    boost::ref(expired[registered])));
+            }
+            next = manager.nextTimer();
+            if (registered < count)
+                next = std::min(next, start + registerAt[registered] - clock);
+            else if (next == ~0ull)
+                break;
+            // Sleep until the next timer (or registration), like an
+            // IOManager would
+            clock += next;
+            manager.executeTimers();
+        }
+        for (size_t i = 0; i < count; ++i) {
+            MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(expired[i],
+                start + registerAt[i] + delays[i]);
+            MORDOR_TEST_ASSERT_LESS_THAN(expired[i],
+                start + registerAt[i] + delays[i] + resolution);
+        }
+    }
+
+    TimerManager::setClock();
+}
+
+MORDOR_UNITTEST(Timer, wheelRefreshAndCancel)
+{
+    static unsigned long long clock = 1000000000ULL;
+    TimerManager::setClock(boost::bind(&fakeClock, boost::ref(clock)));
+
+    int sequence = 0;
+    {
+        TimerManager manager(1000);
+        Timer::ptr timer1 = manager.registerTimer(10000,
+            boost::bind(&singleTimer, boost::ref(sequence), 1));
+        Timer::ptr timer2 = manager.registerTimer(5000,
+            boost::bind(&singleTimer, boost::ref(sequence), 2));
+        MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), 5000ull);
+        MORDOR_TEST_ASSERT(timer2->cancel());
+        MORDOR_TEST_ASSERT(!timer2->cancel());
+        MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), 10000ull);
+        clock += 8000;
+        MORDOR_TEST_ASSERT(timer1->refresh());
+        manager.executeTimers();
+        MORDOR_TEST_ASSERT_EQUAL(sequence, 0);
+        MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), 10000ull);
+        MORDOR_TEST_ASSERT(timer1->reset(20000, false));
+        MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), 20000ull);
+        clock += 20000;
+        manager.executeTimers();
+        MORDOR_TEST_ASSERT_EQUAL(sequence, 1);
+        MORDOR_TEST_ASSERT(!timer1->refresh());
+        MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), ~0ull);
+
+        Timer::ptr timer3 = manager.registerTimer(1000,
+            boost::bind(&singleTimer, boost::ref(sequence),
+            boost::ref(sequence)), true);
+        for (int i = 0; i < 3; ++i) {
+            MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), 1000ull);
+            clock += 1000;
+            manager.executeTimers();
+        }
+        MORDOR_TEST_ASSERT_EQUAL(sequence, 4);
+        MORDOR_TEST_ASSERT(timer3->cancel());
+        MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), ~0ull);
+    }
+
+    TimerManager::setClock();
+}
+
+MORDOR_UNITTEST(Timer, wheelRollover)
+{
+    static unsigned long long clock = 1000000000000ULL;
+    TimerManager::setClock(boost::bind(&fakeClock, boost::ref(clock)));
+
+    int sequence = 0;
+    {
+        TimerManager manager(1000);
+        manager.registerTimer(60000000,
+            boost::bind(&singleTimer, boost::ref(sequence), boost::ref(sequence)));
+        manager.registerTimer(3600000000ULL,
+            boost::bind(&singleTimer, boost::ref(sequence), boost::ref(sequence)));
+        manager.executeTimers();
+        MORDOR_TEST_ASSERT_EQUAL(sequence, 0);
+        // The clock jumps backwards by more than
+        // timer.clockrolloverthreshold; everything expires
+        clock -= 60000000;
+        manager.executeTimers();
+        MORDOR_TEST_ASSERT_EQUAL(sequence, 2);
+        MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), ~0ull);
+    }
+
+    TimerManager::setClock();
+}
+
+static void nop() {}
+
+static void
+timerOperations(unsigned long long wheelResolution, size_t count)
+{
+    std::vector<Timer::ptr> timers;
+    timers.reserve(count);
+    TimerManager manager(wheelResolution);
+    // Connection-style timeouts: all about the same, spread a little
+    unsigned long long before = TimerManager::now();
+    for (size_t i = 0; i < count; ++i)
+        timers.push_back(manager.registerTimer(30000000 + (i * 7919) % 1000000,
+            &nop));
+    unsigned long long registered = TimerManager::now();
+    for (size_t i = 0; i < count; ++i)
+        timers[i]->refresh();
+    unsigned long long refreshed = TimerManager::now();
+    for (size_t i = 0; i < count; ++i)
+        timers[i]->cancel();
+    unsigned long long cancelled = TimerManager::now();
+    MORDOR_LOG_INFO(Mordor::Log::root())
+        << (wheelResolution ? "wheel" : "set") << " " << count
+        << " timers register: " << (registered - before)
+        << " refresh: " << (refreshed - registered)
+        << " cancel: " << (cancelled - refreshed);
+}
+
+MORDOR_UNITTEST(Timer, wheelPerformance)
+{
+#ifndef NDEBUG_PERF
+    const size_t counts[] = { 10000, 100000 };
+#else
+    const size_t counts[] = { 100000, 1000000 };
+#endif
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i) {
+        timerOperations(0, counts[i]);
+        timerOperations(1000, counts[i]);
+    }
+}
+
+MORDOR_UNITTEST(Timer, coarseClock)
+{
+    ConfigVarBase::ptr coarse = Config::lookup("timer.coarseclock");
+    std::string oldCoarse = coarse->toString();
+    coarse->fromString("1");
+    unsigned long long resolution = TimerManager::clockResolution();
+    unsigned long long coarseNow = TimerManager::now();
+    coarse->fromString("0");
+    unsigned long long preciseNow = TimerManager::now();
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(preciseNow + resolution,
+        coarseNow);
+    MORDOR_TEST_ASSERT_LESS_THAN_OR_EQUAL(preciseNow, coarseNow + resolution
+        + 1000000);
+
+    // The test hook still wins
+    coarse->fromString("1");
+    static unsigned long long clock = 12345;
+    TimerManager::setClock(boost::bind(&fakeClock, boost::ref(clock)));
+    MORDOR_TEST_ASSERT_EQUAL(TimerManager::now(), 12345ull);
+    MORDOR_TEST_ASSERT_EQUAL(TimerManager::clockResolution(), 1ull);
+    TimerManager::setClock();
+    coarse->fromString(oldCoarse);
+}
+
+static void
+timerHotPath(size_t count)
+{
+    TimerManager manager;
+    Timer::ptr timer = manager.registerTimer(30000000, &nop);
+    for (size_t i = 0; i < count; ++i) {
+        timer->refresh();
+        manager.nextTimer();
+        manager.executeTimers();
+    }
+    timer->cancel();
+}
+
+static void
+readClock(size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        TimerManager::now();
+}
+
+MORDOR_UNITTEST(Timer, coarseClockPerformance)
+{
+#ifndef NDEBUG_PERF
+    const size_t count = 100000;
+#else
+    const size_t count = 10000000;
+#endif
+    ConfigVarBase::ptr coarse = Config::lookup("timer.coarseclock");
+    std::string oldCoarse = coarse->toString();
+    for (int i = 0; i < 2; ++i) {
+        // Always time with the precise clock
+        coarse->fromString("0");
+        unsigned long long before = TimerManager::now();
+        coarse->fromString(i ? "1" : "0");
+        readClock(count);
+        coarse->fromString("0");
+        unsigned long long clock = TimerManager::now() - before;
+        before = TimerManager::now();
+        coarse->fromString(i ? "1" : "0");
+        timerHotPath(count);
+        coarse->fromString("0");
+        unsigned long long hotPath = TimerManager::now() - before;
+        MORDOR_LOG_INFO(Mordor::Log::root())
+            << (i ? "coarse" : "precise") << " now(): "
+            << clock * 1000 / count << " ns refresh/nextTimer/execute: "
+            << hotPath * 1000 / count << " ns";
+    }
+    coarse->fromString(oldCoarse);
+}
@@ -1,11 +1,25 @@
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <boost/bind.hpp>
+
+#include "mordor/config.h"
+#include "mordor/iomanager.h"
+#include "mordor/log.h"
+#include "mordor/socket.h"
+#include "mordor/statistics.h"
+#include "mordor/streams/buffered.h"
+#include "mordor/streams/fd.h"
+#include "mordor/streams/limited.h"
 #include "mordor/streams/memory.h"
+#include "mordor/streams/notify.h"
+#include "mordor/streams/socket.h"
 #include "mordor/streams/test.h"
 #include "mordor/streams/transfer.h"
 #include "mordor/test/test.h"
+#include "mordor/timer.h"
 
 using namespace Mordor;
+using namespace Mordor::Test;
 
 MORDOR_UNITTEST(TransferStream, exactLengthMultipleReads)
 {
@@ -41,3 +55,265 @@ MORDOR_UNITTEST(TransferStream, inferEof)
     MemoryStream outStream;
     MORDOR_TEST_ASSERT_EQUAL(transferStream(inStream, outStream), 5ull);
 }
+
+static ConfigVar<bool>::ptr adaptiveEnabled()
+{
+    return boost::dynamic_pointer_cast<ConfigVar<bool> >(
+        Config::lookup("transferstream.adaptive"));
+}
+
+static ConfigVar<size_t>::ptr budget()
+{
+    return boost::dynamic_pointer_cast<ConfigVar<size_t> >(
+        Config::lookup("transferstream.budget"));
+}
+
+namespace {
+// Puts a ConfigVar back the way it was, even if the test fails
+template <class T>
+struct ConfigVarRestorer
+{
+    ConfigVarRestorer(typename ConfigVar<T>::ptr var)
+        : m_var(var),
+          m_val(var->val())
+    {}
+    ~ConfigVarRestorer() { m_var->val(m_val); }
+
+private:
+    typename ConfigVar<T>::ptr m_var;
+    T m_val;
+};
+}
+
+static std::string pattern(size_t size)
+{
+    std::string result(size, '\0');
+    for (size_t i = 0; i < size; ++i)
+        result[i] = (char)(i % 251);
+    return result;
+}
+
+MORDOR_UNITTEST(TransferStream, adaptive)
+{
+    ConfigVarRestorer<bool> restoreAdaptive(adaptiveEnabled());
+    ConfigVarRestorer<size_t> restoreBudget(budget());
+    adaptiveEnabled()->val(true);
+    // Small enough that both the chunk size and the depth have to give
+    budget()->val(128 * 1024);
+    CountStatistic<unsigned long long> &adjustments =
+        *Statistics::lookup<CountStatistic<unsigned long long> >(
+            "transferstream.adaptive.adjustments");
+    unsigned long long adjustmentsBefore = adjustments.count;
+    IOManager ioManager;
+    std::string data = pattern(1024 * 1024 + 3);
+    MemoryStream::ptr inStream(new MemoryStream(Buffer(data)));
+    TestStream::ptr source(new TestStream(inStream));
+    MemoryStream::ptr outStream(new MemoryStream());
+    TestStream::ptr sink(new TestStream(outStream));
+    // Starts out reading whole chunks, then gets stingy
+    source->onRead(boost::bind(&TestStream::maxReadSize, source.get(), 1000),
+        512 * 1024);
+    sink->maxWriteSize(3000);
+    MORDOR_TEST_ASSERT_EQUAL(transferStream(source, sink),
+        (unsigned long long)data.size());
+    MORDOR_TEST_ASSERT(outStream->buffer() == data);
+    // 1000 byte reads can't fill the starting chunk size
+    MORDOR_TEST_ASSERT_GREATER_THAN(adjustments.count, adjustmentsBefore);
+
+    inStream->seek(0);
+    MemoryStream discard;
+    MORDOR_TEST_ASSERT_EQUAL(transferStream(source, discard, data.size() + 1,
+        UNTILEOF), (unsigned long long)data.size());
+    inStream->seek(0);
+    MORDOR_TEST_ASSERT_EXCEPTION(transferStream(source, discard,
+        data.size() + 1), UnexpectedEofException);
+}
+
+static void acceptOne(Socket::ptr listen, Socket::ptr &accepted)
+{
+    accepted = listen->accept();
+}
+
+static void connectedSockets(IOManager &ioManager, Socket::ptr &sender,
+    Socket::ptr &receiver)
+{
+    IPv4Address address("127.0.0.1");
+    Socket::ptr listen = address.createSocket(ioManager, SOCK_STREAM);
+    listen->bind(address);
+    listen->listen();
+    ioManager.schedule(boost::bind(&acceptOne, listen, boost::ref(receiver)));
+    sender = address.createSocket(ioManager, SOCK_STREAM);
+    sender->connect(listen->localAddress());
+    ioManager.dispatch();
+}
+
+static void receiveAll(Socket::ptr socket, Buffer &buffer, bool keep)
+{
+    SocketStream stream(socket);
+    while (stream.read(buffer, 65536) > 0) {
+        if (!keep)
+            buffer.clear();
+    }
+}
+
+static void sendAll(Socket::ptr socket, const Buffer &data)
+{
+    SocketStream stream(socket);
+    Buffer remaining(data);
+    while (remaining.readAvailable() > 0)
+        remaining.consume(stream.write(remaining, remaining.readAvailable()));
+    socket->shutdown();
+}
+
+// Relays data from one loopback connection to another
+static unsigned long long relay(const Buffer &data)
+{
+    IOManager ioManager;
+    Socket::ptr sender, relayIn, relayOut, receiver;
+    connectedSockets(ioManager, sender, relayIn);
+    connectedSockets(ioManager, relayOut, receiver);
+    Buffer received;
+    ioManager.schedule(boost::bind(&sendAll, sender, boost::cref(data)));
+    ioManager.schedule(boost::bind(&receiveAll, receiver,
+        boost::ref(received), false));
+    SocketStream in(relayIn), out(relayOut);
+    unsigned long long start = TimerManager::now();
+    transferStream(in, out);
+    relayOut->shutdown();
+    ioManager.dispatch();
+    return TimerManager::now() - start;
+}
+
+MORDOR_UNITTEST(TransferStream, adaptivePerformance)
+{
+#ifndef NDEBUG_PERF
+    size_t megabytes = 16;
+#else
+    size_t megabytes = 256;
+#endif
+    Buffer megabyte(pattern(1024 * 1024)), data;
+    for (size_t i = 0; i < megabytes; ++i)
+        data.copyIn(megabyte);
+    ConfigVar<bool>::ptr adaptive = adaptiveEnabled();
+    ConfigVarRestorer<bool> restoreAdaptive(adaptive);
+    adaptive->val(false);
+    unsigned long long fixed = relay(data);
+    adaptive->val(true);
+    unsigned long long adapted = relay(data);
+    MORDOR_LOG_INFO(Mordor::Log::root()) << megabytes << "MB relayed between "
+        << "sockets: " << fixed << "us (" << data.readAvailable() / (double)fixed
+        << " MB/s) fixed, " << adapted << "us ("
+        << data.readAvailable() / (double)adapted << " MB/s) adaptive";
+}
+
+#ifdef LINUX
+static ConfigVar<bool>::ptr zeroCopyEnabled()
+{
+    return boost::dynamic_pointer_cast<ConfigVar<bool> >(
+        Config::lookup("transferstream.zerocopy"));
+}
+
+static Stream::ptr tempFile(size_t size)
+{
+    std::string path("/tmp/mordorXXXXXX");
+    int fd = mkstemp(&path[0]);
+    if (fd < 0)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mkstemp");
+    unlink(path.c_str());
+    Stream::ptr file(new FDStream(fd));
+    std::string chunk = pattern(65536);
+    for (size_t written = 0; written < size;)
+        written += file->write(chunk.c_str(),
+            std::min(chunk.size(), size - written));
+    file->seek(0);
+    return file;
+}
+
+MORDOR_UNITTEST(TransferStream, zeroCopyFileToSocket)
+{
+    if (!zeroCopyEnabled()->val())
+        throw TestSkippedException();
+    CountStatistic<unsigned long long> &zeroCopied =
+        *Statistics::lookup<CountStatistic<unsigned long long> >(
+            "transferstream.zerocopy");
+    unsigned long long zeroCopiedBefore = zeroCopied.count;
+    const size_t size = 1024 * 1024 + 3;
+    Stream::ptr file = tempFile(size);
+    MemoryStream expected;
+    expected.write("headers", 7);
+    transferStream(file, expected);
+    file->seek(0);
+
+    IOManager ioManager;
+    Socket::ptr sender, receiver;
+    connectedSockets(ioManager, sender, receiver);
+    Buffer received;
+    ioManager.schedule(boost::bind(&receiveAll, receiver,
+        boost::ref(received), true));
+    // Layered the same as an HTTP response body, with the headers still
+    // buffered
+    BufferedStream::ptr buffered(new BufferedStream(
+        Stream::ptr(new SocketStream(sender))));
+    buffered->write("headers", 7);
+    LimitedStream::ptr limited(new LimitedStream(buffered, size));
+    limited->strict(true);
+    NotifyStream notify(limited);
+    MORDOR_TEST_ASSERT_EQUAL(transferStream(file, notify, size),
+        (unsigned long long)size);
+    // With io_uring, the socket is blocking, so it's copied instead
+    MORDOR_TEST_ASSERT_EQUAL(zeroCopied.count,
+        zeroCopiedBefore + (sender->canSendFile() ? size : 0));
+    MORDOR_TEST_ASSERT_EQUAL(limited->tell(), (long long)size);
+    MORDOR_TEST_ASSERT_EQUAL(file->tell(), (long long)size);
+
+    // Running out of file is still an error
+    file->seek(size - 3);
+    limited->reset(4);
+    MORDOR_TEST_ASSERT_EXCEPTION(transferStream(file, notify, 4),
+        UnexpectedEofException);
+    file->seek(size - 3);
+    transferStream(file, expected);
+
+    buffered->flush();
+    sender->shutdown();
+    ioManager.dispatch();
+    MORDOR_TEST_ASSERT(received == expected.buffer());
+}
+
+static unsigned long long transferToSocket(Stream &file, size_t size)
+{
+    IOManager ioManager;
+    Socket::ptr sender, receiver;
+    connectedSockets(ioManager, sender, receiver);
+    Buffer received;
+    ioManager.schedule(boost::bind(&receiveAll, receiver,
+        boost::ref(received), false));
+    SocketStream stream(sender);
+    file.seek(0);
+    unsigned long long start = TimerManager::now();
+    transferStream(file, stream, size);
+    sender->shutdown();
+    ioManager.dispatch();
+    return TimerManager::now() - start;
+}
+
+MORDOR_UNITTEST(TransferStream, zeroCopyPerformance)
+{
+#ifndef NDEBUG_PERF
+    size_t size = 16 * 1024 * 1024;
+#else
+    size_t size = 256 * 1024 * 1024;
+#endif
+    Stream::ptr file = tempFile(size);
+    ConfigVar<bool>::ptr zeroCopy = zeroCopyEnabled();
+    ConfigVarRestorer<bool> restoreZeroCopy(zeroCopy);
+    zeroCopy->val(false);
+    unsigned long long copied = transferToSocket(*file, size);
+    zeroCopy->val(true);
+    unsigned long long zeroCopied = transferToSocket(*file, size);
+    MORDOR_LOG_INFO(Mordor::Log::root()) << size << " bytes from a file to a "
+        << "socket: " << copied << "us (" << size / (double)copied
+        << " MB/s) copied, " << zeroCopied << "us ("
+        << size / (double)zeroCopied << " MB/s) zero-copy";
+}
+#endif
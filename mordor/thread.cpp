@@ -1,23 +1,37 @@
 // Copyright (c) 2010 - Mozy, Inc.
 
+#include <sstream>
+
+#include <boost/thread/thread.hpp>
+
 #include "assert.h"
 #include "fiber.h"
 #include "scheduler.h"
 #include "thread.h"
 
 #ifdef LINUX
+#include <fstream>
+#include <sched.h>
 #include <sys/prctl.h>
 #include <syscall.h>
+#include <unistd.h>
 #elif defined(WINDOWS)
 #include <process.h>
 #elif defined (OSX)
 #include <mach/mach_init.h>
 #endif
 
+#include "config.h"
 #include "exception.h"
 
 namespace Mordor {
 
+static ConfigVar<bool>::ptr g_numaLocalAlloc = Config::lookup(
+    "numa.localalloc", false,
+    "Prefer the NUMA node of the allocating thread for fiber stacks and "
+    "large Buffer segments, instead of the node of whichever thread first "
+    "touches them");
+
 tid_t gettid()
 {
 #ifdef WINDOWS
@@ -31,6 +45,161 @@ tid_t gettid()
 #endif
 }
 
+void setThreadAffinity(const std::vector<unsigned int> &cpus)
+{
+#ifdef WINDOWS
+    DWORD_PTR mask = 0;
+    for (size_t i = 0; i < cpus.size(); ++i) {
+        MORDOR_ASSERT(cpus[i] < sizeof(DWORD_PTR) * 8);
+        mask |= (DWORD_PTR)1 << cpus[i];
+    }
+    if (cpus.empty()) {
+        DWORD_PTR systemMask;
+        if (!GetProcessAffinityMask(GetCurrentProcess(), &mask, &systemMask))
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API(
+                "GetProcessAffinityMask");
+    }
+    if (!SetThreadAffinityMask(GetCurrentThread(), mask))
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("SetThreadAffinityMask");
+#elif defined(LINUX)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (cpus.empty()) {
+        // The kernel ignores CPUs that don't exist
+        for (int i = 0; i < CPU_SETSIZE; ++i)
+            CPU_SET(i, &set);
+    }
+    for (size_t i = 0; i < cpus.size(); ++i) {
+        MORDOR_ASSERT(cpus[i] < CPU_SETSIZE);
+        CPU_SET(cpus[i], &set);
+    }
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &set))
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("sched_setaffinity");
+#endif
+}
+
+unsigned int currentCpu()
+{
+#ifdef WINDOWS
+    return GetCurrentProcessorNumber();
+#elif defined(LINUX)
+    int cpu = sched_getcpu();
+    if (cpu < 0)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("sched_getcpu");
+    return (unsigned int)cpu;
+#else
+    return 0;
+#endif
+}
+
+#ifdef LINUX
+// Parses the kernel's list format, i.e. "0-3,8,10-11"
+static std::vector<unsigned int> parseCpuList(std::istream &is)
+{
+    std::vector<unsigned int> result;
+    unsigned int first, last;
+    while (is >> first) {
+        last = first;
+        if (is.peek() == '-') {
+            is.get();
+            is >> last;
+        }
+        for (unsigned int i = first; i <= last; ++i)
+            result.push_back(i);
+        if (is.peek() != ',')
+            break;
+        is.get();
+    }
+    return result;
+}
+#endif
+
+size_t numaNodeCount()
+{
+#ifdef WINDOWS
+    ULONG highest;
+    if (!GetNumaHighestNodeNumber(&highest))
+        return 1;
+    return highest + 1;
+#elif defined(LINUX)
+    std::ifstream is("/sys/devices/system/node/possible");
+    std::vector<unsigned int> nodes = parseCpuList(is);
+    return nodes.empty() ? 1 : nodes.back() + 1;
+#else
+    return 1;
+#endif
+}
+
+std::vector<unsigned int> numaNodeCpus(size_t node)
+{
+    std::vector<unsigned int> result;
+#ifdef WINDOWS
+    ULONGLONG mask;
+    if (GetNumaNodeProcessorMask((UCHAR)node, &mask)) {
+        for (unsigned int i = 0; i < 64; ++i)
+            if (mask & (1ull << i))
+                result.push_back(i);
+        return result;
+    }
+#elif defined(LINUX)
+    std::ostringstream path;
+    path << "/sys/devices/system/node/node" << node << "/cpulist";
+    std::ifstream is(path.str().c_str());
+    if (is)
+        return parseCpuList(is);
+#endif
+    // Not NUMA (or we can't tell); everything is on node 0
+    if (node == 0) {
+        unsigned int cpus = boost::thread::hardware_concurrency();
+        for (unsigned int i = 0; i < cpus; ++i)
+            result.push_back(i);
+    }
+    return result;
+}
+
+size_t currentNumaNode()
+{
+#ifdef WINDOWS
+    UCHAR node;
+    if (!GetNumaProcessorNode((UCHAR)GetCurrentProcessorNumber(), &node))
+        return 0;
+    return node;
+#elif defined(LINUX)
+    unsigned int cpu, node;
+    if (syscall(__NR_getcpu, &cpu, &node, NULL))
+        return 0;
+    return node;
+#else
+    return 0;
+#endif
+}
+
+void numaPreferLocal(void *start, size_t length)
+{
+#ifdef LINUX
+    if (!g_numaLocalAlloc->val())
+        return;
+    // Racy, but every thread computes the same answer
+    static int nodes = 0;
+    if (nodes == 0)
+        nodes = (int)numaNodeCount();
+    if (nodes == 1)
+        return;
+    static const size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t begin = ((size_t)start + pageSize - 1) & ~(pageSize - 1);
+    size_t end = ((size_t)start + length) & ~(pageSize - 1);
+    if (begin >= end)
+        return;
+    size_t node = currentNumaNode();
+    if (node >= sizeof(unsigned long) * 8)
+        return;
+    unsigned long mask = 1ul << node;
+    // MPOL_PREFERRED; <numaif.h> belongs to libnuma, which we don't need.
+    // This is only a hint, so failure isn't interesting.
+    syscall(__NR_mbind, begin, end - begin, 1, &mask, sizeof(mask) * 8, 0);
+#endif
+}
+
 #ifdef WINDOWS
 //
 // Usage: SetThreadName (-1, "MainThread");
@@ -3,6 +3,7 @@
 // Copyright (c) 2010 - Mozy, Inc.
 
 #include <iosfwd>
+#include <vector>
 
 #include <boost/function.hpp>
 #include <boost/noncopyable.hpp>
@@ -27,6 +28,28 @@ typedef pthread_t tid_t;
 inline tid_t emptytid() { return (tid_t)-1; }
 tid_t gettid();
 
+/// Bind the calling thread to a set of CPUs
+/// @param cpus The CPUs the thread may run on; if empty, it may run on any
+/// @note OS X has no way to bind a thread to a CPU; this is a no-op there
+void setThreadAffinity(const std::vector<unsigned int> &cpus);
+/// @return The CPU the calling thread is currently running on
+unsigned int currentCpu();
+
+/// @return The number of NUMA nodes; 1 if the machine isn't NUMA, or it can't
+/// be determined.  Nodes are numbered from 0, and some may have no CPUs.
+size_t numaNodeCount();
+/// @return The CPUs that belong to NUMA node @c node
+std::vector<unsigned int> numaNodeCpus(size_t node);
+/// @return The NUMA node of the CPU the calling thread is running on
+size_t currentNumaNode();
+/// Prefer the NUMA node of the calling thread for the pages of a memory range
+/// that haven't been touched yet
+///
+/// Only whole pages inside the range are affected.  Does nothing unless the
+/// numa.localalloc config var is set and the machine has more than one node
+/// (and on platforms other than Linux).
+void numaPreferLocal(void *start, size_t length);
+
 class Scheduler;
 
 class Thread : boost::noncopyable
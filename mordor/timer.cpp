@@ -35,9 +35,74 @@ static ConfigVar<unsigned long long>::ptr g_clockRolloverThreshold =
     Config::lookup<unsigned long long>("timer.clockrolloverthreshold", 5000000ULL,
     "Expire all timers if the clock goes backward by >= this amount");
 
+// Mirrors timer.coarseclock; a plain bool so now() is safe to call during
+// static initialization
+static bool g_useCoarseClock;
+static void setCoarseClock(bool coarse) { g_useCoarseClock = coarse; }
+
+static ConfigVar<bool>::ptr g_coarseClock =
+    Config::lookup("timer.coarseclock", false,
+    "Read now() from a cheaper clock that is only updated once per kernel "
+    "tick (Linux only)");
+
+namespace {
+static struct CoarseClockInitializer
+{
+    CoarseClockInitializer()
+    {
+        g_coarseClock->onChange.connect(&setCoarseClock);
+        setCoarseClock(g_coarseClock->val());
+    }
+} g_coarseClockInitializer;
+}
+
+static ConfigVar<unsigned long long>::ptr g_wheelResolution =
+    Config::lookup<unsigned long long>("timer.wheelresolution", 0ULL,
+    "If non-zero, new TimerManagers keep timers in a timer wheel with this "
+    "resolution (in microseconds), instead of an ordered set; timers may "
+    "then expire up to this late");
+
 static void
 stubOnTimer(boost::weak_ptr<void> weakCond, boost::function<void ()> dg);
 
+// The wheel is laid out like the Linux kernel's: 256 slots of one tick each,
+// then four levels of 64 slots, each slot spanning a whole revolution of the
+// level below, for 2^32 ticks in all.  Timers further out than that are
+// parked in the last slot, and re-linked when it comes around.
+static const unsigned int g_wheelLevels = 5;
+static const unsigned int g_wheelShift[g_wheelLevels + 1] =
+    { 0, 8, 14, 20, 26, 32 };
+
+static size_t
+wheelSlots(unsigned int level)
+{
+    return (size_t)1 << (g_wheelShift[level + 1] - g_wheelShift[level]);
+}
+
+struct TimerManager::Wheel
+{
+    Wheel(unsigned long long res)
+        : resolution(res),
+          current(0),
+          count(0),
+          reported(~0ull)
+    {
+        memset(levelCount, 0, sizeof(levelCount));
+        memset(slots, 0, sizeof(slots));
+    }
+
+    unsigned long long resolution;
+    /// The next tick to be expired
+    unsigned long long current;
+    size_t count;
+    size_t levelCount[g_wheelLevels];
+    /// The tick returned by the last nextTimer(), so registering anything
+    /// earlier wakes up whoever is waiting for it
+    unsigned long long reported;
+    // Levels above 0 only use the first 64 slots
+    Timer *slots[g_wheelLevels][256];
+};
+
 #ifdef WINDOWS
 static unsigned long long queryFrequency()
 {
@@ -79,19 +144,51 @@ TimerManager::now()
     return muldiv64(absoluteTime, g_timebase.numer, (uint64_t)g_timebase.denom * 1000);
 #else
     struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clockid_t clock = g_useCoarseClock ? CLOCK_MONOTONIC_COARSE :
+        CLOCK_MONOTONIC;
+#else
+    clockid_t clock = CLOCK_MONOTONIC;
+#endif
 
-    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    if (clock_gettime(clock, &ts))
         MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("clock_gettime");
     return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
 #endif
 }
 
+unsigned long long
+TimerManager::clockResolution()
+{
+    if (ms_clockDg)
+        return 1;
+#if defined(WINDOWS) || defined(OSX)
+    return 1;
+#else
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clockid_t clock = g_useCoarseClock ? CLOCK_MONOTONIC_COARSE :
+        CLOCK_MONOTONIC;
+#else
+    clockid_t clock = CLOCK_MONOTONIC;
+#endif
+    if (clock_getres(clock, &ts))
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("clock_getres");
+    unsigned long long result = ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+    return result ? result : 1;
+#endif
+}
+
 Timer::Timer(unsigned long long us, boost::function<void ()> dg, bool recurring,
              TimerManager *manager)
     : m_recurring(recurring),
       m_us(us),
       m_dg(dg),
-      m_manager(manager)
+      m_manager(manager),
+      m_wheelPrev(NULL),
+      m_wheelNext(NULL),
+      m_wheelSlot(NULL),
+      m_wheelLevel(0)
 {
     MORDOR_ASSERT(m_dg);
     m_next = TimerManager::now() + m_us;
@@ -108,10 +205,7 @@ Timer::cancel()
     boost::mutex::scoped_lock lock(m_manager->m_mutex);
     if (m_dg) {
         m_dg = NULL;
-        std::set<Timer::ptr, Timer::Comparator>::iterator it =
-            m_manager->m_timers.find(shared_from_this());
-        MORDOR_ASSERT(it != m_manager->m_timers.end());
-        m_manager->m_timers.erase(it);
+        m_manager->eraseTimer(shared_from_this());
         return true;
     }
     return false;
@@ -123,12 +217,10 @@ Timer::refresh()
     boost::mutex::scoped_lock lock(m_manager->m_mutex);
     if (!m_dg)
         return false;
-    std::set<Timer::ptr, Timer::Comparator>::iterator it =
-        m_manager->m_timers.find(shared_from_this());
-    MORDOR_ASSERT(it != m_manager->m_timers.end());
-    m_manager->m_timers.erase(it);
+    Timer::ptr self = shared_from_this();
+    m_manager->eraseTimer(self);
     m_next = TimerManager::now() + m_us;
-    m_manager->m_timers.insert(shared_from_this());
+    m_manager->insertTimer(self);
     lock.unlock();
     MORDOR_LOG_DEBUG(g_log) << this << " refresh";
     return true;
@@ -143,10 +235,8 @@ Timer::reset(unsigned long long us, bool fromNow)
     // No change
     if (us == m_us && !fromNow)
         return true;
-    std::set<Timer::ptr, Timer::Comparator>::iterator it =
-        m_manager->m_timers.find(shared_from_this());
-    MORDOR_ASSERT(it != m_manager->m_timers.end());
-    m_manager->m_timers.erase(it);
+    Timer::ptr self = shared_from_this();
+    m_manager->eraseTimer(self);
     unsigned long long start;
     if (fromNow)
         start = TimerManager::now();
@@ -154,8 +244,7 @@ Timer::reset(unsigned long long us, bool fromNow)
         start = m_next - m_us;
     m_us = us;
     m_next = start + m_us;
-    it = m_manager->m_timers.insert(shared_from_this()).first;
-    bool atFront = (it == m_manager->m_timers.begin()) && !m_manager->m_tickled;
+    bool atFront = m_manager->insertTimer(self) && !m_manager->m_tickled;
     if (atFront)
         m_manager->m_tickled = true;
     lock.unlock();
@@ -166,7 +255,17 @@ Timer::reset(unsigned long long us, bool fromNow)
 }
 
 TimerManager::TimerManager()
-: m_tickled(false),
+: m_wheel(NULL),
+  m_tickled(false),
+  m_previousTime(0ull)
+{
+    if (g_wheelResolution->val())
+        m_wheel = new Wheel(g_wheelResolution->val());
+}
+
+TimerManager::TimerManager(unsigned long long wheelResolution)
+: m_wheel(wheelResolution ? new Wheel(wheelResolution) : NULL),
+  m_tickled(false),
   m_previousTime(0ull)
 {}
 
@@ -175,7 +274,157 @@ TimerManager::~TimerManager()
 #ifndef NDEBUG
     boost::mutex::scoped_lock lock(m_mutex);
     MORDOR_ASSERT(m_timers.empty());
+    MORDOR_ASSERT(!m_wheel || !m_wheel->count);
 #endif
+    if (m_wheel) {
+        // Break the self references of anything left over
+        std::vector<Timer::ptr> timers;
+        for (unsigned int level = 0; level < g_wheelLevels; ++level)
+            for (size_t i = 0; i < wheelSlots(level); ++i)
+                wheelTake(m_wheel->slots[level][i], timers);
+        delete m_wheel;
+    }
+}
+
+bool
+TimerManager::insertTimer(const Timer::ptr &timer)
+{
+    if (m_wheel) {
+        // Nothing to keep in step with; start from now, so an idle wheel
+        // doesn't have to catch up
+        if (!m_wheel->count)
+            m_wheel->current = now() / m_wheel->resolution;
+        timer->m_wheelSelf = timer;
+        unsigned long long tick = wheelLink(timer.get());
+        if (tick >= m_wheel->reported)
+            return false;
+        m_wheel->reported = tick;
+        return true;
+    }
+    std::set<Timer::ptr, Timer::Comparator>::iterator it =
+        m_timers.insert(timer).first;
+    return it == m_timers.begin();
+}
+
+void
+TimerManager::eraseTimer(const Timer::ptr &timer)
+{
+    if (m_wheel) {
+        wheelUnlink(timer.get());
+        timer->m_wheelSelf.reset();
+        return;
+    }
+    std::set<Timer::ptr, Timer::Comparator>::iterator it =
+        m_timers.find(timer);
+    MORDOR_ASSERT(it != m_timers.end());
+    m_timers.erase(it);
+}
+
+unsigned long long
+TimerManager::wheelLink(Timer *timer)
+{
+    Wheel &wheel = *m_wheel;
+    // Round up, so timers never expire early
+    unsigned long long tick = timer->m_next / wheel.resolution +
+        (timer->m_next % wheel.resolution ? 1 : 0);
+    if (tick < wheel.current)
+        tick = wheel.current;
+    unsigned long long delta = tick - wheel.current;
+    if (delta >> g_wheelShift[g_wheelLevels]) {
+        delta = (1ull << g_wheelShift[g_wheelLevels]) - 1;
+        tick = wheel.current + delta;
+    }
+    unsigned int level = 0;
+    while (delta >> g_wheelShift[level + 1])
+        ++level;
+    Timer *&slot = wheel.slots[level][(tick >> g_wheelShift[level]) &
+        (wheelSlots(level) - 1)];
+    timer->m_wheelPrev = NULL;
+    timer->m_wheelNext = slot;
+    if (slot)
+        slot->m_wheelPrev = timer;
+    slot = timer;
+    timer->m_wheelSlot = &slot;
+    timer->m_wheelLevel = level;
+    ++wheel.count;
+    ++wheel.levelCount[level];
+    return tick;
+}
+
+void
+TimerManager::wheelUnlink(Timer *timer)
+{
+    MORDOR_ASSERT(timer->m_wheelSlot);
+    if (timer->m_wheelPrev)
+        timer->m_wheelPrev->m_wheelNext = timer->m_wheelNext;
+    else
+        *timer->m_wheelSlot = timer->m_wheelNext;
+    if (timer->m_wheelNext)
+        timer->m_wheelNext->m_wheelPrev = timer->m_wheelPrev;
+    timer->m_wheelPrev = timer->m_wheelNext = NULL;
+    timer->m_wheelSlot = NULL;
+    --m_wheel->count;
+    --m_wheel->levelCount[timer->m_wheelLevel];
+}
+
+void
+TimerManager::wheelCascade(unsigned int level)
+{
+    Wheel &wheel = *m_wheel;
+    size_t index = (wheel.current >> g_wheelShift[level]) &
+        (wheelSlots(level) - 1);
+    Timer *timer = wheel.slots[level][index];
+    while (timer) {
+        Timer *next = timer->m_wheelNext;
+        wheelUnlink(timer);
+        wheelLink(timer);
+        timer = next;
+    }
+    if (index == 0 && level + 1 < g_wheelLevels)
+        wheelCascade(level + 1);
+}
+
+void
+TimerManager::wheelTake(Timer *&slot, std::vector<Timer::ptr> &timers)
+{
+    while (slot) {
+        Timer *timer = slot;
+        wheelUnlink(timer);
+        timers.push_back(Timer::ptr());
+        timers.back().swap(timer->m_wheelSelf);
+    }
+}
+
+unsigned long long
+TimerManager::wheelNextTick() const
+{
+    const Wheel &wheel = *m_wheel;
+    // A level's timers are only further out than the lower levels' relative
+    // to when they were linked; one linked into level 1 long ago can be due
+    // before one linked into level 0 just now.  So take the earliest of
+    // each level's first occupied slot.  Above level 0, a slot spans many
+    // ticks, so report its start; it will be cascaded down then.
+    unsigned long long result = ~0ull;
+    for (unsigned int level = 0; level < g_wheelLevels; ++level) {
+        unsigned long long base = wheel.current >> g_wheelShift[level];
+        // Nothing at this level or above can come before its next slot
+        if (level && result <= (base + 1) << g_wheelShift[level])
+            break;
+        if (!wheel.levelCount[level])
+            continue;
+        size_t slots = wheelSlots(level);
+        // The current slot of a higher level was cascaded when we entered
+        // it, so anything there is a whole revolution out
+        size_t i = level ? 1 : 0;
+        for (; i <= slots; ++i) {
+            if (wheel.slots[level][(base + i) & (slots - 1)])
+                break;
+        }
+        MORDOR_ASSERT(i <= slots);
+        result = std::min(result,
+            level ? (base + i) << g_wheelShift[level] : base + i);
+    }
+    return result;
 }
 
 Timer::ptr
@@ -185,9 +434,7 @@ TimerManager::registerTimer(unsigned long long us, boost::function<void ()> dg,
     MORDOR_ASSERT(dg);
     Timer::ptr result(new Timer(us, dg, recurring, this));
     boost::mutex::scoped_lock lock(m_mutex);
-    std::set<Timer::ptr, Timer::Comparator>::iterator it =
-        m_timers.insert(result).first;
-    bool atFront = (it == m_timers.begin()) && !m_tickled;
+    bool atFront = insertTimer(result) && !m_tickled;
     if (atFront)
         m_tickled = true;
     lock.unlock();
@@ -226,6 +473,19 @@ TimerManager::nextTimer()
 {
     boost::mutex::scoped_lock lock(m_mutex);
     m_tickled = false;
+    if (m_wheel) {
+        if (!m_wheel->count) {
+            m_wheel->reported = ~0ull;
+            MORDOR_LOG_DEBUG(g_log) << this << " nextTimer(): ~0ull";
+            return ~0ull;
+        }
+        m_wheel->reported = wheelNextTick();
+        unsigned long long next = m_wheel->reported * m_wheel->resolution;
+        unsigned long long nowUs = now();
+        unsigned long long result = nowUs >= next ? 0 : next - nowUs;
+        MORDOR_LOG_DEBUG(g_log) << this << " nextTimer(): " << result;
+        return result;
+    }
     if (m_timers.empty()) {
         MORDOR_LOG_DEBUG(g_log) << this << " nextTimer(): ~0ull";
         return ~0ull;
@@ -269,20 +529,26 @@ TimerManager::processTimers()
     unsigned long long nowUs = now();
     {
         boost::mutex::scoped_lock lock(m_mutex);
-        if (m_timers.empty())
-            return result;
-        bool rollover = detectClockRollover(nowUs);
-        if (!rollover && (*m_timers.begin())->m_next > nowUs)
-            return result;
-        Timer nowTimer(nowUs);
-        Timer::ptr nowTimerPtr(&nowTimer, &nop<Timer *>);
-        // Find all timers that are expired
-        std::set<Timer::ptr, Timer::Comparator>::iterator it =
-            rollover ? m_timers.end() : m_timers.lower_bound(nowTimerPtr);
-        while (it != m_timers.end() && (*it)->m_next == nowUs ) ++it;
-        // Copy to expired, remove from m_timers;
-        expired.insert(expired.begin(), m_timers.begin(), it);
-        m_timers.erase(m_timers.begin(), it);
+        if (m_wheel) {
+            if (!m_wheel->count)
+                return result;
+            wheelExpire(nowUs, detectClockRollover(nowUs), expired);
+        } else {
+            if (m_timers.empty())
+                return result;
+            bool rollover = detectClockRollover(nowUs);
+            if (!rollover && (*m_timers.begin())->m_next > nowUs)
+                return result;
+            Timer nowTimer(nowUs);
+            Timer::ptr nowTimerPtr(&nowTimer, &nop<Timer *>);
+            // Find all timers that are expired
+            std::set<Timer::ptr, Timer::Comparator>::iterator it =
+                rollover ? m_timers.end() : m_timers.lower_bound(nowTimerPtr);
+            while (it != m_timers.end() && (*it)->m_next == nowUs ) ++it;
+            // Copy to expired, remove from m_timers;
+            expired.insert(expired.begin(), m_timers.begin(), it);
+            m_timers.erase(m_timers.begin(), it);
+        }
         result.reserve(expired.size());
         // Look at expired timers and re-register recurring timers
         // (while under the same lock)
@@ -295,7 +561,7 @@ TimerManager::processTimers()
             if (timer->m_recurring) {
                 MORDOR_LOG_TRACE(g_log) << timer << " expired and refreshed";
                 timer->m_next = nowUs + timer->m_us;
-                m_timers.insert(timer);
+                insertTimer(timer);
             } else {
                 MORDOR_LOG_TRACE(g_log) << timer << " expired";
                 timer->m_dg = NULL;
@@ -305,6 +571,31 @@ TimerManager::processTimers()
     return result;
 }
 
+void
+TimerManager::wheelExpire(unsigned long long nowUs, bool rollover,
+    std::vector<Timer::ptr> &expired)
+{
+    Wheel &wheel = *m_wheel;
+    if (rollover) {
+        for (unsigned int level = 0; level < g_wheelLevels; ++level)
+            for (size_t i = 0; i < wheelSlots(level); ++i)
+                wheelTake(wheel.slots[level][i], expired);
+        return;
+    }
+    unsigned long long target = nowUs / wheel.resolution;
+    while (wheel.current <= target && wheel.count) {
+        if (wheel.levelCount[0]) {
+            wheelTake(wheel.slots[0][wheel.current & 255], expired);
+            ++wheel.current;
+        } else {
+            // Nothing to expire until the next level 0 revolution
+            wheel.current = std::min(target + 1, (wheel.current | 255) + 1);
+        }
+        if (!(wheel.current & 255))
+            wheelCascade(1);
+    }
+}
+
 void
 TimerManager::executeTimers()
 {
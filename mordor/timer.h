@@ -49,6 +49,12 @@ private:
     unsigned long long m_us;
     boost::function<void ()> m_dg;
     TimerManager *m_manager;
+    // Only used if m_manager has a timer wheel; the wheel's slots link
+    // timers intrusively, and a timer keeps itself alive while it's linked
+    Timer::ptr m_wheelSelf;
+    Timer *m_wheelPrev, *m_wheelNext;
+    Timer **m_wheelSlot;
+    unsigned int m_wheelLevel;
 
 private:
     struct Comparator
@@ -58,11 +64,24 @@ private:
 
 };
 
+/// Keeps a set of Timers, and runs them when they expire
+
+/// Timers are normally kept in an ordered set, so they expire exactly on time,
+/// but registering, refreshing or cancelling one is O(log n).  Alternatively,
+/// a TimerManager can keep them in a hierarchical timer wheel, where each of
+/// those is O(1), at the cost of timers expiring up to one wheel tick late
+/// (never early).  The wheel is the better choice for huge numbers of coarse
+/// timeouts (i.e. one per connection), that are mostly refreshed or
+/// cancelled, rather than expire.
 class TimerManager : public boost::noncopyable
 {
     friend class Timer;
 public:
+    /// Uses a timer wheel if timer.wheelresolution is non-zero
     TimerManager();
+    /// @param wheelResolution The timer wheel's tick, in microseconds; 0 to
+    /// use an ordered set instead
+    explicit TimerManager(unsigned long long wheelResolution);
     virtual ~TimerManager();
 
     virtual Timer::ptr registerTimer(unsigned long long us,
@@ -87,7 +106,18 @@ public:
     /// however, the difference between two successive calls to now() is
     /// equal to the time that elapsed between calls.  This is true even if the
     /// system clock is changed.
+    ///
+    /// If timer.coarseclock is set (only effective on Linux), the clock is
+    /// CLOCK_MONOTONIC_COARSE, which is cheaper to read but only advances
+    /// once per kernel tick; it can lag the precise clock by up to
+    /// clockResolution() (typically 1 to 4 ms).  Timers are both started and
+    /// expired against that clock, so measured in real time, one can then
+    /// expire up to that much early (if it was started just before a tick)
+    /// or late (if it comes due just after one).
     static unsigned long long now();
+    /// @return The granularity of now(), in microseconds; i.e. how far it can
+    /// lag behind the true time
+    static unsigned long long clockResolution();
 
     /// replace the built-in clock
     /// @param dg replacement function whose value will be returned by now()
@@ -100,9 +130,31 @@ protected:
     std::vector<boost::function<void ()> > processTimers();
 
 private:
+    struct Wheel;
+
     static boost::function<unsigned long long ()> ms_clockDg;
     bool detectClockRollover(unsigned long long nowUs);
+    /// @return If the timer is now the first to expire
+    /// @pre m_mutex is held
+    bool insertTimer(const Timer::ptr &timer);
+    /// @pre m_mutex is held
+    void eraseTimer(const Timer::ptr &timer);
+    /// @return The tick the timer was linked into
+    unsigned long long wheelLink(Timer *timer);
+    void wheelUnlink(Timer *timer);
+    /// Re-link everything in the current slot of @c level, and the levels
+    /// above that wrapped
+    void wheelCascade(unsigned int level);
+    /// Unlink everything that expires by @c nowUs (or everything, if the
+    /// clock rolled back), and append it to @c expired
+    void wheelExpire(unsigned long long nowUs, bool rollover,
+        std::vector<Timer::ptr> &expired);
+    /// Unlink everything in a slot, and append it to @c timers
+    void wheelTake(Timer *&slot, std::vector<Timer::ptr> &timers);
+    /// @return The earliest tick at which something may expire
+    unsigned long long wheelNextTick() const;
     std::set<Timer::ptr, Timer::Comparator> m_timers;
+    Wheel *m_wheel;
     boost::mutex m_mutex;
     bool m_tickled;
     unsigned long long m_previousTime;
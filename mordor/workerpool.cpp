@@ -2,6 +2,13 @@
 
 #include "workerpool.h"
 
+#ifdef LINUX
+#include <linux/futex.h>
+#include <syscall.h>
+#endif
+
+#include "atomic.h"
+#include "exception.h"
 #include "fiber.h"
 #include "log.h"
 
@@ -11,6 +18,10 @@ static Logger::ptr g_log = Log::lookup("mordor:workerpool");
 
 WorkerPool::WorkerPool(size_t threads, bool useCaller, size_t batchSize)
     : Scheduler(threads, useCaller, batchSize)
+#ifdef LINUX
+    , m_epoch(0),
+      m_sleepers(0)
+#endif
 {
     start();
 }
@@ -18,11 +29,33 @@ WorkerPool::WorkerPool(size_t threads, bool useCaller, size_t batchSize)
 void
 WorkerPool::idle()
 {
+#ifdef LINUX
+    // We can't know whether we were tickled before we got here, so go back
+    // around the scheduling loop once; after that, it only ever runs after
+    // we've taken note of m_epoch
+    int seen = m_epoch - 1;
+#endif
     while (true) {
         if (stopping()) {
             return;
         }
+#ifdef LINUX
+        // Announce that we're about to sleep before the final check of
+        // m_epoch; tickle() bumps m_epoch before checking m_sleepers, so
+        // one of us is sure to see the other
+        atomicIncrement(m_sleepers);
+        while (m_epoch == seen) {
+            if (syscall(SYS_futex, &m_epoch, FUTEX_WAIT_PRIVATE, seen, NULL,
+                NULL, 0) && errno != EAGAIN && errno != EINTR) {
+                atomicDecrement(m_sleepers);
+                MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("futex");
+            }
+        }
+        atomicDecrement(m_sleepers);
+        seen = m_epoch;
+#else
         m_semaphore.wait();
+#endif
         try {
             Fiber::yield();
         } catch (OperationAbortedException &) {
@@ -35,7 +68,14 @@ void
 WorkerPool::tickle()
 {
     MORDOR_LOG_DEBUG(g_log) << this << " tickling";
+#ifdef LINUX
+    atomicIncrement(m_epoch);
+    if (m_sleepers != 0 && syscall(SYS_futex, &m_epoch, FUTEX_WAKE_PRIVATE,
+        1, NULL, NULL, 0) < 0)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("futex");
+#else
     m_semaphore.notify();
+#endif
 }
 
 }
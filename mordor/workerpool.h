@@ -18,15 +18,26 @@ public:
     ~WorkerPool() { stop(); }
 
 protected:
-    /// The idle Fiber for a WorkerPool simply loops waiting on a Semaphore,
-    /// and yields whenever that Semaphore is signalled, returning if
-    /// stopping() is true.
+    /// The idle Fiber for a WorkerPool simply loops waiting to be tickled,
+    /// and yields whenever it is, returning if stopping() is true.
     void idle();
-    /// Signals the semaphore so that the idle Fiber will yield.
+    /// Wakes up an idle Fiber so that it will yield.
+    ///
+    /// On Linux, this is an eventcount on a futex: tickling bumps a counter,
+    /// and only makes a system call if there is a thread actually asleep
+    /// waiting for it.  Threads that are busy notice the change the next
+    /// time they go idle, and go back to the Scheduler instead of sleeping,
+    /// so any number of tickles while they were busy cost one extra trip
+    /// through the scheduling loop.  Elsewhere it is a Semaphore.
     void tickle();
 
 private:
+#ifdef LINUX
+    volatile int m_epoch;
+    volatile int m_sleepers;
+#else
     Semaphore m_semaphore;
+#endif
 };
 
 }